@@ -3,26 +3,53 @@
 #include "core.h"
 #include "program.h"
 #include "program_builder.h"
+#include "module.h"
+#include "debug_info.h"
 
+// Goes up whenever the same source starts assembling to different bytes (a new fusion,
+// a new encoding), so modules and cached programs from an older assembler get rebuilt
+#define ASSEMBLER_REVISION 1
+
+// Tokens are views into `code`, so reading them doesn't allocate. The only
+// copies go to `scratch`, for escaped string literals, and to the names of `labels`.
 typedef struct {
     char *code;
     usize count;
     usize current_pos;
 
-    HashMap labels;
+    SymbolTable labels; // Label name -> label id
+    SymbolTable exports; // Names in `.export` lines
+    StringBuffer scratch;
+    bool optimize; // Run the peephole optimizer before building the Program
+    usize eliminated; // Instructions the optimizer removed, filled by assemble()
+
+    // Filled with the line and label of every instruction, when it's set
+    DebugInfo *debug_info;
+    usize line;             // Of `lines_counted_to`, from 1
+    usize lines_counted_to;
 } Assembler;
 
 void init_assembler(Assembler *assembler);
 void free_assembler(Assembler *assembler);
 void assemble_ignore_spaces(Assembler *assembler);
 
-HashEntry *assemble_label_literal(Assembler *assembler, bool *exists);
+Symbol *assemble_label_literal(Assembler *assembler, bool *exists);
 u64 assemble_u64_literal(Assembler *assembler);
-StringBuffer assemble_string_literal(Assembler *assembler);
+// The unescaped literal, in the scratch buffer until the next token that uses it
+StringView assemble_string_literal(Assembler *assembler);
 
-void resolve_instruction(Assembler*, StringBuffer*, ProgramBuilder*);
+void resolve_instruction(Assembler*, StringView mnemonic, ProgramBuilder*);
 Program assemble(Assembler *assembler);
+// Reads every token the way assemble() does without building anything, and returns how
+// many instructions there are. With `intern_labels` the label names go into `labels` too.
+usize scan_source(Assembler *assembler, bool intern_labels);
+// Assembles the code as a relocatable module instead, see module.h
+void assemble_module(Assembler *assembler, Module *module);
 
-Program assemble_file(char *input_file);
+// `eliminated` gets how many instructions the optimizer removed, unless it's NULL
+Program assemble_source(char *source, usize size, bool optimize, usize *eliminated);
+Program assemble_file(char *input_file, bool optimize, usize *eliminated);
+// Without the optimizer, so every instruction stays where its line put it
+Program assemble_file_with_debug_info(char *input_file, DebugInfo *info);
 
 #endif //ndef ASSEMBLER_H
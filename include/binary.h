@@ -0,0 +1,67 @@
+#ifndef BINARY_H
+#define BINARY_H
+#include "core.h"
+#include "program.h"
+
+// On-disk format of an assembled program, little-endian:
+//   BinaryHeader
+//   code      the bytecode, string literals included since STR carries them inline
+//   rodata    read-only constants that go with the code
+//   symbols   optional, BinarySymbolEntry records each followed by its name
+// Every section starts 16-byte aligned. The checksum covers the whole file, the
+// header included with its checksum zeroed, so a loaded file is only validated once.
+#define BINARY_MAGIC "CVMB"
+#define BINARY_VERSION 2
+#define BINARY_ALIGNMENT 16
+
+typedef struct {
+    u64 offset; // From the start of the file
+    u64 size;
+} BinarySection;
+
+typedef struct {
+    char magic[4];
+    u16 version;
+    u16 header_size;
+    u64 entry;      // Byte offset in the code where execution starts
+    u64 checksum;
+    BinarySection code;
+    BinarySection rodata;
+    BinarySection symbols;
+} BinaryHeader;
+
+typedef struct {
+    u64 address;
+    u32 name_length;
+    u32 padding;
+} BinarySymbolEntry;
+
+// A label of the program. Loaded names point into the file and aren't NUL-terminated.
+typedef struct {
+    u64 address;
+    const char *name;
+    usize name_length;
+} BinarySymbol;
+
+typedef struct {
+    Program program;    // Owns the file contents, everything else points into them
+    const u8 *rodata;
+    usize rodata_size;
+    BinarySymbol *symbols;
+    usize symbols_count;
+} BinaryFile;
+
+u64 binary_checksum(const u8 *data, usize size);
+
+// Raises an error when the file can't be written
+void write_binary_file(const char *file_path, Program *program, const u8 *rodata, usize rodata_size,
+                       const BinarySymbol *symbols, usize symbols_count);
+
+// Maps the file and runs it from there, raising an error for anything that
+// isn't a valid file of this version
+void load_binary_file(const char *file_path, BinaryFile *binary);
+// Same as load_binary_file(), for malloc()'d contents. The BinaryFile takes `data`.
+void read_binary(u8 *data, usize size, BinaryFile *binary);
+void free_binary_file(BinaryFile *binary);
+
+#endif // BINARY_H
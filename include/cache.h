@@ -0,0 +1,16 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include "core.h"
+#include "program.h"
+
+// Assembled programs saved as binaries (see binary.h), named after a hash and the size of
+// their source and the assembler revision, so running an unchanged source again skips the
+// assembler. The hash only picks the entry: it keeps a copy of the source, and it's only
+// used when that's the same as the one being run.
+// They go to $CVM_CACHE_DIR, $XDG_CACHE_HOME/cvm or ~/.cache/cvm, whichever is set
+// first. A cache that can't be used is skipped, never an error.
+
+// `eliminated` is the same as for assemble_file(), kept in the entry for when it's a hit
+Program assemble_file_cached(char *input_file, bool optimize, usize *eliminated);
+
+#endif // CACHE_H
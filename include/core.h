@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <setjmp.h>
 
 #ifndef DEBUG
 #define DEBUG 0
@@ -19,16 +20,49 @@
 
 #define LOG(x...) do { if (DEBUG) { printf("INFO: " x); } } while(0)
 #define VERBOSE_LOG(x...) do { if (VERBOSE) { printf("INFO: " x); } } while(0)
-#define ERROR(x...) printf(AT"Error: " x); exit(-1)
-#define TODO(x...) printf(AT"Not implemented: " x); exit(-1)
-#define ASSERT(condition, x...) do { if (!(condition)) { printf(AT "Assertion Error [" #condition "]: " x); exit(-1); } } while(0)
+#define ERROR(x...) raise_error(AT"Error: " x)
+#define TODO(x...) raise_error(AT"Not implemented: " x)
+#define ASSERT(condition, x...) do { if (!(condition)) { raise_error(AT "Assertion Error [" #condition "]: " x); } } while(0)
+
+// Errors print their message and exit, unless the thread that raised them set
+// `error_trap`: then the message is kept in it and execution jumps back to it.
+// Lets a VM fail a single run without taking the whole process down.
+typedef struct {
+    sigjmp_buf jump;
+    char message[256];
+} ErrorTrap;
+
+extern _Thread_local ErrorTrap *error_trap;
+// Runs before an error is reported, to get out the output buffered so far
+extern _Thread_local void (*before_error)(void);
+
+#if defined(__GNUC__)
+__attribute__((format(printf, 1, 2)))
+#endif
+_Noreturn void raise_error(const char *format, ...);
 
 // Int types
 #define u8 u_int8_t
 #define u64 u_int64_t
 #define u32 u_int32_t
+#define u16 u_int16_t
 #define usize size_t
 
+// Built with -DCOUNT_ALLOCATIONS=1, the malloc(), calloc() and realloc() calls of every file
+// that includes this one are counted in `allocation_count`, for the benchmarks
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS 0
+#endif // COUNT_ALLOCATIONS
+#if COUNT_ALLOCATIONS
+extern _Atomic usize allocation_count;
+void *counted_malloc(usize size);
+void *counted_calloc(usize count, usize size);
+void *counted_realloc(void *pointer, usize size);
+#define malloc(size) counted_malloc(size)
+#define calloc(count, size) counted_calloc(count, size)
+#define realloc(pointer, size) counted_realloc(pointer, size)
+#endif // COUNT_ALLOCATIONS
+
 // Float types
 #define f32 float32_t
 #define f64 float64_t
@@ -44,6 +78,12 @@ typedef struct {
     char* str;
 } StringBuffer;
 
+// A slice of some other string, not NUL-terminated
+typedef struct {
+    const char *str;
+    usize count;
+} StringView;
+
 StringBuffer create_string_buffer(usize initial_capacity);
 void init_string_buffer(StringBuffer* buffer, usize initial_capacity);
 void free_string_buffer(StringBuffer* buffer);
@@ -56,28 +96,36 @@ void append_char_string_buffer(StringBuffer* buffer, char c);
 // String functions
 bool strbeingswith(char* str, char* prefix);
 
+// SymbolTable
+// Maps names to u64 values. Names are interned: copied once, NUL-terminated, into
+// one growing buffer, and the slots only keep where they start, so growing the
+// table never copies them. Slots cache the hash of their name, and are probed
+// Robin Hood style so no name ends up far from its home slot.
 typedef struct {
-    bool taken;
-    StringBuffer key;
+    u64 hash;         // 0 for an empty slot
+    u32 name_offset;  // Into `names`
+    u32 name_length;
     u64 value;
-} HashEntry;
+} Symbol;
 
-// HashMap
 typedef struct {
-    usize capacity;
-    u32 capacity_prime_index;
-    HashEntry *data;
+    Symbol *slots;
+    usize capacity;   // Always a power of two
     usize count;
-} HashMap;
+    StringBuffer names;
+} SymbolTable;
 
-HashMap create_hash_map(void);
-void init_hash_map(HashMap* map);
-void free_hash_map(HashMap* map);
+void init_symbol_table(SymbolTable *table);
+void free_symbol_table(SymbolTable *table);
 
-void grow_hash_map(HashMap* map);
+u64 hash_bytes(const char *str, usize length);
 
-HashEntry *find_entry(HashMap* map, char* key); // FIXME: Accept StringBuffer too?
-HashEntry *insert_hash_map(HashMap* map, char* key, u64 value);
+// Keys don't need to be NUL-terminated.
+// The Symbol pointers they return are only good until the next intern_symbol().
+Symbol *find_symbol(SymbolTable *table, const char *key, usize length);
+// The symbol for the key, added with `value` if it wasn't there
+Symbol *intern_symbol(SymbolTable *table, const char *key, usize length, u64 value, bool *existed);
+const char *symbol_name(SymbolTable *table, Symbol *symbol);
 
 char* read_all_from_file(const char *file_path, usize *length);
 #endif // CORE_H
@@ -0,0 +1,45 @@
+#ifndef DEBUG_INFO_H
+#define DEBUG_INFO_H
+#include "core.h"
+
+// Where the code of a Program came from, filled by the assembler when it's asked to.
+// Lines are kept as ranges: an entry covers the code from its address up to the
+// next one, so a line only takes an entry when the line or the label changes.
+typedef struct {
+    u64 address;
+    u32 line;   // From 1
+    u32 label;  // Index in `labels`, NO_DEBUG_LABEL before the first one
+} LineEntry;
+
+#define NO_DEBUG_LABEL ((u32) -1)
+
+typedef struct {
+    u64 address;
+    u32 name_offset; // In `names`, NUL-terminated
+    u32 name_length;
+} DebugLabel;
+
+typedef struct {
+    const char *file;
+    LineEntry *lines;   // Sorted by address
+    usize lines_count;
+    usize lines_capacity;
+    DebugLabel *labels; // Sorted by address
+    usize labels_count;
+    usize labels_capacity;
+    StringBuffer names;
+} DebugInfo;
+
+void init_debug_info(DebugInfo *info, const char *file);
+void free_debug_info(DebugInfo *info);
+
+// Both have to be added in the order of the code
+void add_debug_line(DebugInfo *info, u64 address, u32 line);
+void add_debug_label(DebugInfo *info, u64 address, const char *name, usize length);
+
+// The entry covering `address`, NULL before the first one
+const LineEntry *find_debug_line(const DebugInfo *info, u64 address);
+// The name of the label `address` is under, or NULL
+const char *find_debug_label(const DebugInfo *info, u64 address);
+
+#endif // DEBUG_INFO_H
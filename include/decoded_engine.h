@@ -0,0 +1,222 @@
+// Body of the decoded interpreter. vm.c includes it once per variant, with
+// DECODED_ENGINE_NAME set to the function to define and CHECK_FRAMES picking
+// whether pops are checked against the frame. No include guard on purpose.
+#ifndef DECODED_ENGINE_NAME
+#error "DECODED_ENGINE_NAME must be defined before including decoded_engine.h"
+#endif
+
+// Threaded interpreter over a DecodedProgram. Immediates come from the decoded
+// instruction and jumps go to instruction indices; byte addresses only show up for
+// targets that were computed at runtime, and go through decoded->index_of.
+void DECODED_ENGINE_NAME(VM *vm, DecodedProgram *decoded) {
+    ASSERT(decoded->memory == vm->memory.model, "The program was decoded for another memory model\n");
+
+    DecodedInstruction *const instructions = decoded->instructions;
+
+    // The handlers are resolved once per DecodedProgram. The HLT sentinel tells
+    // whether it was this engine that resolved them.
+    if (instructions[decoded->count].handler != &&op_HLT) {
+        void *dispatch_table[DECODED_OPCODE_LIMIT];
+        for (usize i = 0; i < DECODED_OPCODE_LIMIT; i++) {
+            dispatch_table[i] = &&op_invalid;
+        }
+        #define X(name, val) dispatch_table[name] = &&op_fallback;
+        OPCODES
+        #undef X
+        #define X(name) dispatch_table[name] = &&op_##name;
+        DECODED_ENGINE_OPCODES
+        #undef X
+        #define X(name, val) dispatch_table[name] = &&op_##name;
+        DECODED_OPCODES
+        #undef X
+
+        for (usize i = 0; i <= decoded->count; i++) {
+            instructions[i].handler = dispatch_table[instructions[i].opcode];
+        }
+    }
+
+    u8 *storage = vm->stack.storage;
+    usize sp = vm->stack.sp;
+    usize frame_start = current_frame_start(&vm->call_stack);
+    u8 *tos_home = storage - sizeof(u64);
+    u64 tos;
+    RELOAD_TOS();
+    u32 entry = decoded_index_of(decoded, vm->pc);
+    ASSERT(entry != NO_INSTRUCTION, "Entry point %#zx is not an instruction boundary\n", vm->pc);
+    DecodedInstruction *ip = &instructions[entry];
+
+    #define DISPATCH() do { \
+        ip++; \
+        goto *ip->handler; \
+    } while(0)
+    #define JUMP_TO_INDEX(index) do { \
+        ip = &instructions[(index)]; \
+        goto *ip->handler; \
+    } while(0)
+    #define JUMP_TO_ADDRESS(address) do { \
+        u64 address_ = (address); \
+        u32 index_ = decoded_index_of(decoded, address_); \
+        ASSERT(index_ != NO_INSTRUCTION, "Jump target %#llx is not an instruction boundary\n", address_); \
+        JUMP_TO_INDEX(index_); \
+    } while(0)
+    #define OPERAND_U8 ((u8) ip->a)
+    #define OPERAND_U64 (ip->a)
+
+    goto *ip->handler;
+
+    STACK_OPCODE_HANDLERS
+
+    op_PSH: {
+        PUSH_U64(ip->a);
+        DISPATCH();
+    }
+    op_STR: {
+        PUSH_U64(ip->a);
+        PUSH_U64(ip->b);
+        DISPATCH();
+    }
+    op_PTS: {
+        u64 str_length, str;
+        POP_U64(str_length);
+        POP_U64(str);
+        write_output(&vm->output, (const char *) vm_address_range(vm, str, str_length), str_length);
+        DISPATCH();
+    }
+    op_PTC: {
+        u8 c;
+        POP_U8(c);
+        write_output_char(&vm->output, (char) c);
+        DISPATCH();
+    }
+    op_JMP: {
+        u64 target;
+        POP_U64(target);
+        JUMP_TO_ADDRESS(target);
+    }
+    op_JPT: {
+        u64 target;
+        u8 condition;
+        POP_U64(target);
+        POP_U8(condition);
+        if (condition) {
+            JUMP_TO_ADDRESS(target);
+        }
+        DISPATCH();
+    }
+    op_JPF: {
+        u64 target;
+        u8 condition;
+        POP_U64(target);
+        POP_U8(condition);
+        if (!condition) {
+            JUMP_TO_ADDRESS(target);
+        }
+        DISPATCH();
+    }
+    op_CLL: {
+        u64 target;
+        POP_U64(target);
+
+        StackFrame sf = {
+            .callee = target,
+            .caller_site = ip[1].addr,
+            .stack_start = sp
+        };
+        push_to_call_stack(&vm->call_stack, sf);
+        frame_start = sp;
+
+        JUMP_TO_ADDRESS(target);
+    }
+    op_RET: {
+        StackFrame current_frame = pop_from_call_stack(&vm->call_stack);
+        frame_start = current_frame_start(&vm->call_stack);
+
+        JUMP_TO_ADDRESS(current_frame.caller_site);
+    }
+    // Jumps with an immediate target: `a` is the resolved index, `b` the original address.
+    op_JMPI: JUMP_TO_INDEX(ip->a);
+    op_JPTI: {
+        u8 condition;
+        POP_U8(condition);
+        if (condition) {
+            JUMP_TO_INDEX(ip->a);
+        }
+        DISPATCH();
+    }
+    op_JPFI: {
+        u8 condition;
+        POP_U8(condition);
+        if (!condition) {
+            JUMP_TO_INDEX(ip->a);
+        }
+        DISPATCH();
+    }
+    // Superinstructions: `a` is the resolved target index, `b` the original address.
+    // The transfer instruction they were fused with is skipped when falling through.
+    op_PJMP: JUMP_TO_INDEX(ip->a);
+    op_PJPT: {
+        u8 condition;
+        POP_U8(condition);
+        if (condition) {
+            JUMP_TO_INDEX(ip->a);
+        }
+        ip++;
+        DISPATCH();
+    }
+    op_PJPF: {
+        u8 condition;
+        POP_U8(condition);
+        if (!condition) {
+            JUMP_TO_INDEX(ip->a);
+        }
+        ip++;
+        DISPATCH();
+    }
+    op_PCLL: {
+        StackFrame sf = {
+            .callee = ip->b,
+            .caller_site = ip[2].addr,
+            .stack_start = sp
+        };
+        push_to_call_stack(&vm->call_stack, sf);
+        frame_start = sp;
+
+        JUMP_TO_INDEX(ip->a);
+    }
+    op_EXT: goto done;
+    op_HLT: goto done;
+
+    op_BADJ:
+    op_fallback: {
+        // Run the instruction from the byte stream, then find where it left pc
+        FLUSH_TOS();
+        vm->pc = ip->addr + 1;
+        vm->stack.sp = sp;
+
+        execute_byte(vm, (OpCode) decoded->program->code[ip->addr]);
+
+        sp = vm->stack.sp;
+        RELOAD_TOS();
+        frame_start = current_frame_start(&vm->call_stack);
+        if (vm->pc == ip[1].addr) {
+            DISPATCH();
+        }
+        JUMP_TO_ADDRESS(vm->pc);
+    }
+    op_invalid: {
+        ERROR("Invalid opcode %#x\n", ip->opcode);
+    }
+
+    #undef DISPATCH
+    #undef JUMP_TO_INDEX
+    #undef JUMP_TO_ADDRESS
+    #undef OPERAND_U8
+    #undef OPERAND_U64
+
+done:
+    FLUSH_TOS();
+    vm->pc = ip->addr;
+    vm->stack.sp = sp;
+}
+
+#undef DECODED_ENGINE_NAME
@@ -0,0 +1,55 @@
+#ifndef DECODER_H
+#define DECODER_H
+#include "core.h"
+#include "opcodes.h"
+#include "program.h"
+
+// Superinstructions that only exist in a decoded stream. They are numbered after
+// the byte opcodes so that a decoded opcode can still be compared against OpCode.
+// PJMP, PJPT, PJPF and PCLL are a `PSH <target>` fused with the following transfer.
+// BADJ is a JMPI, JPTI or JPFI whose target isn't an instruction boundary: it runs
+// from the byte stream, so it's only an error when the jump is taken.
+#define DECODED_OPCODES \
+    X(PJMP, 0x100) \
+    X(PJPT, 0x101) \
+    X(PJPF, 0x102) \
+    X(PCLL, 0x103) \
+    X(HLT , 0x104) \
+    X(BADJ, 0x105)
+
+#define X(name, val) name = val,
+enum _decoded_opcode {
+    DECODED_OPCODES
+    DECODED_OPCODE_LIMIT
+};
+#undef X
+
+#define NO_INSTRUCTION ((u32) -1)
+
+// Fixed-width instruction. Immediates are already loaded and jump targets are
+// resolved to instruction indices, so executing it doesn't touch the byte stream.
+typedef struct {
+    void *handler; // Filled in by the engine running the stream (threaded code)
+    u64 a;
+    u64 b;
+    u32 addr;      // Byte offset of the instruction in the original Program
+    u16 opcode;
+} DecodedInstruction;
+
+typedef struct {
+    DecodedInstruction *instructions;
+    usize count; // Not counting the HLT sentinel at the end
+    u32 *index_of; // Byte offset -> instruction index, NO_INSTRUCTION if it isn't a boundary
+    Program *program;
+    MemoryModel memory; // String literals are pushed as pointers of this kind
+} DecodedProgram;
+
+void decode_program(Program *program, DecodedProgram *decoded, MemoryModel memory);
+void free_decoded_program(DecodedProgram *decoded);
+
+u32 decoded_index_of(DecodedProgram *decoded, u64 address);
+
+char *decoded_opcode_to_str(u16 opcode);
+void debug_print_decoded_program(DecodedProgram *decoded);
+
+#endif // DECODER_H
@@ -0,0 +1,29 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+#include "core.h"
+#include "program_builder.h"
+
+// Synthetic programs for the benchmarks. The same config always gives the same
+// program, either as .cvm source or as the builder calls the assembler would make
+// for it, so the two can be timed against each other. Random programs are only for
+// the toolchain and are never run. With `passes`, the program is made to run instead,
+// for `make bench`: blocks that each jump to the next one, in a loop that goes through
+// all of them `passes` times. `label_every` and `strings` don't apply to those.
+typedef struct {
+    usize instructions;     // Rounded down to whole blocks for a program that runs
+    usize label_every;      // A label before every n-th instruction, 0 for none
+    usize strings;          // How many of the instructions are `str` literals
+    usize comment_percent;  // Chance of a comment line before each instruction
+    u64 seed;
+    usize passes;           // Non-zero for a program that runs
+} GeneratorConfig;
+
+GeneratorConfig default_generator_config(usize instructions);
+// What `instructions` comes to once it's rounded for the kind of program
+usize generated_instruction_count(const GeneratorConfig *config);
+
+// Appends the program to `source`, NUL-terminated
+void generate_source(const GeneratorConfig *config, StringBuffer *source);
+void generate_program(const GeneratorConfig *config, ProgramBuilder *builder);
+
+#endif // GENERATOR_H
@@ -0,0 +1,61 @@
+#ifndef HEAP_H
+#define HEAP_H
+#include "core.h"
+
+// Memory handed out by ALC, owned by one VM. Small allocations come from free
+// lists per size class, refilled from a bump arena; big ones go to malloc() but
+// are still tracked. Everything is released at once when the VM is reset or
+// destroyed, so a program that forgets FRE doesn't leak into the host.
+// A sandboxed VM gives its heap a region of linear memory instead, and then every
+// block, big ones included, is carved out of it.
+
+// Size classes are the powers of two from 16 bytes to 4 KB
+#define HEAP_MIN_CLASS_SHIFT 4
+#define HEAP_SIZE_CLASSES 9
+#define HEAP_MAX_CLASS_SIZE ((usize) 1 << (HEAP_MIN_CLASS_SHIFT + HEAP_SIZE_CLASSES - 1))
+#define HEAP_CHUNK_SIZE (64 * 1024)
+
+typedef struct HeapChunk {
+    struct HeapChunk *next;
+    usize used;
+    _Alignas(16) u8 data[];
+} HeapChunk;
+
+typedef struct HeapBlock {
+    struct HeapBlock *next;
+} HeapBlock;
+
+typedef struct LargeAllocation {
+    struct LargeAllocation *previous;
+    struct LargeAllocation *next;
+} LargeAllocation;
+
+typedef struct {
+    HeapChunk *chunks;  // The first one is the one being bumped
+    HeapBlock *free_lists[HEAP_SIZE_CLASSES];
+    LargeAllocation *large;
+
+    usize quota;        // Most bytes allocated at once, 0 for no limit
+    usize used;
+
+    // Set with use_heap_region(), NULL when the blocks come from malloc()
+    u8 *region;
+    usize region_size;
+    usize region_used;
+    HeapBlock *free_large; // Freed big blocks of the region, to be reused
+} VMHeap;
+
+void init_vm_heap(VMHeap *heap, usize quota);
+void free_vm_heap(VMHeap *heap);
+// Releases every allocation, keeping one chunk around for the next run
+void reset_vm_heap(VMHeap *heap);
+// Releases every allocation, and takes the blocks from `region` from then on.
+// Anything the program wrote there can't make the heap hand out memory outside of it.
+void use_heap_region(VMHeap *heap, u8 *region, usize size);
+
+// Raises an error when the allocation would go over the quota
+void *heap_allocate(VMHeap *heap, usize size);
+// Raises an error for pointers that didn't come from heap_allocate(), or were freed already
+void heap_free(VMHeap *heap, void *pointer);
+
+#endif // HEAP_H
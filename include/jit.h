@@ -0,0 +1,57 @@
+#ifndef JIT_H
+#define JIT_H
+#include "core.h"
+#include "program.h"
+#include "decoder.h"
+#include "vm.h"
+
+// The template JIT only emits x86-64 machine code. Everywhere else
+// run_jit() falls back to the decoded interpreter.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+// Native code for a whole Program.
+typedef struct {
+    u8 *code;      // Executable mapping
+    usize size;
+    void **native; // Byte offset in the Program -> native address, NULL if it isn't an instruction
+    DecodedProgram decoded;
+} JitProgram;
+
+// The code only runs on VMs with the same memory model
+bool jit_compile(Program *program, JitProgram *jit, MemoryModel memory);
+void jit_free(JitProgram *jit);
+
+// Runs code from jit_compile() on a VM that was reset with the same Program.
+// The native code doesn't depend on the VM, so it can run on many of them.
+void run_jit_program(VM *vm, JitProgram *jit);
+// Runs vm->program with the JIT, compiling it on its first run
+void run_jit(VM *vm);
+
+// What the engines build from a Program once, and reuse for every run after that.
+// A Program keeps one for run_vm(), and each pool worker keeps its own: the
+// decoded engine writes its handlers into it, so it can't be shared between threads.
+typedef struct PreparedProgram {
+    u64 program_id; // Not the address, a program freed and allocated again may reuse it
+    MemoryModel memory;
+    bool verified;
+    bool decoded_ready;
+    DecodedProgram decoded;
+    bool jit_tried; // It's only compiled once, even when that fails
+    bool jit_ready;
+    JitProgram jit;
+} PreparedProgram;
+
+// Builds what `engine` needs to run the program with the id from program_id(),
+// starting over when it was prepared for another program or memory model
+void prepare_program(PreparedProgram *prepared, Program *program, u64 id, ExecutionEngine engine, MemoryModel memory);
+void free_prepared_program(PreparedProgram *prepared);
+// Runs a program prepared for `engine` on a VM that was reset with it
+void run_prepared_program(VM *vm, PreparedProgram *prepared, ExecutionEngine engine);
+// The one kept in the Program, prepared for the memory model of the VM
+PreparedProgram *prepared_for_vm(VM *vm, ExecutionEngine engine);
+
+#endif // JIT_H
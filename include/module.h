@@ -0,0 +1,93 @@
+#ifndef MODULE_H
+#define MODULE_H
+#include "core.h"
+#include "program.h"
+#include "binary.h"
+
+// A relocatable module: the code of one source file, assembled on its own.
+// Label operands are stored relative to the start of the module and listed as
+// relocations, so the linker can move the code anywhere. Labels named in a
+// `.export` line can be used by other modules, and labels a module uses without
+// defining them are imports, resolved when linking.
+//
+// On disk, little-endian:
+//   ModuleHeader
+//   code, exports, imports, relocations, names
+// Every section starts 16-byte aligned and everything after the header is
+// covered by the checksum, like a binary (see binary.h).
+#define MODULE_MAGIC "CVMO"
+#define MODULE_VERSION 2
+
+typedef enum {
+    RELOCATION_LOCAL,   // The operand is an offset in the module, the module's address is added
+    RELOCATION_IMPORT,  // The operand is the address of `imports[symbol]`
+} RelocationKind;
+
+typedef struct {
+    u64 at;         // Offset of the u64 operand in the code
+    u32 kind;       // RelocationKind
+    u32 symbol;     // Index in the imports, for RELOCATION_IMPORT
+} Relocation;
+
+typedef struct {
+    u64 address;    // Offset in the code, 0 for imports
+    u32 name_offset; // In the names section, NUL-terminated
+    u32 name_length;
+} ModuleSymbol;
+
+typedef struct {
+    char magic[4];
+    u16 version;
+    u16 header_size;
+    u64 source_hash; // Hash of the source it was assembled from
+    u32 assembler_revision; // ASSEMBLER_REVISION of the assembler that did it
+    u32 padding;
+    u64 checksum;
+    BinarySection code;
+    BinarySection exports;
+    BinarySection imports;
+    BinarySection relocations;
+    BinarySection names;
+} ModuleHeader;
+
+typedef struct {
+    u8 *code;
+    usize size;
+    ModuleSymbol *exports;
+    usize exports_count;
+    ModuleSymbol *imports;
+    usize imports_count;
+    Relocation *relocations;
+    usize relocations_count;
+    char *names;
+    usize names_size;
+
+    u64 source_hash;
+    u32 assembler_revision;
+    const char *source_path; // For errors, not saved
+    void *backing;  // The file contents when it was loaded, everything points into them
+} Module;
+
+static inline const char *module_symbol_name(const Module *module, const ModuleSymbol *symbol) {
+    return &module->names[symbol->name_offset];
+}
+
+u64 module_source_hash(const char *source, usize size);
+
+void write_module_file(const char *file_path, const Module *module);
+// Returns false when the file can't be read, or isn't a valid module of this version
+bool load_module_file(const char *file_path, Module *module);
+void free_module(Module *module);
+
+// Lays the modules out one after the other, the first one starting at 0 where the
+// program starts, and resolves every relocation. Raises an error for imports no
+// module exports, and for symbols exported twice.
+// `symbols` gets the address of every export, pointing into the modules' names.
+void link_modules(const Module *modules, usize count, Program *program, BinarySymbol **symbols, usize *symbols_count);
+
+// Loads the module built from `source_path` at `module_path`, or assembles the
+// source again and saves the module there when it changed since.
+// Returns whether it was assembled.
+bool build_module(const char *source_path, const char *module_path, Module *module);
+
+#endif // MODULE_H
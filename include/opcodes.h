@@ -55,6 +55,13 @@
     X(GTZ , 0x90) \
     X(REFZ, 0x91) \
     X(WRTZ, 0x92) \
+/* immediate opcodes: a u64 operand replaces the top of the stack */ \
+    X(ADDI, 0xC1) \
+    X(SUBI, 0xC2) \
+    X(MODI, 0xC3) \
+    X(EQUI, 0xC6) \
+    X(LTI , 0xC7) \
+    X(GTI , 0xD0) \
 /* logical opcodes*/ \
     X(NOT, 0xA0) \
     X(OR , 0xA1) \
@@ -65,6 +72,9 @@
     X(PTC, 0xB3) \
     X(PTS, 0xB4) \
     X(STR, 0xB5) \
+    X(JMPI, 0xB6) \
+    X(JPTI, 0xB7) \
+    X(JPFI, 0xB8) \
     X(BKP, 0xFE) \
     X(EXT, 0xFF)
 
@@ -77,6 +87,9 @@ typedef enum _opcode OpCode;
 
 const int OPCODE_COUNT;
 
+// Immediate opcodes behave like `PSH <operand>` followed by their base opcode:
+// `ADDI 1` is `PSH 1 ADD`, and `JPTI <target>` is `PSH <target> JPT`.
+
 // PNT -> Considers the top of the stack a number with the length and a pointer to string and prints it
 // By default, all stack operations will work on 64-bit values
 
@@ -85,5 +98,23 @@ char *opcode_to_str(OpCode op);
 void print_opcode(OpCode op);
 
 bool string_to_opcode(OpCode *dst, char *str);
+// Same, for a mnemonic that isn't NUL-terminated. Case doesn't matter.
+bool mnemonic_to_opcode(OpCode *dst, const char *str, usize length);
+
+// Size in bytes of the immediates that follow an opcode in the byte stream.
+// STR is followed by a u64 length and then that many bytes; only the length is counted here.
+usize opcode_immediate_size(OpCode op);
+
+// Bytes an opcode pops from and pushes to the data stack. `pure` opcodes don't do
+// anything else (and can't trap), so they can be removed if their result is dropped.
+// `variable` is set when the effect depends on operands or runtime values (Z opcodes, TKS).
+typedef struct {
+    u8 pops;
+    u8 pushes;
+    bool pure;
+    bool variable;
+} StackEffect;
+
+StackEffect opcode_stack_effect(OpCode op);
 
 #endif // OPCODES_H
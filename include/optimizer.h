@@ -0,0 +1,12 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+#include "core.h"
+#include "program_builder.h"
+
+// Peephole pass over the instructions of a builder, to run before clone_to_program().
+// Removes sequences that don't change the stack (`SWP SWP`, `PSH x DRP`, `ADDI 0`...)
+// and re-targets the labels that pointed at removed instructions.
+// Returns how many instructions were eliminated. Flat builders can't be optimized.
+usize optimize_program_builder(ProgramBuilder *builder);
+
+#endif // OPTIMIZER_H
@@ -0,0 +1,95 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+#include "core.h"
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+typedef struct OutputWriter OutputWriter;
+
+// Where the output of a VM ends up
+typedef enum {
+    OUTPUT_FILE,    // A stdio stream, so it stays in order with other printf()s to it
+    OUTPUT_FD,      // write() to a file descriptor
+    OUTPUT_MEMORY,  // Appended to a StringBuffer, for embedding
+} OutputSinkKind;
+
+typedef struct {
+    OutputSinkKind kind;
+    FILE *file;
+    int fd;
+    StringBuffer *memory;
+    OutputWriter *writer; // When set, full buffers are written by its thread instead
+} OutputSink;
+
+OutputSink file_output_sink(FILE *file);
+OutputSink fd_output_sink(int fd);
+OutputSink memory_output_sink(StringBuffer *memory);
+
+// Output of a VM, collected until the buffer fills up or it's flushed
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+typedef struct {
+    char *data;
+    usize count;
+    OutputSink sink;
+} OutputBuffer;
+
+void init_output_buffer(OutputBuffer *buffer, OutputSink sink);
+void free_output_buffer(OutputBuffer *buffer);
+// Hands what's buffered to the sink, or to its writer thread
+void flush_output(OutputBuffer *buffer);
+// Flushes, and waits for the writer thread to get it out too
+void sync_output(OutputBuffer *buffer);
+
+void write_output_slow(OutputBuffer *buffer, const char *data, usize n);
+void write_output_u64(OutputBuffer *buffer, u64 value);
+
+static inline void write_output(OutputBuffer *buffer, const char *data, usize n) {
+    if (buffer->count + n <= OUTPUT_BUFFER_SIZE) {
+        memcpy(&buffer->data[buffer->count], data, n);
+        buffer->count += n;
+        return;
+    }
+
+    write_output_slow(buffer, data, n);
+}
+
+static inline void write_output_char(OutputBuffer *buffer, char c) {
+    if (buffer->count == OUTPUT_BUFFER_SIZE) {
+        flush_output(buffer);
+    }
+
+    buffer->data[buffer->count++] = c;
+}
+
+// A buffer waiting for the writer thread
+typedef struct {
+    _Atomic usize sequence;
+    OutputSink sink;
+    char *data;
+    usize count;
+} OutputChunk;
+
+// Writes the buffers of any number of VMs from its own thread. They go through a
+// bounded lock-free ring: flushing a buffer only blocks while the ring is full.
+// The thread sleeps on `work_available` while the ring is empty, and only then
+// does pushing a buffer take the lock, to wake it up.
+#define OUTPUT_RING_SIZE 64
+struct OutputWriter {
+    OutputChunk ring[OUTPUT_RING_SIZE];
+    _Atomic usize head; // Next slot to fill
+    _Atomic usize tail; // Next slot to write out
+    _Atomic bool stopping;
+    _Atomic bool sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_t thread;
+};
+
+void start_output_writer(OutputWriter *writer);
+// Writes out whatever is still in the ring, then stops the thread
+void stop_output_writer(OutputWriter *writer);
+// Waits until the ring is empty
+void drain_output_writer(OutputWriter *writer);
+
+#endif // OUTPUT_H
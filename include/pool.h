@@ -0,0 +1,67 @@
+#ifndef POOL_H
+#define POOL_H
+#include "core.h"
+#include "program.h"
+#include "vm.h"
+#include <pthread.h>
+
+// A run of a Program on one of the workers of a VMPool.
+// The job is owned by whoever submits it, and must stay alive until it's done.
+typedef struct PoolJob {
+    Program *program;   // Read only, shared by every job running it
+    const u64 *stack;   // Pushed before running, bottom first
+    usize stack_count;
+    const OutputSink *output; // Where the program prints, NULL for the sink in the VMConfig
+
+    u64 program_id;     // Set by submit_job(), what workers key their prepared program on
+
+    // Filled by the worker
+    bool ok;
+    char error[256];    // What stopped the program when it didn't finish
+    usize stack_size;   // Bytes left on the stack
+    u64 top;            // The u64 on top of the stack, if it has one
+
+    bool done;          // Once it's true, everything the job printed is in its sink
+    struct PoolJob *next;
+} PoolJob;
+
+typedef struct {
+    usize workers;          // 0 for one per online core
+    ExecutionEngine engine;
+    VMConfig vm_config;
+    bool pin_workers;       // Worker i only runs on core i
+} VMPoolConfig;
+
+typedef struct VMPool VMPool;
+
+typedef struct {
+    VMPool *pool;
+    usize index;
+    pthread_t thread;
+} PoolWorker;
+
+// Worker threads, each with its own VM, taking jobs from a shared queue.
+struct VMPool {
+    VMPoolConfig config;
+    PoolWorker *workers;
+    usize workers_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_available;
+    pthread_cond_t job_done;
+    PoolJob *queue_head;
+    PoolJob *queue_tail;
+    usize pending;      // Submitted jobs that aren't done yet
+    bool stopping;
+};
+
+VMPoolConfig default_vm_pool_config(void);
+void init_vm_pool(VMPool *pool, VMPoolConfig config);
+// Waits for the jobs in the queue, then stops the workers
+void free_vm_pool(VMPool *pool);
+
+void submit_job(VMPool *pool, PoolJob *job);
+// Blocks until every job submitted so far is done
+void wait_for_jobs(VMPool *pool);
+
+#endif // POOL_H
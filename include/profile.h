@@ -0,0 +1,42 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include "core.h"
+#include "program.h"
+#include <time.h>
+
+// Execution counts of one run, filled by run_switch_profiled(). The counting
+// loop is a separate expansion of the switch engine (see switch_engine.h), so
+// run_switch() itself doesn't pay anything for it.
+typedef struct {
+    u64 instructions;
+    u64 opcode_counts[256];
+    u64 opcode_cycles[256]; // Only with `timed`, in ticks of read_cycles()
+    u64 *address_counts;    // Per byte of code, for the instruction starting there
+    u64 *call_counts;       // Per byte of code, for CLLs landing there
+    usize code_size;
+    bool timed;
+} VMProfile;
+
+void init_vm_profile(VMProfile *profile, Program *program, bool timed);
+void free_vm_profile(VMProfile *profile);
+
+// Opcodes and call targets sorted by count, then the program annotated with
+// how many times each instruction ran
+void print_vm_profile(VMProfile *profile, Program *program);
+
+// The time stamp counter where there is one, nanoseconds otherwise
+static inline u64 read_cycles(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__) && defined(__GNUC__)
+    u64 ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (u64) now.tv_sec * 1000000000ull + (u64) now.tv_nsec;
+#endif
+}
+
+#endif // PROFILE_H
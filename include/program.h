@@ -6,10 +6,22 @@
 typedef struct {
     usize size;
     u8* code;
+    usize entry;   // Where execution starts
+    void *backing; // What destroy_program() frees when `code` points inside of it, like a loaded file
+    usize mapped_size; // Non-zero when `backing` is a mapping, then it's unmapped instead
+    u64 id;        // Never reused while the process runs, 0 until program_id() hands one out
+    struct PreparedProgram *prepared; // Built by the engines on its first run, see jit.h
 } Program;
 
+// How the pointers a program works with are addressed
+typedef enum {
+    MEMORY_HOST,      // Raw addresses in the host process
+    MEMORY_SANDBOXED, // Offsets into the linear memory of the VM
+} MemoryModel;
+
 void print_program(Program*);
 Program create_program(void);
 void destroy_program(Program*);
+u64 program_id(Program*);
 
 #endif // PROGRAM_H
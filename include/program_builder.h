@@ -53,20 +53,50 @@ void grow_inst_array_to_fit(InstructionArray*, usize new_elements);
 Instruction *insert_inst_array(InstructionArray*, Instruction element);
 void free_inst_array(InstructionArray*);
 
+// Where a label address goes once the label is linked
+typedef struct {
+    usize at;   // Offset of the u64 operand in the encoded bytes
+    u64 label;
+} LabelFixup;
+
 // A utility struct for building a bytecode Program.
-#define LABEL_T u8
+// By default it keeps a list of Instructions, which the optimizer can rewrite.
+// A flat builder encodes every instruction into one byte buffer as it's emitted
+// instead, and only remembers the label operands to patch, so it allocates a
+// handful of times for the whole program. Its emit functions return NULL.
+// Labels are numbered from 0 as they're created, the table grows with them.
+#define LABEL_T u32
+#define MAX_LABELS ((usize) (LABEL_T) -1)
+#define UNLINKED_LABEL ((usize) -1) // Resolves to address 0 in a Program
 typedef struct {
     InstructionArray instructions;
-    usize labels[256];
-    LABEL_T current_label;
+    usize *labels; // Instruction index, or byte address for a flat builder
+    usize labels_capacity;
+    LABEL_T current_label; // How many labels were created
+    usize last_linked_index; // Instructions can't be fused across a label
+
+    bool flat;
+    u8 *bytes;
+    usize bytes_count;
+    usize bytes_capacity;
+    LabelFixup *fixups;
+    usize fixups_count;
+    usize fixups_capacity;
+    usize last_instruction; // Offset of the last one encoded, if bytes_count > 0
 } ProgramBuilder;
 
 void init_program_builder(ProgramBuilder *builder);
+void init_flat_program_builder(ProgramBuilder *builder);
 void free_program_builder(ProgramBuilder *builder);
 
 void debug_print_program_builder(ProgramBuilder *builder);
+// Prints one instruction of encoded code the way the listing does, without the newline.
+// `label` is the label its operand refers to, NULL to print the operand itself.
+// Returns how many bytes the instruction takes.
+usize print_encoded_instruction(const u8 *code, usize size, usize address, const LabelFixup *label);
 
 //    To Program:
+// Resolves the labels and copies the code. The builder can still be printed after.
 void clone_to_program(ProgramBuilder*, Program*);
 
 // Instruction creation
@@ -77,6 +107,7 @@ Instruction *emit_instruction_with_operands(ProgramBuilder*, OpCode, Operand *,
 void emit_nop(ProgramBuilder*);
 void emit_push(ProgramBuilder*, BASE_T value);
 void emit_push_label(ProgramBuilder*, BASE_T label);
+void emit_label_instruction(ProgramBuilder*, OpCode, BASE_T label);
 void emit_str(ProgramBuilder*, char*);
 void emit_sized_instruction(ProgramBuilder*, OpCode, u64);
 void emit_jump(ProgramBuilder*, LABEL_T);
@@ -86,5 +117,6 @@ void emit_jump_if_false(ProgramBuilder*, LABEL_T label);
 // Labels
 LABEL_T create_label(ProgramBuilder*);
 void link_label(ProgramBuilder*, LABEL_T);
+bool label_is_linked(ProgramBuilder*, LABEL_T);
 
 #endif // PROGRAM_BUILDER_H
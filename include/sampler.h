@@ -0,0 +1,36 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+#include "core.h"
+#include "vm.h"
+#include "debug_info.h"
+
+// Samples where a program is every `interval` microseconds of CPU time, from a
+// SIGPROF handler, along with the calls that led there. It runs the program on
+// run_switch() as it is, which keeps vm->pc up to date, so nothing is counted
+// per instruction. Samples are only recorded while running, and turned into
+// names once the run is over.
+#define SAMPLER_MAX_DEPTH 128
+#define DEFAULT_SAMPLE_INTERVAL 1000
+
+typedef struct {
+    // Each sample is [pc, frames, truncated, then the callee and caller site of every frame]
+    u64 *records;
+    usize used;
+    usize capacity;
+    usize samples;
+    usize dropped;      // Taken after `records` filled up
+    usize interval;     // Microseconds
+} Sampler;
+
+void init_sampler(Sampler *sampler, usize interval);
+void free_sampler(Sampler *sampler);
+
+// Runs vm->program on a VM that was just reset
+void run_sampled(VM *vm, Sampler *sampler);
+
+// One line per distinct stack, `outer;...;inner;file:line count`, the folded format
+// that flamegraph.pl, inferno and speedscope read. Functions are named after the
+// label they start at, lines come from `info`.
+void write_folded_stacks(Sampler *sampler, const DebugInfo *info, FILE *file);
+
+#endif // SAMPLER_H
@@ -0,0 +1,39 @@
+// Body of the switch interpreter. vm.c includes it once per variant, with
+// SWITCH_ENGINE_NAME set to the function to define, PROFILE_COUNTS picking whether
+// it fills a VMProfile and PROFILE_CYCLES whether it also times every opcode.
+// No include guard on purpose.
+#ifndef SWITCH_ENGINE_NAME
+#error "SWITCH_ENGINE_NAME must be defined before including switch_engine.h"
+#endif
+
+static void SWITCH_ENGINE_NAME(VM *vm, VMProfile *profile) {
+    usize size = vm->program->size;
+#if !PROFILE_COUNTS
+    (void) profile;
+#endif
+
+    while (vm->pc < size) {
+#if PROFILE_COUNTS
+        usize at = vm->pc;
+#endif
+#if PROFILE_CYCLES
+        u64 started = read_cycles();
+#endif
+        OpCode op = get_next_u8_from_program(vm);
+
+        execute_byte(vm, op);
+
+#if PROFILE_CYCLES
+        profile->opcode_cycles[op] += read_cycles() - started;
+#endif
+#if PROFILE_COUNTS
+        profile->instructions++;
+        profile->opcode_counts[op]++;
+        profile->address_counts[at]++;
+        // A call left the pc at its target
+        if (op == CLL && vm->pc < size) {
+            profile->call_counts[vm->pc]++;
+        }
+#endif
+    }
+}
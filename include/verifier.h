@@ -0,0 +1,24 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+#include "core.h"
+#include "program.h"
+
+// What the verifier found out about a Program.
+typedef struct {
+    bool ok;
+    usize failed_at;    // Address of the instruction that couldn't be verified
+    const char *reason;
+    usize functions;    // Including the global code
+    usize max_depth;    // Deepest any single frame gets, in bytes
+} Verification;
+
+// Walks every path through the program and proves, for each instruction, how many
+// bytes are on the stack above the current frame start. A program verifies when:
+// - Every jump and call target is a constant that lands on an instruction boundary
+// - No instruction pops below the start of its frame
+// - Every path reaching an instruction agrees on the stack depth and the function
+// - Every RET of a function leaves the same depth, and the global code doesn't return
+// Opcodes whose effect isn't known statically (TKS, the Z opcodes) fail verification.
+bool verify_program(Program *program, Verification *result);
+
+#endif // VERIFIER_H
@@ -3,13 +3,25 @@
 #include "core.h"
 #include "opcodes.h"
 #include "program.h"
+#include "decoder.h"
+#include "output.h"
+#include "heap.h"
+#include "profile.h"
+#include <stdint.h>
 
 // Stack
 #define MB *1024
 #define MAX_STACK_SIZE (2 MB)
+// Room below the stack storage for engines that cache the top of the stack,
+// since they flush the top 8 bytes even when the stack holds fewer than that.
+#define STACK_PADDING sizeof(u64)
+// The storage ends right at an inaccessible guard page, so the engines don't
+// compare sp on every push: a write past `capacity` faults and is reported as
+// a stack overflow.
 typedef struct {
-    u8 storage[MAX_STACK_SIZE];
     usize sp;
+    u8 *storage;
+    usize capacity;
 } Stack;
 
 // CallStack
@@ -19,27 +31,100 @@ typedef struct {
     usize stack_start;
 } StackFrame;
 
-#define MAX_CALLSTACK_SIZE (10 * 1024)
+// The call stack reserves room for `max_capacity` frames up front, but only
+// `capacity` of them are backed by memory. It doubles when a call reaches the end.
+#define INITIAL_CALLSTACK_SIZE 1024
+#define MAX_CALLSTACK_SIZE (1024 * 1024)
 typedef struct {
-    StackFrame storage[MAX_CALLSTACK_SIZE];
     usize sp;
+    StackFrame *storage;
+    usize capacity;
+    usize max_capacity;
 } CallStack;
 
+// Sizes of the stacks of a VM, picked at runtime
+typedef struct {
+    usize stack_size;      // Bytes
+    usize call_stack_size; // Most frames the call stack can grow to
+    bool huge_pages;       // Ask for transparent huge pages where the OS has them
+    OutputSink output;     // Where the programs print
+    usize heap_quota;      // Most bytes ALC can hand out at once, 0 for no limit
+    MemoryModel memory;    // What the pointers of the programs are
+    usize memory_size;     // Bytes of linear memory for MEMORY_SANDBOXED
+} VMConfig;
+
+VMConfig default_vm_config(void);
+// The config init_vm() uses from then on
+void set_vm_config(VMConfig config);
+
+// Linear memory
+// A sandboxed VM only hands out u32 offsets into a region of its own: the code
+// of the program, so string literals are in it, followed by the heap. The whole
+// range of a u32 is reserved, with a guard page on each side, and only `size`
+// bytes of it are backed. An offset can't point anywhere else, and touching
+// the unbacked part faults, so loads and stores don't compare anything.
+#define DEFAULT_MEMORY_SIZE (64 * 1024 * 1024)
+#define MAX_MEMORY_SIZE ((usize) 1 << 32)
+typedef struct {
+    MemoryModel model;
+    u8 *base;      // NULL for host pointers
+    u64 mask;      // The bits of a pointer that are kept
+    u64 limit;     // Accesses longer than a guard page are checked against it
+    usize size;
+    u64 code_address; // Where the program sees its own code, for string literals
+
+    u8 *mapping;
+    usize mapping_size;
+    bool huge_pages;
+    bool used;     // A program was loaded since it was last cleared
+} LinearMemory;
+
+// What a fault on one of the VM's guard pages stands for
+typedef enum {
+    VM_FAULT_NONE,
+    VM_FAULT_STACK_OVERFLOW,
+    VM_FAULT_FRAME_BOUNDS,
+    VM_FAULT_MEMORY,
+} VMFault;
+
 // VM
+// The fields touched by every instruction come first and share a cache line.
 typedef struct {
-    usize pc;
+    // Hot
+    _Alignas(64) usize pc;
+    const u8 *code;
+    Stack stack;
+    CallStack call_stack;
     Program* program;
+
+    // Cold
     BASE_T registers[32];
     char* strings[sizeof(BASE_T)];
     BASE_T current_string;
 
-    Stack stack;
-    CallStack call_stack;
+    // Flushed when it fills up, on EXT and BKP, and when a run ends
+    OutputBuffer output;
+    // Backs ALC and FRE, emptied on every reset
+    VMHeap heap;
+    LinearMemory memory;
+
+    // Mappings behind the stacks, guard pages included
+    u8 *stack_mapping;
+    usize stack_mapping_size;
+    u8 *call_stack_mapping;
+    usize call_stack_mapping_size;
+
+    // Set by run_trapping_faults() while an engine runs. The fault handler only
+    // records the fault and jumps back to it, the error is raised from there.
+    sigjmp_buf *fault_jump;
+    VMFault fault;
+    u64 fault_address; // Offset in linear memory, for VM_FAULT_MEMORY
 } VM;
 
 void push_to_call_stack(CallStack*, StackFrame);
 StackFrame pop_from_call_stack(CallStack*);
 StackFrame * current_stack_frame(CallStack*);
+usize current_frame_start(CallStack*);
 
 void push_to_stack(Stack*, u8);
 void push_n_to_stack(Stack*, usize, u8*);
@@ -58,10 +143,86 @@ u64 get_next_u8_from_program(VM*);
 
 void debug_stack(Stack*);
 
+// Where a pointer of the program is in the host
+static inline u8 *vm_address(VM *vm, u64 pointer) {
+    return (u8 *) ((uintptr_t) vm->memory.base + (uintptr_t) (pointer & vm->memory.mask));
+}
+
+// The same, for `length` bytes starting there
+static inline u8 *vm_address_range(VM *vm, u64 pointer, u64 length) {
+    u64 offset = pointer & vm->memory.mask;
+    ASSERT(length <= vm->memory.limit - offset, "Out of bounds memory access of %llu bytes at %#llx\n", length, offset);
+    return (u8 *) ((uintptr_t) vm->memory.base + (uintptr_t) offset);
+}
+
+// The pointer the program sees for a host address
+static inline u64 vm_pointer(VM *vm, const void *address) {
+    return (u64) ((uintptr_t) address - (uintptr_t) vm->memory.base);
+}
+
+// Interpreter cores that can run a Program.
+// The threaded engine needs labels-as-values (GCC/Clang), so it can be compiled out.
+#ifndef THREADED_DISPATCH
+#if defined(__GNUC__)
+#define THREADED_DISPATCH 1
+#else
+#define THREADED_DISPATCH 0
+#endif
+#endif // THREADED_DISPATCH
+
+typedef enum {
+    ENGINE_SWITCH,
+    ENGINE_THREADED,
+    ENGINE_DECODED,
+    ENGINE_JIT,
+    ENGINE_DEBUG,
+} ExecutionEngine;
+
+#if THREADED_DISPATCH
+#define DEFAULT_ENGINE ENGINE_DECODED
+#else
+#define DEFAULT_ENGINE ENGINE_SWITCH
+#endif
+
+bool string_to_engine(ExecutionEngine *dst, char *str);
+
 const char *save_string(VM*);
+void init_vm(VM*, Program*);
+void init_vm_with_config(VM*, Program*, const VMConfig*);
 void destroy_vm(VM*);
+
+// Reusable VMs: the stacks are mapped once by create_vm(), and each run_vm()
+// only resets what the previous run used before running the program.
+// A NULL config uses the one set with set_vm_config().
+VM *create_vm(const VMConfig *config);
+void reset_vm(VM*, Program*);
+void run_vm(VM*, Program*, ExecutionEngine);
+void free_vm(VM*);
+// Flushes what the VM printed so far, and sends the rest somewhere else
+void set_vm_output(VM*, OutputSink);
+// The stack the last run left, bottom first
+const u8 *vm_stack_contents(VM*, usize *size);
+
 void execute_byte(VM*, OpCode);
+
+// Runs `run(vm, context)` so that running past a stack or out of linear memory raises
+// the error after the signal handler has returned, like any other error of the run
+void run_trapping_faults(VM *vm, void (*run)(VM *vm, void *context), void *context);
+
+// Engines, running vm->program on a VM that was just reset
+void run_switch(VM*);
+// The switch engine, filling `profile` as it goes
+void run_switch_profiled(VM*, VMProfile *profile);
+void run_threaded(VM*);
+void run_decoded(VM*);
+void run_decoded_program(VM*, DecodedProgram*);
+// Only for programs that passed verify_program()
+void run_decoded_program_unchecked(VM*, DecodedProgram*);
+void debug_run(VM*);
+
+// One-off runs on a fresh VM
 void execute(Program*);
+void execute_with_engine(Program*, ExecutionEngine);
 void debug_execute(Program*);
 
 #endif // VM_H
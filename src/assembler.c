@@ -2,82 +2,191 @@
 #include "core.h"
 #include "program.h"
 #include "program_builder.h"
+#include "optimizer.h"
 #include "vm.h"
-#include <ctype.h>
+#include <string.h>
 
 void init_assembler(Assembler *assembler) {
-    init_hash_map(&assembler->labels);
+    init_symbol_table(&assembler->labels);
+    init_symbol_table(&assembler->exports);
+    init_string_buffer(&assembler->scratch, 64);
 }
 
 void free_assembler(Assembler *assembler) {
-    free_hash_map(&assembler->labels);
+    free_symbol_table(&assembler->labels);
+    free_symbol_table(&assembler->exports);
+    free_string_buffer(&assembler->scratch);
+}
+
+// Whitespace and comments are skipped 8 bytes at a time. Every byte up to ' '
+// counts as a space, so a word is all spaces when none of its bytes is above it.
+#define BYTES_OF(b) (0x0101010101010101ull * (u8) (b))
+
+static bool has_non_space(u64 word) {
+    const u64 high = BYTES_OF(0x80);
+    // A byte gets its high bit set when its low 7 bits are above ' ', or it had it already
+    return ((((word & BYTES_OF(0x7F)) + BYTES_OF(0x7F - ' ')) | word) & high) != 0;
+}
+
+static bool has_newline(u64 word) {
+    u64 x = word ^ BYTES_OF('\n');
+    return ((x - BYTES_OF(0x01)) & ~x & BYTES_OF(0x80)) != 0;
 }
 
 void assemble_ignore_spaces(Assembler *assembler) {
-    while (
-        ((assembler->current_pos) < assembler->count) &&
-        isspace(assembler->code[assembler->current_pos])
-    ) {
-        assembler->current_pos++;
+    const char *code = assembler->code;
+    usize count = assembler->count;
+    usize pos = assembler->current_pos;
+
+    while (pos + sizeof(u64) <= count) {
+        u64 word;
+        memcpy(&word, &code[pos], sizeof(u64));
+        if (has_non_space(word)) { break; }
+        pos += sizeof(u64);
     }
+    while (pos < count && (u8) code[pos] <= ' ') {
+        pos++;
+    }
+
+    assembler->current_pos = pos;
 }
 
-HashEntry *assemble_label_literal(Assembler *assembler, bool *existing) {
-    StringBuffer literal = create_string_buffer(4);
-    usize code_len = assembler->count;
-    for (;assembler->current_pos < code_len; assembler->current_pos++) {
-        char c = assembler->code[assembler->current_pos];
-        if (isspace(c)) { break; }
+// From a '#' up to the end of the line
+static void assemble_ignore_comment(Assembler *assembler) {
+    const char *code = assembler->code;
+    usize count = assembler->count;
+    usize pos = assembler->current_pos;
+
+    while (pos + sizeof(u64) <= count) {
+        u64 word;
+        memcpy(&word, &code[pos], sizeof(u64));
+        if (has_newline(word)) { break; }
+        pos += sizeof(u64);
+    }
+    while (pos < count && code[pos] != '\n') {
+        pos++;
+    }
+
+    assembler->current_pos = pos;
+}
 
-        append_char_string_buffer(&literal, c);
+static void assemble_ignore_trivia(Assembler *assembler) {
+    for (;;) {
+        assemble_ignore_spaces(assembler);
+        if (assembler->current_pos >= assembler->count || assembler->code[assembler->current_pos] != '#') {
+            return;
+        }
+        assemble_ignore_comment(assembler);
     }
-    
-    HashMap *labels = &assembler->labels;
+}
 
-    HashEntry *entry = find_entry(labels, literal.str);
-    if (!entry) {
-        *existing = false;
-        entry = insert_hash_map(labels, literal.str, 0);
-    } else {
-        *existing = true;
+// A mnemonic or the name of a label definition
+static StringView assemble_word(Assembler *assembler) {
+    const char *code = assembler->code;
+    usize start = assembler->current_pos;
+    usize pos = start;
+    while (pos < assembler->count) {
+        u8 c = (u8) code[pos];
+        if (c <= ' ' || c == ':' || c == '#') { break; }
+        pos++;
     }
-    
-    return entry;
+
+    assembler->current_pos = pos;
+    StringView word = { .str = &code[start], .count = pos - start };
+    return word;
 }
 
-u64 assemble_u64_literal(Assembler *assembler) {
-    StringBuffer literal = create_string_buffer(4);
-    usize code_len = assembler->count;
-    for (;assembler->current_pos < code_len; assembler->current_pos++) {
-        char c = assembler->code[assembler->current_pos];
-        if (isspace(c)) { break; }
+// Operands go on until the next space
+static StringView assemble_operand(Assembler *assembler) {
+    const char *code = assembler->code;
+    usize start = assembler->current_pos;
+    usize pos = start;
+    while (pos < assembler->count && (u8) code[pos] > ' ') {
+        pos++;
+    }
 
-        append_char_string_buffer(&literal, c);
+    assembler->current_pos = pos;
+    StringView operand = { .str = &code[start], .count = pos - start };
+    return operand;
+}
+
+Symbol *assemble_label_literal(Assembler *assembler, bool *existing) {
+    StringView name = assemble_operand(assembler);
+    return intern_symbol(&assembler->labels, name.str, name.count, 0, existing);
+}
+
+// Reads it the way strtoull() does with base 0: hex with 0x, octal with a leading 0,
+// an optional sign, and up to the first character that isn't a digit
+static u64 parse_u64(StringView literal) {
+    const char *str = literal.str;
+    usize count = literal.count;
+    usize i = 0;
+
+    bool negative = false;
+    if (i < count && (str[i] == '-' || str[i] == '+')) {
+        negative = str[i] == '-';
+        i++;
     }
 
-    u64 result = strtoull(literal.str, NULL, 0);
-    VERBOSE_LOG("Trying to parse `%s` as numeric operand: `%llu`\n", literal.str, result);
+    u64 base = 10;
+    if (i + 1 < count && str[i] == '0' && (str[i + 1] | 0x20) == 'x') {
+        base = 16;
+        i += 2;
+    } else if (i < count && str[i] == '0') {
+        base = 8;
+    }
 
-    free_string_buffer(&literal);
+    u64 value = 0;
+    for (; i < count; i++) {
+        u8 c = (u8) str[i] | 0x20;
+        u64 digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else {
+            break;
+        }
+        if (digit >= base) { break; }
+
+        value = value * base + digit;
+    }
+
+    return negative ? -value : value;
+}
+
+u64 assemble_u64_literal(Assembler *assembler) {
+    StringView literal = assemble_operand(assembler);
+    u64 result = parse_u64(literal);
+    VERBOSE_LOG("Trying to parse `%.*s` as numeric operand: `%llu`\n", (int) literal.count, literal.str, result);
 
     return result;
 }
 
-StringBuffer assemble_string_literal(Assembler *assembler) {
-    if (assembler->code[assembler->current_pos] != '\"') {
+StringView assemble_string_literal(Assembler *assembler) {
+    const char *code = assembler->code;
+    usize count = assembler->count;
+    usize pos = assembler->current_pos;
+    if (pos >= count || code[pos] != '\"') {
         ERROR("Expected a string literal starting with \"\n");
     }
+    pos++;
+
+    StringBuffer *scratch = &assembler->scratch;
+    scratch->count = 0;
+
+    for (;;) {
+        if (pos >= count) {
+            ERROR("String literal was not closed.\n");
+        }
 
-    assembler->current_pos++;
-    StringBuffer sb = create_string_buffer(8);
+        char c = code[pos++];
+        if (c == '\"') { break; }
 
-    while (assembler->code[assembler->current_pos] != '\"') {
-        char c = assembler->code[assembler->current_pos];
         if (c == '\\') {
-            assembler->current_pos++;
-            ASSERT(assembler->current_pos < assembler->count, "Unexpected end of file trying to escape character");
+            ASSERT(pos < count, "Unexpected end of file trying to escape character");
 
-            char escaped = assembler->code[assembler->current_pos];
+            char escaped = code[pos++];
             switch (escaped) {
                 case 'n':
                     c = '\n';
@@ -90,40 +199,39 @@ StringBuffer assemble_string_literal(Assembler *assembler) {
                     break;
             }
         }
-        
-        append_char_string_buffer(&sb, c);
-        assembler->current_pos++;
 
-        if (assembler->current_pos > assembler->count) {
-            ERROR("String literal was not closed.\n");
-        }
+        append_char_string_buffer(scratch, c);
     }
+    scratch->str[scratch->count] = '\0';
 
-    VERBOSE_LOG("Closing string literal with '%c'\n", assembler->code[assembler->current_pos]);
-    assembler->current_pos++;
-    return sb;
+    VERBOSE_LOG("Closing string literal with '%c'\n", code[pos - 1]);
+    assembler->current_pos = pos;
+
+    StringView literal = { .str = scratch->str, .count = scratch->count };
+    return literal;
 }
 
-void resolve_instruction(Assembler *assembler, StringBuffer *buf, ProgramBuilder *pb) {
+void resolve_instruction(Assembler *assembler, StringView mnemonic, ProgramBuilder *pb) {
     // Then I have a complete instruction
     OpCode opcode = NOP;
-    ASSERT(string_to_opcode(&opcode, buf->str), "Invalid instruction `%s`", buf->str);
+    ASSERT(mnemonic_to_opcode(&opcode, mnemonic.str, mnemonic.count), "Invalid instruction `%.*s`", (int) mnemonic.count, mnemonic.str);
 
-    LOG("Found instruction `%s`\n", buf->str);
+    LOG("Found instruction `%.*s`\n", (int) mnemonic.count, mnemonic.str);
 
     char c;
 
     switch (opcode) {
-        case PSH: {
-            assemble_ignore_spaces(assembler);
-            c = assembler->code[assembler->current_pos];
+        // Instructions whose u64 operand can be a label
+        case PSH: case JMPI: case JPTI: case JPFI: {
+            assemble_ignore_trivia(assembler);
+            c = assembler->current_pos < assembler->count ? assembler->code[assembler->current_pos] : '\0';
 
             if (c == '\'') {
                 // Handle a label operand
                 assembler->current_pos++;
 
                 bool is_existing = false;
-                HashEntry *label_in_table = assemble_label_literal(assembler, &is_existing);
+                Symbol *label_in_table = assemble_label_literal(assembler, &is_existing);
 
                 u64 operand;
                 if (is_existing) {
@@ -133,29 +241,30 @@ void resolve_instruction(Assembler *assembler, StringBuffer *buf, ProgramBuilder
                     operand = label_id;
                     label_in_table->value = label_id;
                 }
-                emit_push_label(pb, operand);
+                emit_label_instruction(pb, opcode, operand);
             } else {
                 u64 operand = assemble_u64_literal(assembler);
-                emit_push(pb, operand);
+                emit_sized_instruction(pb, opcode, operand);
             }
             
             break;
         }
         case STR: {
-            assemble_ignore_spaces(assembler);
-            StringBuffer literal = assemble_string_literal(assembler);
-
-            emit_str(pb, literal.str);
+            assemble_ignore_trivia(assembler);
+            StringView literal = assemble_string_literal(assembler);
 
-            free_string_buffer(&literal);
+            // Still NUL-terminated, in the scratch buffer
+            emit_str(pb, (char *) literal.str);
             break;
         }
         // All 'Z' instructions have a single u64 operand
         case ADDZ: case SUBZ: case MODZ: case DIVZ: case MULZ:
         case EQUZ: case LTZ: case DBGZ: case INCZ: case DECZ:
         case PSHZ: case DUPZ: case SWPZ: case DRPZ: case OVRZ:
-        case GTZ: case REFZ: case WRTZ: {
-            assemble_ignore_spaces(assembler);
+        case GTZ: case REFZ: case WRTZ:
+        // And so do the arithmetic immediates
+        case ADDI: case SUBI: case MODI: case EQUI: case LTI: case GTI: {
+            assemble_ignore_trivia(assembler);
             u64 operand = assemble_u64_literal(assembler);
             emit_sized_instruction(pb, opcode, operand);
             break;
@@ -167,104 +276,314 @@ void resolve_instruction(Assembler *assembler, StringBuffer *buf, ProgramBuilder
     }
 }
 
-Program assemble(Assembler *assembler) {
-    ProgramBuilder pb = {0};
-    init_program_builder(&pb);
-    StringBuffer buf = {0};
-    init_string_buffer(&buf, 4);
-
-    usize code_len = assembler->count;
-    for (; assembler->current_pos < code_len; assembler->current_pos++) {
-        char c = assembler->code[assembler->current_pos];
-        if (c == '#') { // Ignore comments until new line
-            while (++assembler->current_pos < code_len) {
-                c = assembler->code[assembler->current_pos];
-                if (c == '\n') {
-                    break;
-                }
-            }
-        }
+// `.export <label>` makes a label visible to other modules
+static void assemble_directive(Assembler *assembler, StringView directive) {
+    if (directive.count == 7 && memcmp(directive.str, ".export", 7) == 0) {
+        assemble_ignore_trivia(assembler);
+        StringView name = assemble_word(assembler);
+        ASSERT(name.count > 0, "`.export` needs a label name\n");
 
-        if (isspace(c)) {
-            if (buf.count > 0) {
-                resolve_instruction(assembler, &buf, &pb);
-            } else {
-                continue;
-            }
+        bool existing;
+        intern_symbol(&assembler->exports, name.str, name.count, 0, &existing);
+        return;
+    }
 
-            free_string_buffer(&buf);
-            init_string_buffer(&buf, 4);
+    ERROR("Unknown directive `%.*s`\n", (int) directive.count, directive.str);
+}
 
-            continue;
-        } else if (c == ':') {
+// The line `position` is on. Positions only move forward, so every newline is counted once.
+static u32 line_at(Assembler *assembler, usize position) {
+    const char *code = assembler->code;
+    for (const char *next = &code[assembler->lines_counted_to]; next < &code[position];) {
+        next = memchr(next, '\n', (usize) (&code[position] - next));
+        if (next == NULL) { break; }
+        assembler->line++;
+        next++;
+    }
+    assembler->lines_counted_to = position;
+
+    return (u32) assembler->line;
+}
+
+static void assemble_into(Assembler *assembler, ProgramBuilder *pb) {
+    DebugInfo *debug_info = assembler->debug_info;
+    assembler->line = 1;
+    assembler->lines_counted_to = assembler->current_pos;
+
+    for (;;) {
+        assemble_ignore_trivia(assembler);
+        if (assembler->current_pos >= assembler->count) { break; }
+
+        usize start = assembler->current_pos;
+        StringView word = assemble_word(assembler);
+        if (assembler->current_pos < assembler->count && assembler->code[assembler->current_pos] == ':') {
             assembler->current_pos++;
 
-            HashEntry *entry = find_entry(&assembler->labels, buf.str);
+            bool existing;
+            Symbol *entry = intern_symbol(&assembler->labels, word.str, word.count, 0, &existing);
 
             u64 label_id;
-            if (!entry) {
-                LOG("Found a new label called `%s`\n", buf.str);
-                label_id = create_label(&pb);
-                entry = insert_hash_map(&assembler->labels, buf.str, label_id);
+            if (!existing) {
+                LOG("Found a new label called `%.*s`\n", (int) word.count, word.str);
+                label_id = create_label(pb);
+                entry->value = label_id;
             } else {
                 label_id = entry->value;
             }
 
-            link_label(&pb, label_id);
+            link_label(pb, label_id);
+            if (debug_info != NULL) {
+                add_debug_label(debug_info, pb->bytes_count, word.str, word.count);
+            }
+            continue;
+        }
 
-            free_string_buffer(&buf);
-            init_string_buffer(&buf, 4);
+        if (word.count > 0 && word.str[0] == '.') {
+            assemble_directive(assembler, word);
+            continue;
+        }
+
+        resolve_instruction(assembler, word, pb);
+        if (debug_info != NULL) {
+            add_debug_line(debug_info, pb->last_instruction, line_at(assembler, start));
+        }
+    }
+}
+
+usize scan_source(Assembler *assembler, bool intern_labels) {
+    usize instructions = 0;
+
+    for (;;) {
+        assemble_ignore_trivia(assembler);
+        if (assembler->current_pos >= assembler->count) { break; }
+
+        StringView word = assemble_word(assembler);
+        if (assembler->current_pos < assembler->count && assembler->code[assembler->current_pos] == ':') {
+            assembler->current_pos++;
+            if (intern_labels) {
+                bool existing;
+                intern_symbol(&assembler->labels, word.str, word.count, 0, &existing);
+            }
+            continue;
+        }
 
+        if (word.count > 0 && word.str[0] == '.') {
+            assemble_directive(assembler, word);
             continue;
-        } else if (buf.count == 0) {}
+        }
+
+        OpCode opcode = NOP;
+        ASSERT(mnemonic_to_opcode(&opcode, word.str, word.count), "Invalid instruction `%.*s`", (int) word.count, word.str);
+        instructions++;
+
+        // The same operands resolve_instruction() reads
+        switch (opcode) {
+            case PSH: case JMPI: case JPTI: case JPFI: {
+                assemble_ignore_trivia(assembler);
+                if (assembler->current_pos < assembler->count && assembler->code[assembler->current_pos] == '\'') {
+                    assembler->current_pos++;
+                    if (intern_labels) {
+                        bool existing;
+                        assemble_label_literal(assembler, &existing);
+                    } else {
+                        assemble_operand(assembler);
+                    }
+                } else {
+                    assemble_u64_literal(assembler);
+                }
+                break;
+            }
+            case STR: {
+                assemble_ignore_trivia(assembler);
+                assemble_string_literal(assembler);
+                break;
+            }
+            case ADDZ: case SUBZ: case MODZ: case DIVZ: case MULZ:
+            case EQUZ: case LTZ: case DBGZ: case INCZ: case DECZ:
+            case PSHZ: case DUPZ: case SWPZ: case DRPZ: case OVRZ:
+            case GTZ: case REFZ: case WRTZ:
+            case ADDI: case SUBI: case MODI: case EQUI: case LTI: case GTI: {
+                assemble_ignore_trivia(assembler);
+                assemble_u64_literal(assembler);
+                break;
+            }
+            default: break;
+        }
+    }
+
+    return instructions;
+}
 
-        append_char_string_buffer(&buf, c);
+Program assemble(Assembler *assembler) {
+    // The optimizer works on the instruction list, otherwise the code is encoded as it's read
+    ProgramBuilder pb = {0};
+    ASSERT(!assembler->optimize || assembler->debug_info == NULL, "Line info can't be kept through the optimizer\n");
+    if (assembler->optimize) {
+        init_program_builder(&pb);
+    } else {
+        init_flat_program_builder(&pb);
     }
 
-    if (buf.count > 0) {
-        resolve_instruction(assembler, &buf, &pb);
+    assemble_into(assembler, &pb);
+
+    if (assembler->optimize) {
+        assembler->eliminated = optimize_program_builder(&pb);
     }
 
-    free_string_buffer(&buf);
     Program p = {0};
     clone_to_program(&pb, &p);
+
+    #if DEBUG
     debug_print_program_builder(&pb);
+    #endif // DEBUG
 
     free_program_builder(&pb);
 
     return p;
 }
 
-void debug_print_hash_map(HashMap *map) {
-    printf("Debug Hash Map:\n");
+void assemble_module(Assembler *assembler, Module *module) {
+    ProgramBuilder pb = {0};
+    init_flat_program_builder(&pb);
+    assemble_into(assembler, &pb);
+
+    memset(module, 0, sizeof(Module));
+
+    // The names of every label, copied from the table along with their offsets
+    SymbolTable *labels = &assembler->labels;
+    Symbol **label_symbols = calloc(pb.current_label + 1, sizeof(Symbol *));
+    u32 *import_of = malloc((pb.current_label + 1) * sizeof(u32));
+    module->names = malloc(labels->names.count + 1);
+    module->exports = malloc((assembler->exports.count + 1) * sizeof(ModuleSymbol));
+    module->imports = malloc((pb.current_label + 1) * sizeof(ModuleSymbol));
+    module->relocations = malloc((pb.fixups_count + 1) * sizeof(Relocation));
+    if (label_symbols == NULL || import_of == NULL || module->names == NULL || module->exports == NULL
+        || module->imports == NULL || module->relocations == NULL) {
+        ERROR("Could not allocate the module\n");
+    }
+
+    memcpy(module->names, labels->names.str, labels->names.count);
+    module->names_size = labels->names.count;
+    for (usize i = 0; i < labels->capacity; i++) {
+        Symbol *symbol = &labels->slots[i];
+        if (symbol->hash != 0) {
+            label_symbols[symbol->value] = symbol;
+        }
+    }
+
+    SymbolTable *exports = &assembler->exports;
+    for (usize i = 0; i < exports->capacity; i++) {
+        Symbol *exported = &exports->slots[i];
+        if (exported->hash == 0) { continue; }
+
+        const char *name = symbol_name(exports, exported);
+        Symbol *label = find_symbol(labels, name, exported->name_length);
+        ASSERT(label != NULL && label_is_linked(&pb, (LABEL_T) label->value), "`%s` is exported but never defined\n", name);
+
+        ModuleSymbol *symbol = &module->exports[module->exports_count++];
+        symbol->address = pb.labels[label->value];
+        symbol->name_offset = label->name_offset;
+        symbol->name_length = label->name_length;
+    }
+
+    // Labels defined here are written as offsets in the module, the rest become imports
+    for (usize l = 0; l < pb.current_label; l++) {
+        import_of[l] = (u32) -1;
+    }
+    for (usize i = 0; i < pb.fixups_count; i++) {
+        LabelFixup *fixup = &pb.fixups[i];
+        Relocation *relocation = &module->relocations[module->relocations_count++];
+        relocation->at = fixup->at;
+
+        if (label_is_linked(&pb, (LABEL_T) fixup->label)) {
+            u64 offset = pb.labels[fixup->label];
+            memcpy(&pb.bytes[fixup->at], &offset, sizeof(u64));
+            relocation->kind = RELOCATION_LOCAL;
+            relocation->symbol = 0;
+            continue;
+        }
+
+        if (import_of[fixup->label] == (u32) -1) {
+            Symbol *label = label_symbols[fixup->label];
+            ModuleSymbol *symbol = &module->imports[module->imports_count];
+            symbol->address = 0;
+            symbol->name_offset = label->name_offset;
+            symbol->name_length = label->name_length;
+            import_of[fixup->label] = (u32) module->imports_count++;
+        }
+        memset(&pb.bytes[fixup->at], 0, sizeof(u64));
+        relocation->kind = RELOCATION_IMPORT;
+        relocation->symbol = import_of[fixup->label];
+    }
+
+    // The module keeps the encoded code
+    module->code = pb.bytes;
+    module->size = pb.bytes_count;
+    pb.bytes = NULL;
+
+    free(label_symbols);
+    free(import_of);
+    free_program_builder(&pb);
+}
+
+void debug_print_symbol_table(SymbolTable *table) {
+    printf("Debug Symbol Table:\n");
 
-    for (usize i = 0; i < map->capacity; i++) {
-        HashEntry *bucket = &map->data[i];
+    for (usize i = 0; i < table->capacity; i++) {
+        Symbol *symbol = &table->slots[i];
 
-        if(bucket->taken) {
-            printf("[%zu] `%s` -> %llu\n", i, bucket->key.str, bucket->value);
+        if (symbol->hash != 0) {
+            printf("[%zu] `%s` -> %llu\n", i, symbol_name(table, symbol), symbol->value);
         } else {
-            printf("[%zu] Empty bucket\n", i);
+            printf("[%zu] Empty slot\n", i);
         }
     }
 }
 
-Program assemble_file(char *input_file) {
+Program assemble_source(char *source, usize size, bool optimize, usize *eliminated) {
     Assembler assembler = {0};
     init_assembler(&assembler);
+    assembler.optimize = optimize;
+    assembler.current_pos = 0;
+    assembler.count = size;
+    assembler.code = source;
+
+    Program program = assemble(&assembler);
+    if (eliminated != NULL) {
+        *eliminated = assembler.eliminated;
+    }
+
+    #if DEBUG
+    debug_print_symbol_table(&assembler.labels);
+    #endif // DEBUG
+
+    free_assembler(&assembler);
+
+    return program;
+}
+
+Program assemble_file(char *input_file, bool optimize, usize *eliminated) {
     usize file_size;
     char *contents = read_all_from_file(input_file, &file_size);
 
-    assembler.current_pos = 0;
-    assembler.count = file_size;
+    Program program = assemble_source(contents, file_size, optimize, eliminated);
+    free(contents);
+
+    return program;
+}
+
+Program assemble_file_with_debug_info(char *input_file, DebugInfo *info) {
+    usize file_size;
+    char *contents = read_all_from_file(input_file, &file_size);
+
+    Assembler assembler = {0};
+    init_assembler(&assembler);
     assembler.code = contents;
+    assembler.count = file_size;
+    assembler.debug_info = info;
 
     Program program = assemble(&assembler);
 
-    #if DEBUG
-    debug_print_hash_map(&assembler.labels);
-    #endif // DEBUG
-    
     free_assembler(&assembler);
     free(contents);
 
@@ -0,0 +1,247 @@
+#include "binary.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+_Static_assert(sizeof(BinaryHeader) == 72, "BinaryHeader is part of the file format");
+_Static_assert(sizeof(BinarySymbolEntry) == 16, "BinarySymbolEntry is part of the file format");
+
+static usize align_up(usize value) {
+    return (value + BINARY_ALIGNMENT - 1) & ~(usize) (BINARY_ALIGNMENT - 1);
+}
+
+// FNV-1a, taking 8 bytes at a time and then whatever is left
+static u64 continue_checksum(u64 hash, const u8 *data, usize size) {
+    const u64 prime = 0x100000001b3ull;
+
+    usize i = 0;
+    for (; i + sizeof(u64) <= size; i += sizeof(u64)) {
+        u64 word;
+        memcpy(&word, &data[i], sizeof(u64));
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ data[i]) * prime;
+    }
+
+    return hash;
+}
+
+u64 binary_checksum(const u8 *data, usize size) {
+    return continue_checksum(0xcbf29ce484222325ull, data, size);
+}
+
+// The header with its checksum zeroed, then the rest of the file
+static u64 file_checksum(const u8 *data, usize size) {
+    BinaryHeader header;
+    memcpy(&header, data, sizeof(header));
+    header.checksum = 0;
+
+    u64 hash = binary_checksum((const u8 *) &header, sizeof(header));
+    return continue_checksum(hash, &data[sizeof(BinaryHeader)], size - sizeof(BinaryHeader));
+}
+
+static usize symbol_record_size(usize name_length) {
+    return (sizeof(BinarySymbolEntry) + name_length + sizeof(u64) - 1) & ~(sizeof(u64) - 1);
+}
+
+void write_binary_file(const char *file_path, Program *program, const u8 *rodata, usize rodata_size,
+                       const BinarySymbol *symbols, usize symbols_count) {
+    usize symbols_size = 0;
+    for (usize i = 0; i < symbols_count; i++) {
+        symbols_size += symbol_record_size(symbols[i].name_length);
+    }
+
+    BinaryHeader header = {0};
+    memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+    header.version = BINARY_VERSION;
+    header.header_size = sizeof(BinaryHeader);
+    header.entry = program->entry;
+    header.code.offset = align_up(sizeof(BinaryHeader));
+    header.code.size = program->size;
+    header.rodata.offset = align_up(header.code.offset + header.code.size);
+    header.rodata.size = rodata_size;
+    header.symbols.offset = align_up(header.rodata.offset + header.rodata.size);
+    header.symbols.size = symbols_size;
+
+    // Laid out in memory first, so the checksum can go in the header
+    usize size = header.symbols.offset + symbols_size;
+    u8 *data = calloc(size, sizeof(u8));
+    ASSERT(data != NULL, "Could not allocate %zu bytes for the binary\n", size);
+
+    if (program->size > 0) {
+        memcpy(&data[header.code.offset], program->code, program->size);
+    }
+    if (rodata_size > 0) {
+        memcpy(&data[header.rodata.offset], rodata, rodata_size);
+    }
+
+    u8 *record = &data[header.symbols.offset];
+    for (usize i = 0; i < symbols_count; i++) {
+        BinarySymbolEntry entry = {
+            .address = symbols[i].address,
+            .name_length = (u32) symbols[i].name_length,
+        };
+        memcpy(record, &entry, sizeof(entry));
+        memcpy(record + sizeof(entry), symbols[i].name, symbols[i].name_length);
+        record += symbol_record_size(symbols[i].name_length);
+    }
+
+    memcpy(data, &header, sizeof(header));
+    header.checksum = file_checksum(data, size);
+    memcpy(data, &header, sizeof(header));
+
+    FILE *file = fopen(file_path, "wb");
+    if (file == NULL) {
+        free(data);
+        ERROR("Could not open `%s` for writing\n", file_path);
+    }
+    usize written = fwrite(data, sizeof(u8), size, file);
+    bool closed = fclose(file) == 0;
+    free(data);
+
+    ASSERT(written == size && closed, "Could not write `%s`\n", file_path);
+}
+
+static bool section_in_file(BinarySection section, usize size) {
+    return section.offset >= sizeof(BinaryHeader) && section.offset <= size && section.size <= size - section.offset;
+}
+
+static void release_contents(u8 *data, usize size, bool mapped) {
+    if (mapped) {
+        munmap(data, size);
+    } else {
+        free(data);
+    }
+}
+
+// The contents are released before the error is raised
+#define BINARY_ASSERT(condition, x...) do { \
+    if (!(condition)) { \
+        release_contents(data, size, mapped); \
+        free(symbols); \
+        ERROR("Invalid binary: " x); \
+    } \
+} while(0)
+
+// Takes `data`, malloc()'d or mapped, and only points into it
+static void parse_binary(u8 *data, usize size, bool mapped, BinaryFile *binary) {
+    BinarySymbol *symbols = NULL;
+    BinaryHeader header;
+
+    BINARY_ASSERT(size >= sizeof(BinaryHeader), "%zu bytes is too short for a header\n", size);
+    memcpy(&header, data, sizeof(header));
+
+    BINARY_ASSERT(memcmp(header.magic, BINARY_MAGIC, sizeof(header.magic)) == 0, "wrong magic\n");
+    BINARY_ASSERT(header.version == BINARY_VERSION, "version %u, only %u is supported\n", header.version, BINARY_VERSION);
+    BINARY_ASSERT(header.header_size == sizeof(BinaryHeader), "header of %u bytes\n", header.header_size);
+    BINARY_ASSERT(section_in_file(header.code, size), "the code section is out of the file\n");
+    BINARY_ASSERT(section_in_file(header.rodata, size), "the rodata section is out of the file\n");
+    BINARY_ASSERT(section_in_file(header.symbols, size), "the symbols section is out of the file\n");
+    BINARY_ASSERT(header.entry < header.code.size || header.entry == 0, "entry point %#llx is out of the code\n", header.entry);
+
+    u64 checksum = file_checksum(data, size);
+    BINARY_ASSERT(checksum == header.checksum, "checksum %#llx doesn't match %#llx\n", checksum, header.checksum);
+
+    // Two passes over the symbols: one to count them, one to point at their names
+    usize symbols_count = 0;
+    for (usize pass = 0; pass < 2; pass++) {
+        usize position = 0;
+        usize index = 0;
+        while (position < header.symbols.size) {
+            BINARY_ASSERT(header.symbols.size - position >= sizeof(BinarySymbolEntry), "truncated symbol\n");
+
+            BinarySymbolEntry entry;
+            const u8 *record = &data[header.symbols.offset + position];
+            memcpy(&entry, record, sizeof(entry));
+            BINARY_ASSERT(header.symbols.size - position - sizeof(entry) >= entry.name_length, "truncated symbol name\n");
+
+            if (symbols != NULL) {
+                symbols[index].address = entry.address;
+                symbols[index].name = (const char *) record + sizeof(entry);
+                symbols[index].name_length = entry.name_length;
+            }
+
+            index++;
+            usize record_size = symbol_record_size(entry.name_length);
+            position += record_size < header.symbols.size - position ? record_size : header.symbols.size - position;
+        }
+
+        symbols_count = index;
+        if (pass == 0 && symbols_count > 0) {
+            symbols = malloc(symbols_count * sizeof(BinarySymbol));
+            BINARY_ASSERT(symbols != NULL, "could not allocate %zu symbols\n", symbols_count);
+        } else if (pass == 0) {
+            break;
+        }
+    }
+
+    binary->program = create_program();
+    binary->program.code = &data[header.code.offset];
+    binary->program.size = header.code.size;
+    binary->program.entry = header.entry;
+    binary->program.backing = data;
+    binary->program.mapped_size = mapped ? size : 0;
+    binary->rodata = &data[header.rodata.offset];
+    binary->rodata_size = header.rodata.size;
+    binary->symbols = symbols;
+    binary->symbols_count = symbols_count;
+}
+
+#undef BINARY_ASSERT
+
+void read_binary(u8 *data, usize size, BinaryFile *binary) {
+    parse_binary(data, size, false, binary);
+}
+
+static void advise_sequential(void *data, usize size) {
+#ifdef MADV_SEQUENTIAL
+    madvise(data, size, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+    madvise(data, size, MADV_WILLNEED);
+#endif
+}
+
+// The file is mapped copy-on-write and run from the mapping: nothing is copied, and
+// every process running the same file shares the pages it doesn't write to.
+// Pipes and other things that can't be mapped are read into memory instead.
+void load_binary_file(const char *file_path, BinaryFile *binary) {
+    int fd = open(file_path, O_RDONLY);
+    ASSERT(fd >= 0, "Could not open `%s`\n", file_path);
+
+    struct stat info;
+    bool mappable = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0;
+    if (!mappable) {
+        close(fd);
+
+        usize size;
+        char *contents = read_all_from_file(file_path, &size);
+        parse_binary((u8 *) contents, size, false, binary);
+        return;
+    }
+
+    usize size = (usize) info.st_size;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // The checksum reads all of it right away
+    flags |= MAP_POPULATE;
+#endif
+    // Writable because programs can write through STR pointers, which point into the code.
+    // Private, so those writes copy the page instead of reaching the file.
+    u8 *data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    close(fd);
+    ASSERT(data != MAP_FAILED, "Could not map `%s`\n", file_path);
+    advise_sequential(data, size);
+
+    parse_binary(data, size, true, binary);
+}
+
+void free_binary_file(BinaryFile *binary) {
+    destroy_program(&binary->program);
+    free(binary->symbols);
+    binary->symbols = NULL;
+    binary->symbols_count = 0;
+}
@@ -0,0 +1,148 @@
+#include "cache.h"
+#include "assembler.h"
+#include "binary.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static bool make_directory(const char *path) {
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+// Creates the directory when it isn't there, the parent of the default one included
+static bool cache_directory(StringBuffer *path) {
+    const char *custom = getenv("CVM_CACHE_DIR");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    path->count = 0;
+    if (custom != NULL && *custom != '\0') {
+        append_string_buffer(path, (char *) custom);
+    } else {
+        if (xdg != NULL && *xdg != '\0') {
+            append_string_buffer(path, (char *) xdg);
+        } else if (home != NULL && *home != '\0') {
+            append_string_buffer(path, (char *) home);
+            append_string_buffer(path, "/.cache");
+        } else {
+            return false;
+        }
+        path->str[path->count] = '\0';
+        if (!make_directory(path->str)) { return false; }
+
+        append_string_buffer(path, "/cvm");
+    }
+    path->str[path->count] = '\0';
+
+    return make_directory(path->str);
+}
+
+// The rodata of an entry: how many instructions the optimizer eliminated, then the source
+// it was assembled from, for load_cached() to compare it with the one being run
+#define CACHED_SOURCE_OFFSET sizeof(u64)
+
+// A damaged entry raises an error while loading, which only makes it a miss.
+// So does one saved for another source whose name collided with this one.
+static bool load_cached(const char *path, const char *source, usize size, Program *program, usize *eliminated) {
+    struct stat info;
+    if (stat(path, &info) != 0) { return false; }
+
+    ErrorTrap *previous = error_trap;
+    ErrorTrap trap;
+    error_trap = &trap;
+
+    if (sigsetjmp(trap.jump, 1) == 0) {
+        BinaryFile binary;
+        load_binary_file(path, &binary);
+        error_trap = previous;
+
+        if (binary.rodata_size != CACHED_SOURCE_OFFSET + size ||
+            memcmp(&binary.rodata[CACHED_SOURCE_OFFSET], source, size) != 0) {
+            LOG("Ignoring the cached `%s`: it was assembled from another source\n", path);
+            free_binary_file(&binary);
+            return false;
+        }
+
+        u64 count;
+        memcpy(&count, binary.rodata, sizeof(count));
+        *eliminated = (usize) count;
+
+        free(binary.symbols);
+        *program = binary.program;
+        return true;
+    }
+
+    error_trap = previous;
+    LOG("Ignoring the cached `%s`: %s\n", path, trap.message);
+    return false;
+}
+
+// Written aside and renamed, so a concurrent run never sees half of it
+static void save_cached(const char *path, const char *source, usize size, Program *program, usize eliminated) {
+    u8 *rodata = malloc(CACHED_SOURCE_OFFSET + size);
+    if (rodata == NULL) { return; }
+    u64 count = eliminated;
+    memcpy(rodata, &count, sizeof(count));
+    memcpy(&rodata[CACHED_SOURCE_OFFSET], source, size);
+
+    StringBuffer temporary = create_string_buffer(strlen(path) + 32);
+    append_string_buffer(&temporary, (char *) path);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long) getpid());
+    append_string_buffer(&temporary, suffix);
+    temporary.str[temporary.count] = '\0';
+
+    ErrorTrap *previous = error_trap;
+    ErrorTrap trap;
+    error_trap = &trap;
+
+    if (sigsetjmp(trap.jump, 1) == 0) {
+        write_binary_file(temporary.str, program, rodata, CACHED_SOURCE_OFFSET + size, NULL, 0);
+        if (rename(temporary.str, path) != 0) {
+            unlink(temporary.str);
+        }
+    } else {
+        LOG("Could not save `%s` to the cache: %s", path, trap.message);
+        unlink(temporary.str);
+    }
+
+    error_trap = previous;
+    free_string_buffer(&temporary);
+    free(rodata);
+}
+
+Program assemble_file_cached(char *input_file, bool optimize, usize *eliminated) {
+    usize size;
+    char *source = read_all_from_file(input_file, &size);
+
+    StringBuffer path = create_string_buffer(256);
+    bool cached = cache_directory(&path);
+    if (cached) {
+        // The name says which format, assembler and options it was assembled with, too
+        char name[96];
+        snprintf(name, sizeof(name), "/%016llx-%zu.v%u.a%u%s.bin", binary_checksum((u8 *) source, size),
+                 size, BINARY_VERSION, ASSEMBLER_REVISION, optimize ? ".opt" : "");
+        append_string_buffer(&path, name);
+        path.str[path.count] = '\0';
+    }
+
+    Program program;
+    usize removed = 0;
+    if (cached && load_cached(path.str, source, size, &program, &removed)) {
+        LOG("Running `%s` from `%s`\n", input_file, path.str);
+    } else {
+        program = assemble_source(source, size, optimize, &removed);
+
+        if (cached) {
+            save_cached(path.str, source, size, &program, removed);
+        }
+    }
+    if (eliminated != NULL) {
+        *eliminated = removed;
+    }
+
+    free_string_buffer(&path);
+    free(source);
+    return program;
+}
@@ -1,35 +1,31 @@
 #include "core.h"
 #include <string.h>
+#include <stdarg.h>
 
-#define PRIMES_COUNT 26
-usize capacity_primes[PRIMES_COUNT] = {
-    53,
-    97,
-    193,
-    389,
-    769,
-    1543,
-    3079,
-    6151,
-    12289,
-    24593,
-    49157,
-    98317,
-    196613,
-    393241,
-    786433,
-    1572869,
-    3145739,
-    6291469,
-    12582917,
-    25165843,
-    50331653,
-    100663319,
-    201326611,
-    402653189,
-    805306457,
-    1610612741
-};
+_Thread_local ErrorTrap *error_trap = NULL;
+_Thread_local void (*before_error)(void) = NULL;
+
+void raise_error(const char *format, ...) {
+    // Cleared first, so an error raised from inside it doesn't run it again
+    void (*hook)(void) = before_error;
+    before_error = NULL;
+    if (hook != NULL) {
+        hook();
+    }
+
+    va_list args;
+    va_start(args, format);
+
+    if (error_trap != NULL) {
+        vsnprintf(error_trap->message, sizeof(error_trap->message), format, args);
+        va_end(args);
+        siglongjmp(error_trap->jump, 1);
+    }
+
+    vprintf(format, args);
+    va_end(args);
+    exit(-1);
+}
 
 StringBuffer create_string_buffer(usize initial_capacity) {
     StringBuffer buf = {0};
@@ -42,6 +38,7 @@ void init_string_buffer(StringBuffer* sb, usize initial_capacity) {
     sb->str = calloc(initial_capacity + 1, sizeof(char));
     ASSERT(sb->str != NULL, "Able to allocate initial space for string\n");
     sb->capacity = initial_capacity + 1;
+    sb->count = 0;
 }
 
 void free_string_buffer(StringBuffer* sb) {
@@ -89,171 +86,216 @@ bool strbeingswith(char* str, char* prefix) {
 }
 
 
-// HashMap
-
-HashMap create_hash_map(void) {
-    HashMap map = {0};
-
-    init_hash_map(&map);
+// SymbolTable
 
-    return map;
-}
-
-void init_hash_map(HashMap* map) {
-    map->capacity_prime_index = 0;
-    usize initial_capacity = capacity_primes[0];
+#define INITIAL_SYMBOL_TABLE_CAPACITY 64
 
-    map->data = calloc(initial_capacity, sizeof(HashEntry));
-    if (map->data == NULL) {
-        ERROR("Could not allocate initial space for HashMap.\n");
+// FNV-1a, with the high bits folded in since the slot comes from the low ones
+u64 hash_bytes(const char *str, usize length) {
+    u64 hash = 0xcbf29ce484222325ull;
+    for (usize i = 0; i < length; i++) {
+        hash = (hash ^ (u8) str[i]) * 0x100000001b3ull;
     }
+    hash ^= hash >> 32;
 
-    map->capacity = initial_capacity;
-    map->capacity_prime_index++;
+    // 0 marks the empty slots
+    return hash != 0 ? hash : 1;
 }
 
-void free_hash_map(HashMap* map) {
-    for(usize i = 0; i < map->capacity; i++) {
-        HashEntry *entry = &map->data[i];
-        if (entry->key.capacity > 0) { // FIXME: Puede fallar?
-            free_string_buffer((StringBuffer*) &entry->key); // const cast c:
-        }
+static Symbol *allocate_symbols(usize capacity) {
+    Symbol *slots = calloc(capacity, sizeof(Symbol));
+    if (slots == NULL) {
+        ERROR("Could not allocate %zu symbols\n", capacity);
     }
 
-    free(map->data);
+    return slots;
 }
 
-void grow_hash_map(HashMap* map) {
-    HashEntry *old_entries = map->data;
-    usize old_capacity = map->capacity;
-
-    usize new_capacity;
-    if (map->capacity_prime_index >= PRIMES_COUNT) {
-        new_capacity = old_capacity * 2 + 1;
-    } else {
-        new_capacity = capacity_primes[map->capacity_prime_index++];
-    }
+void init_symbol_table(SymbolTable *table) {
+    table->capacity = INITIAL_SYMBOL_TABLE_CAPACITY;
+    table->slots = allocate_symbols(table->capacity);
+    table->count = 0;
+    init_string_buffer(&table->names, 256);
+}
 
-    map->data = calloc(new_capacity, sizeof(HashEntry));
-    if (map->data == NULL) {
-        ERROR("Could not allocate new space for growing HashMap.\n");
-    }
+void free_symbol_table(SymbolTable *table) {
+    free(table->slots);
+    free_string_buffer(&table->names);
+    table->slots = NULL;
+    table->capacity = table->count = 0;
+}
 
-    map->capacity = new_capacity;
+static usize probe_distance(SymbolTable *table, u64 hash, usize index) {
+    return (index - (usize) hash) & (table->capacity - 1);
+}
 
-    for(usize i = 0; i < old_capacity; i++) {
-        HashEntry *bucket = &old_entries[i];
+// Robin Hood: a symbol further from its home slot than the one in its way takes
+// that slot, and the one it displaced keeps looking. Returns where `symbol` ended up.
+static Symbol *place_symbol(SymbolTable *table, Symbol symbol) {
+    usize mask = table->capacity - 1;
+    usize index = (usize) symbol.hash & mask;
+    usize distance = 0;
+    Symbol *placed = NULL;
+
+    for (;;) {
+        Symbol *slot = &table->slots[index];
+        if (slot->hash == 0) {
+            *slot = symbol;
+            return placed != NULL ? placed : slot;
+        }
 
-        if (bucket->taken && bucket->key.capacity > 0) {
-            insert_hash_map(map, bucket->key.str, bucket->value); // FIXME: This remakes the StringBuffer.
-            free_string_buffer(&bucket->key);
+        usize slot_distance = probe_distance(table, slot->hash, index);
+        if (slot_distance < distance) {
+            Symbol displaced = *slot;
+            *slot = symbol;
+            if (placed == NULL) {
+                placed = slot;
+            }
+            symbol = displaced;
+            distance = slot_distance;
         }
+
+        index = (index + 1) & mask;
+        distance++;
     }
-    
-    free(old_entries);
 }
 
-// https://github.com/haipome/fnv
-u64 hash_string(char *str)
-{
-    u64 hval = 0xcbf29ce484222325ULL;
-    u8 *s = (u8*)str;	/* unsigned string */
-
-    /*
-     * FNV-1 hash each octet of the string
-     */
-    while (*s) {
-        hval += (hval << 1) + (hval << 4) + (hval << 5) +
-            (hval << 7) + (hval << 8) + (hval << 40);
-
-        /* xor the bottom with the current octet */
-        hval ^= (u64)*s++;
+// The names stay where they are, only the slots move
+static void grow_symbol_table(SymbolTable *table) {
+    Symbol *old_slots = table->slots;
+    usize old_capacity = table->capacity;
+
+    table->capacity = old_capacity * 2;
+    table->slots = allocate_symbols(table->capacity);
+    for (usize i = 0; i < old_capacity; i++) {
+        if (old_slots[i].hash != 0) {
+            place_symbol(table, old_slots[i]);
+        }
     }
 
-    /* return our new hash value */
-    return hval;
+    free(old_slots);
 }
 
-HashEntry *find_entry(HashMap* map, char* key) {
-    u64 hash = hash_string(key);
+static bool symbol_matches(SymbolTable *table, Symbol *symbol, u64 hash, const char *key, usize length) {
+    return symbol->hash == hash && symbol->name_length == length
+        && memcmp(&table->names.str[symbol->name_offset], key, length) == 0;
+}
 
-    usize index = hash % map->capacity;
+static Symbol *find_symbol_with_hash(SymbolTable *table, const char *key, usize length, u64 hash) {
+    usize mask = table->capacity - 1;
+    usize index = (usize) hash & mask;
 
-    VERBOSE_LOG("Finding value for `%s`\n", key);
-    VERBOSE_LOG("The hash for `%s` is: 0x%llx\n", key, hash);
-    VERBOSE_LOG("The first bucket selected is %zu\n", index);
+    // Nothing past a symbol closer to its home slot than this one would be
+    for (usize distance = 0;; distance++) {
+        Symbol *slot = &table->slots[index];
+        if (slot->hash == 0 || probe_distance(table, slot->hash, index) < distance) {
+            return NULL;
+        }
+        if (symbol_matches(table, slot, hash, key, length)) {
+            return slot;
+        }
 
-    HashEntry *bucket = &map->data[index];
-    if (bucket->taken) {
-        return bucket;
+        index = (index + 1) & mask;
     }
+}
 
-    return NULL;
+Symbol *find_symbol(SymbolTable *table, const char *key, usize length) {
+    return find_symbol_with_hash(table, key, length, hash_bytes(key, length));
 }
 
-HashEntry *insert_hash_map(HashMap *map, char *key, u64 value) {
-    float usage = 1.0 * map->count / map->capacity;
-    if (usage > 0.75) {
-        grow_hash_map(map);
-    }
-    
-    u64 hash = hash_string(key);
-
-    u64 index = hash%map->capacity;
-    u64 original_index = index;
-
-    VERBOSE_LOG("Inserting value for `%s`\n", key);
-    VERBOSE_LOG("The hash for `%s` is: 0x%llx\n", key, hash);
-    VERBOSE_LOG("The first bucket selected is %llu\n", index);
-    HashEntry *bucket = &map->data[index];
-    while (bucket->taken) {
-        if (strcmp(bucket->key.str, key) == 0) {
-            // If it exists, just update the value.
-            bucket->value = value;
-            return bucket;
-        }
+Symbol *intern_symbol(SymbolTable *table, const char *key, usize length, u64 value, bool *existed) {
+    u64 hash = hash_bytes(key, length);
 
-        index = (index + 1) % map->capacity;
-        if (index == original_index) {
-            // Could not find a valid bucket. Should grow.
-            ERROR("Could not find a valid bucket. TODO: This should never happen.");
-        }
+    Symbol *found = find_symbol_with_hash(table, key, length, hash);
+    if (existed != NULL) {
+        *existed = found != NULL;
+    }
+    if (found != NULL) {
+        return found;
     }
 
-    if (!bucket->taken) {
-        if (bucket->key.capacity > 0) {
-            free_string_buffer((StringBuffer *)&bucket->key);
-        }
-        StringBuffer new_key = create_string_buffer(strlen(key));
-
-        append_string_buffer(&new_key, key);
-        bucket->key = new_key;
-        bucket->value = value;
-        bucket->taken = true;
-        map->count++;
-
-        return bucket;
+    // Kept at most 7/8 full
+    if ((table->count + 1) * 8 > table->capacity * 7) {
+        grow_symbol_table(table);
     }
 
-    return NULL;
+    StringBuffer *names = &table->names;
+    ASSERT(names->count + length < (u32) -1, "Too many symbol names\n");
+    grow_string_buffer_to_fit(names, length + 1);
+
+    Symbol symbol = {
+        .hash = hash,
+        .name_offset = (u32) names->count,
+        .name_length = (u32) length,
+        .value = value,
+    };
+    memcpy(&names->str[names->count], key, length);
+    names->str[names->count + length] = '\0';
+    names->count += length + 1;
+
+    table->count++;
+    return place_symbol(table, symbol);
 }
 
+const char *symbol_name(SymbolTable *table, Symbol *symbol) {
+    return &table->names.str[symbol->name_offset];
+}
+
+// Files that can tell their size are read in one go, pipes in chunks that keep doubling.
+// The buffer is one byte bigger than the file, so a short read tells it's over.
 char *read_all_from_file(const char *file_path, usize *length) {
     FILE *file = fopen(file_path, "rb");
     ASSERT(file != NULL, "Able to open file\n");
 
-    char *file_contents = NULL;
-    (void)file_contents;
-    fseek(file, 0l, SEEK_END);
-    usize file_size = ftell(file);
-    rewind(file);
+    usize capacity = 4096;
+    if (fseek(file, 0l, SEEK_END) == 0) {
+        long file_size = ftell(file);
+        if (file_size >= 0) {
+            capacity = (usize) file_size + 1;
+        }
+        rewind(file);
+    }
+
+    char *output = malloc(capacity);
+    ASSERT(output != NULL, "Could not allocate %zu bytes for `%s`\n", capacity, file_path);
+
+    usize count = 0;
+    for (;;) {
+        count += fread(output + count, sizeof(char), capacity - count, file);
+        if (count < capacity) { break; }
 
-    char *output = calloc(file_size, sizeof(char));
-    fread(output, sizeof(char), file_size, file);
+        capacity *= 2;
+        output = realloc(output, capacity);
+        ASSERT(output != NULL, "Could not allocate %zu bytes for `%s`\n", capacity, file_path);
+    }
 
     fclose(file);
 
-    *length = file_size;
+    *length = count;
 
     return output;
 }
+
+#if COUNT_ALLOCATIONS
+// The real ones from here on
+#undef malloc
+#undef calloc
+#undef realloc
+
+_Atomic usize allocation_count = 0;
+
+void *counted_malloc(usize size) {
+    allocation_count++;
+    return malloc(size);
+}
+
+void *counted_calloc(usize count, usize size) {
+    allocation_count++;
+    return calloc(count, size);
+}
+
+void *counted_realloc(void *pointer, usize size) {
+    allocation_count++;
+    return realloc(pointer, size);
+}
+#endif // COUNT_ALLOCATIONS
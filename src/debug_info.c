@@ -0,0 +1,88 @@
+#include "debug_info.h"
+#include <string.h>
+
+void init_debug_info(DebugInfo *info, const char *file) {
+    memset(info, 0, sizeof(DebugInfo));
+    info->file = file;
+    init_string_buffer(&info->names, 256);
+}
+
+void free_debug_info(DebugInfo *info) {
+    free(info->lines);
+    free(info->labels);
+    free_string_buffer(&info->names);
+    memset(info, 0, sizeof(DebugInfo));
+}
+
+#define GROW_ARRAY(array, count, capacity) do { \
+    if ((count) == (capacity)) { \
+        (capacity) = (capacity) == 0 ? 256 : (capacity) * 2; \
+        (array) = realloc((array), (capacity) * sizeof(*(array))); \
+        ASSERT((array) != NULL, "Could not grow the debug info\n"); \
+    } \
+} while(0)
+
+void add_debug_line(DebugInfo *info, u64 address, u32 line) {
+    u32 label = info->labels_count > 0 ? (u32) (info->labels_count - 1) : NO_DEBUG_LABEL;
+
+    if (info->lines_count > 0) {
+        LineEntry *last = &info->lines[info->lines_count - 1];
+        // Fused into the previous instruction, or still the same line
+        if (last->address == address || (last->line == line && last->label == label)) {
+            return;
+        }
+    }
+
+    GROW_ARRAY(info->lines, info->lines_count, info->lines_capacity);
+    LineEntry entry = { .address = address, .line = line, .label = label };
+    info->lines[info->lines_count++] = entry;
+}
+
+void add_debug_label(DebugInfo *info, u64 address, const char *name, usize length) {
+    GROW_ARRAY(info->labels, info->labels_count, info->labels_capacity);
+
+    DebugLabel label = {
+        .address = address,
+        .name_offset = (u32) info->names.count,
+        .name_length = (u32) length,
+    };
+    grow_string_buffer_to_fit(&info->names, length + 1);
+    memcpy(&info->names.str[info->names.count], name, length);
+    info->names.str[info->names.count + length] = '\0';
+    info->names.count += length + 1;
+
+    info->labels[info->labels_count++] = label;
+}
+
+#undef GROW_ARRAY
+
+const LineEntry *find_debug_line(const DebugInfo *info, u64 address) {
+    // The last entry starting at or before the address
+    usize low = 0;
+    usize high = info->lines_count;
+    while (low < high) {
+        usize middle = low + (high - low) / 2;
+        if (info->lines[middle].address <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low > 0 ? &info->lines[low - 1] : NULL;
+}
+
+const char *find_debug_label(const DebugInfo *info, u64 address) {
+    usize low = 0;
+    usize high = info->labels_count;
+    while (low < high) {
+        usize middle = low + (high - low) / 2;
+        if (info->labels[middle].address <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low > 0 ? &info->names.str[info->labels[low - 1].name_offset] : NULL;
+}
@@ -0,0 +1,160 @@
+#include "decoder.h"
+#include <string.h>
+
+static usize instruction_size_at(Program *program, usize pc) {
+    OpCode op = program->code[pc];
+    usize size = 1 + opcode_immediate_size(op);
+    ASSERT(pc + size <= program->size, "Truncated %s instruction at 0x%zx\n", opcode_to_str(op), pc);
+
+    if (op == STR) {
+        u64 str_length;
+        memcpy(&str_length, &program->code[pc + 1], sizeof(u64));
+        ASSERT(str_length <= program->size - pc - size, "String at 0x%zx runs past the end of the program\n", pc);
+        size += str_length;
+    }
+
+    return size;
+}
+
+static u64 read_u64_at(Program *program, usize pc) {
+    u64 value;
+    memcpy(&value, &program->code[pc], sizeof(u64));
+    return value;
+}
+
+u32 decoded_index_of(DecodedProgram *decoded, u64 address) {
+    if (address >= decoded->program->size) {
+        return decoded->count; // The HLT sentinel
+    }
+
+    return decoded->index_of[address];
+}
+
+void decode_program(Program *program, DecodedProgram *decoded, MemoryModel memory) {
+    ASSERT(program->size < NO_INSTRUCTION, "Program is too large to decode (%zu bytes)\n", program->size);
+
+    // A sandboxed VM has the program at the start of its linear memory
+    u64 code_address = memory == MEMORY_SANDBOXED ? 0 : (u64) program->code;
+
+    decoded->program = program;
+    decoded->memory = memory;
+    decoded->index_of = malloc((program->size + 1) * sizeof(u32));
+    if (decoded->index_of == NULL) {
+        ERROR("Could not allocate the memory for the decoded program index\n");
+    }
+
+    // First, find the instruction boundaries
+    usize count = 0;
+    for (usize pc = 0; pc < program->size; pc++) {
+        decoded->index_of[pc] = NO_INSTRUCTION;
+    }
+    for (usize pc = 0; pc < program->size; pc += instruction_size_at(program, pc)) {
+        decoded->index_of[pc] = count++;
+    }
+    decoded->index_of[program->size] = count;
+    decoded->count = count;
+
+    decoded->instructions = calloc(count + 1, sizeof(DecodedInstruction));
+    if (decoded->instructions == NULL) {
+        ERROR("Could not allocate the memory for the decoded program\n");
+    }
+
+    // Then decode every instruction, resolving immediates and jump targets
+    usize index = 0;
+    for (usize pc = 0; pc < program->size; pc += instruction_size_at(program, pc)) {
+        DecodedInstruction *inst = &decoded->instructions[index++];
+        OpCode op = program->code[pc];
+        inst->opcode = op;
+        inst->addr = pc;
+
+        switch (op) {
+            case PSH: {
+                inst->a = read_u64_at(program, pc + 1);
+
+                // A pushed address that is immediately jumped to can be resolved now.
+                // The transfer instruction stays in the next slot in case something jumps to it.
+                usize next = pc + 1 + sizeof(u64);
+                if (next >= program->size) { break; }
+
+                u32 target = decoded_index_of(decoded, inst->a);
+                if (target == NO_INSTRUCTION) { break; }
+
+                u16 fused = PSH;
+                switch (program->code[next]) {
+                    case JMP: fused = PJMP; break;
+                    case JPT: fused = PJPT; break;
+                    case JPF: fused = PJPF; break;
+                    case CLL: fused = PCLL; break;
+                    default: break;
+                }
+
+                if (fused != PSH) {
+                    inst->opcode = fused;
+                    inst->b = inst->a;
+                    inst->a = target;
+                }
+                break;
+            }
+            case JMPI: case JPTI: case JPFI: {
+                inst->b = read_u64_at(program, pc + 1);
+
+                u32 target = decoded_index_of(decoded, inst->b);
+                if (target == NO_INSTRUCTION) {
+                    inst->opcode = BADJ;
+                }
+                inst->a = target;
+                break;
+            }
+            case PS8: {
+                inst->a = program->code[pc + 1];
+                break;
+            }
+            case STR: {
+                inst->b = read_u64_at(program, pc + 1);
+                inst->a = code_address + pc + 1 + sizeof(u64);
+                break;
+            }
+            case DUPZ: {
+                inst->a = read_u64_at(program, pc + 1);
+                inst->b = read_u64_at(program, pc + 1 + sizeof(u64));
+                break;
+            }
+            default: {
+                if (opcode_immediate_size(op) == sizeof(u64)) {
+                    inst->a = read_u64_at(program, pc + 1);
+                }
+                break;
+            }
+        }
+    }
+
+    DecodedInstruction *sentinel = &decoded->instructions[count];
+    sentinel->opcode = HLT;
+    sentinel->addr = program->size;
+
+    LOG("Decoded %zu instructions from %zu bytes\n", count, program->size);
+}
+
+void free_decoded_program(DecodedProgram *decoded) {
+    free(decoded->instructions);
+    free(decoded->index_of);
+    decoded->instructions = NULL;
+    decoded->index_of = NULL;
+    decoded->count = 0;
+}
+
+char *decoded_opcode_to_str(u16 opcode) {
+    #define X(name, val) case name: return #name;
+    switch (opcode) {
+        DECODED_OPCODES
+        default: return opcode_to_str(opcode);
+    }
+    #undef X
+}
+
+void debug_print_decoded_program(DecodedProgram *decoded) {
+    for (usize i = 0; i <= decoded->count; i++) {
+        DecodedInstruction *inst = &decoded->instructions[i];
+        printf("  #%-5zu [0x%03x]\t%-4s 0x%08llx 0x%08llx\n", i, inst->addr, decoded_opcode_to_str(inst->opcode), inst->a, inst->b);
+    }
+}
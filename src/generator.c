@@ -0,0 +1,258 @@
+#include "generator.h"
+#include "opcodes.h"
+#include <string.h>
+
+GeneratorConfig default_generator_config(usize instructions) {
+    GeneratorConfig config = {
+        .instructions = instructions,
+        .label_every = 8,
+        .strings = instructions / 100,
+        .comment_percent = 10,
+        .seed = 0x5EED,
+    };
+    return config;
+}
+
+typedef enum {
+    GENERATED_PLAIN,
+    GENERATED_PUSH,
+    GENERATED_PUSH_LABEL,
+    GENERATED_STR,
+} GeneratedKind;
+
+typedef struct {
+    GeneratedKind kind;
+    OpCode opcode;      // For plain instructions
+    u64 value;          // Pushed value, or label number
+    bool label_before;  // Label number `label` is defined before it
+    usize label;
+    bool comment_before;
+} GeneratedInstruction;
+
+typedef struct {
+    const GeneratorConfig *config;
+    u64 state;
+    usize count;        // Instructions in the program
+    usize labels;
+    usize string_every;
+    usize blocks;       // Of a program that runs
+} Generator;
+
+// A program that runs is `PSH passes`, the blocks, then the end of the loop
+#define BLOCK_SIZE 6
+#define LOOP_END_SIZE 8
+
+static usize running_blocks(const GeneratorConfig *config) {
+    ASSERT(config->instructions >= 1 + BLOCK_SIZE + LOOP_END_SIZE,
+           "A program that runs needs at least %d instructions\n", 1 + BLOCK_SIZE + LOOP_END_SIZE);
+    return (config->instructions - 1 - LOOP_END_SIZE) / BLOCK_SIZE;
+}
+
+usize generated_instruction_count(const GeneratorConfig *config) {
+    if (config->passes > 0) {
+        return 1 + running_blocks(config) * BLOCK_SIZE + LOOP_END_SIZE;
+    }
+    return config->instructions;
+}
+
+static void init_generator(Generator *generator, const GeneratorConfig *config) {
+    generator->config = config;
+    generator->state = config->seed != 0 ? config->seed : 1;
+    generator->count = generated_instruction_count(config);
+
+    if (config->passes > 0) {
+        generator->blocks = running_blocks(config);
+        // One at the start of every block, and one where the loop ends
+        generator->labels = generator->blocks + 1;
+        generator->string_every = 0;
+        return;
+    }
+
+    ASSERT(config->strings <= config->instructions, "Can't generate %zu strings in %zu instructions\n", config->strings, config->instructions);
+    generator->labels = config->label_every > 0 ? (config->instructions + config->label_every - 1) / config->label_every : 0;
+    generator->string_every = config->strings > 0 ? config->instructions / config->strings : 0;
+    generator->blocks = 0;
+}
+
+// xorshift64
+static u64 next_random(Generator *generator) {
+    u64 x = generator->state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    generator->state = x;
+    return x;
+}
+
+// Block `n` is `PSH n DUP ADD DRP PSH 'l<n+1> JMP`, the loop starts at `l0` and ends at `l<blocks>`
+static GeneratedInstruction generate_running_instruction(Generator *generator, usize index) {
+    GeneratedInstruction instruction = {0};
+    instruction.kind = GENERATED_PLAIN;
+    instruction.comment_before = next_random(generator) % 100 < generator->config->comment_percent;
+
+    if (index == 0) {
+        instruction.kind = GENERATED_PUSH;
+        instruction.value = generator->config->passes;
+        return instruction;
+    }
+
+    usize block = (index - 1) / BLOCK_SIZE;
+    usize offset = (index - 1) % BLOCK_SIZE;
+    instruction.label_before = offset == 0;
+    instruction.label = block;
+
+    if (block < generator->blocks) {
+        switch (offset) {
+            case 0: instruction.kind = GENERATED_PUSH; instruction.value = block; break;
+            case 1: instruction.opcode = DUP; break;
+            case 2: instruction.opcode = ADD; break;
+            case 3: instruction.opcode = DRP; break;
+            case 4: instruction.kind = GENERATED_PUSH_LABEL; instruction.value = block + 1; break;
+            default: instruction.opcode = JMP; break;
+        }
+        return instruction;
+    }
+
+    // The end of the loop, at label `blocks`
+    usize end = index - 1 - generator->blocks * BLOCK_SIZE;
+    instruction.label_before = end == 0;
+    switch (end) {
+        case 0: instruction.opcode = DEC; break;
+        case 1: instruction.opcode = DUP; break;
+        case 2: instruction.kind = GENERATED_PUSH; instruction.value = 0; break;
+        case 3: instruction.opcode = GT; break;
+        case 4: instruction.kind = GENERATED_PUSH_LABEL; instruction.value = 0; break;
+        case 5: instruction.opcode = JPT; break;
+        case 6: instruction.opcode = DRP; break;
+        default: instruction.opcode = EXT; break;
+    }
+    return instruction;
+}
+
+static GeneratedInstruction generate_instruction(Generator *generator, usize index) {
+    if (generator->config->passes > 0) {
+        return generate_running_instruction(generator, index);
+    }
+
+    const GeneratorConfig *config = generator->config;
+    GeneratedInstruction instruction = {0};
+    instruction.kind = GENERATED_PLAIN;
+    instruction.label_before = config->label_every > 0 && index % config->label_every == 0;
+    instruction.label = instruction.label_before ? index / config->label_every : 0;
+    instruction.comment_before = next_random(generator) % 100 < config->comment_percent;
+
+    if (index + 1 == config->instructions) {
+        instruction.opcode = EXT;
+        return instruction;
+    }
+    if (generator->string_every > 0 && index % generator->string_every == generator->string_every - 1) {
+        instruction.kind = GENERATED_STR;
+        return instruction;
+    }
+
+    u64 random = next_random(generator);
+    switch (random % 8) {
+        case 0: case 1: case 2: {
+            instruction.kind = GENERATED_PUSH;
+            // Mostly small numbers, some that take all 8 bytes
+            instruction.value = (random >> 3) >> ((random >> 3) % 64);
+        } break;
+        case 3: instruction.opcode = DUP; break;
+        case 4: instruction.opcode = SWP; break;
+        case 5: instruction.opcode = ADD; break;
+        case 6: {
+            if (generator->labels == 0) {
+                instruction.opcode = DRP;
+                break;
+            }
+            // The label this block starts at, or the next one, which isn't defined yet
+            usize label = index / config->label_every + (random >> 3) % 2;
+            instruction.kind = GENERATED_PUSH_LABEL;
+            instruction.value = label < generator->labels ? label : generator->labels - 1;
+        } break;
+        default: instruction.opcode = DRP; break;
+    }
+
+    return instruction;
+}
+
+static void append_formatted(StringBuffer *source, const char *format, u64 value) {
+    char text[64];
+    snprintf(text, sizeof(text), format, value);
+    append_string_buffer(source, text);
+}
+
+void generate_source(const GeneratorConfig *config, StringBuffer *source) {
+    Generator generator;
+    init_generator(&generator, config);
+
+    append_formatted(source, "# Generated: %llu instructions\n", generator.count);
+    for (usize i = 0; i < generator.count; i++) {
+        GeneratedInstruction instruction = generate_instruction(&generator, i);
+
+        if (instruction.label_before) {
+            append_formatted(source, "l%llu:\n", instruction.label);
+        }
+        if (instruction.comment_before) {
+            append_formatted(source, "    # Instruction %llu, nothing to see here\n", i);
+        }
+
+        switch (instruction.kind) {
+            case GENERATED_PLAIN: {
+                // Mnemonics are written in lower case, like the examples
+                append_string_buffer(source, "    ");
+                for (const char *c = opcode_to_str(instruction.opcode); *c != '\0' && *c != ' '; c++) {
+                    append_char_string_buffer(source, (char) (*c | 0x20));
+                }
+                append_char_string_buffer(source, '\n');
+            } break;
+            case GENERATED_PUSH: append_formatted(source, "    psh %llu\n", instruction.value); break;
+            case GENERATED_PUSH_LABEL: append_formatted(source, "    psh 'l%llu\n", instruction.value); break;
+            case GENERATED_STR: append_formatted(source, "    str \"String number %llu\\n\"\n", i); break;
+        }
+    }
+
+    grow_string_buffer_to_fit(source, 1);
+    source->str[source->count] = '\0';
+}
+
+void generate_program(const GeneratorConfig *config, ProgramBuilder *builder) {
+    Generator generator;
+    init_generator(&generator, config);
+
+    // Labels get created when they first show up, the way the assembler numbers them
+    LABEL_T *label_ids = malloc((generator.labels + 1) * sizeof(LABEL_T));
+    ASSERT(label_ids != NULL, "Could not allocate the labels of a generated program\n");
+    memset(label_ids, 0xFF, (generator.labels + 1) * sizeof(LABEL_T));
+
+    char text[64];
+    for (usize i = 0; i < generator.count; i++) {
+        GeneratedInstruction instruction = generate_instruction(&generator, i);
+
+        if (instruction.label_before) {
+            usize label = instruction.label;
+            if (label_ids[label] == (LABEL_T) -1) {
+                label_ids[label] = create_label(builder);
+            }
+            link_label(builder, label_ids[label]);
+        }
+
+        switch (instruction.kind) {
+            case GENERATED_PLAIN: emit_plain_instruction(builder, instruction.opcode); break;
+            case GENERATED_PUSH: emit_sized_instruction(builder, PSH, instruction.value); break;
+            case GENERATED_PUSH_LABEL: {
+                usize label = instruction.value;
+                if (label_ids[label] == (LABEL_T) -1) {
+                    label_ids[label] = create_label(builder);
+                }
+                emit_label_instruction(builder, PSH, label_ids[label]);
+            } break;
+            case GENERATED_STR: {
+                snprintf(text, sizeof(text), "String number %zu\n", i);
+                emit_str(builder, text);
+            } break;
+        }
+    }
+
+    free(label_ids);
+}
@@ -0,0 +1,249 @@
+#include "heap.h"
+#include <string.h>
+
+#define HEAP_MAGIC 0x4845
+#define LARGE_CLASS 0xFF
+#define FREED_CLASS 0xFE
+
+// Right before every pointer handed out, keeps it 16-byte aligned
+typedef struct {
+    usize size;     // Usable bytes
+    u16 magic;
+    u8 size_class;  // LARGE_CLASS for big ones, FREED_CLASS once it's freed
+    u8 padding[5];
+} HeapHeader;
+
+_Static_assert(sizeof(HeapHeader) == 16, "HeapHeader must keep allocations 16-byte aligned");
+_Static_assert(sizeof(LargeAllocation) % 16 == 0, "LargeAllocation must keep allocations 16-byte aligned");
+
+static usize class_size(usize size_class) {
+    return (usize) 1 << (size_class + HEAP_MIN_CLASS_SHIFT);
+}
+
+static usize size_class_for(usize size) {
+    usize size_class = 0;
+    while (class_size(size_class) < size) {
+        size_class++;
+    }
+
+    return size_class;
+}
+
+static HeapChunk *new_chunk(HeapChunk *next) {
+    HeapChunk *chunk = malloc(sizeof(HeapChunk) + HEAP_CHUNK_SIZE);
+    if (chunk == NULL) {
+        ERROR("Could not allocate a heap chunk\n");
+    }
+
+    chunk->next = next;
+    chunk->used = 0;
+    return chunk;
+}
+
+void init_vm_heap(VMHeap *heap, usize quota) {
+    memset(heap, 0, sizeof(VMHeap));
+    heap->quota = quota;
+}
+
+static void release_allocations(VMHeap *heap, HeapChunk *keep) {
+    if (heap->region != NULL) {
+        // Nothing of the region is kept in lists, it's all bumped again from the start
+        memset(heap->free_lists, 0, sizeof(heap->free_lists));
+        heap->free_large = NULL;
+        heap->region_used = 0;
+        heap->used = 0;
+        return;
+    }
+
+    HeapChunk *chunk = heap->chunks;
+    while (chunk != NULL) {
+        HeapChunk *next = chunk->next;
+        if (chunk != keep) {
+            free(chunk);
+        }
+        chunk = next;
+    }
+
+    LargeAllocation *large = heap->large;
+    while (large != NULL) {
+        LargeAllocation *next = large->next;
+        free(large);
+        large = next;
+    }
+
+    memset(heap->free_lists, 0, sizeof(heap->free_lists));
+    heap->large = NULL;
+    heap->used = 0;
+
+    heap->chunks = keep;
+    if (keep != NULL) {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+}
+
+void free_vm_heap(VMHeap *heap) {
+    release_allocations(heap, NULL);
+}
+
+void reset_vm_heap(VMHeap *heap) {
+    // The last chunk of the list is the oldest, and usually the only one
+    HeapChunk *first = heap->chunks;
+    while (first != NULL && first->next != NULL) {
+        first = first->next;
+    }
+
+    release_allocations(heap, first);
+}
+
+void use_heap_region(VMHeap *heap, u8 *region, usize size) {
+    release_allocations(heap, NULL);
+
+    heap->region = region;
+    heap->region_size = size;
+    heap->region_used = 0;
+}
+
+// The program can write over everything in its region, so a block found in it
+// is only used once it's known to be inside
+static bool in_region(VMHeap *heap, const void *pointer, usize size) {
+    const u8 *start = pointer;
+    return start >= heap->region && size <= heap->region_size
+        && (usize) (start - heap->region) <= heap->region_size - size;
+}
+
+static void *bump_region(VMHeap *heap, usize size) {
+    size = (size + 15) & ~(usize) 15;
+    if (size > heap->region_size - heap->region_used) {
+        ERROR("Out of linear memory: %zu bytes requested, %zu left\n", size, heap->region_size - heap->region_used);
+    }
+
+    void *block = &heap->region[heap->region_used];
+    heap->region_used += size;
+    return block;
+}
+
+static void *bump(VMHeap *heap, usize size) {
+    if (heap->region != NULL) {
+        return bump_region(heap, size);
+    }
+
+    HeapChunk *chunk = heap->chunks;
+    if (chunk == NULL || chunk->used + size > HEAP_CHUNK_SIZE) {
+        chunk = new_chunk(heap->chunks);
+        heap->chunks = chunk;
+    }
+
+    void *block = &chunk->data[chunk->used];
+    chunk->used += size;
+    return block;
+}
+
+// Big blocks of a region keep their size once freed, their link goes after the header
+static HeapHeader *take_large_from_region(VMHeap *heap, usize size) {
+    HeapBlock **link = &heap->free_large;
+    while (*link != NULL) {
+        HeapBlock *block = *link;
+        HeapHeader *header = (HeapHeader *) block - 1;
+        if (!in_region(heap, header, sizeof(HeapHeader) + sizeof(HeapBlock))
+            || !in_region(heap, header, sizeof(HeapHeader) + header->size)) {
+            ERROR("The heap was overwritten: a freed block is outside of linear memory\n");
+        }
+
+        if (header->size >= size) {
+            *link = block->next;
+            return header;
+        }
+        link = &block->next;
+    }
+
+    HeapHeader *header = bump_region(heap, sizeof(HeapHeader) + size);
+    header->size = size;
+    return header;
+}
+
+void *heap_allocate(VMHeap *heap, usize size) {
+    usize size_class = size <= HEAP_MAX_CLASS_SIZE ? size_class_for(size) : LARGE_CLASS;
+    usize usable = size_class == LARGE_CLASS ? size : class_size(size_class);
+
+    if (heap->quota > 0 && usable > heap->quota - heap->used) {
+        ERROR("Heap quota of %zu bytes exceeded: %zu in use, %zu more requested\n", heap->quota, heap->used, size);
+    }
+
+    HeapHeader *header;
+    if (size_class == LARGE_CLASS && heap->region != NULL) {
+        header = take_large_from_region(heap, size);
+        usable = header->size;
+    } else if (size_class == LARGE_CLASS) {
+        LargeAllocation *large = malloc(sizeof(LargeAllocation) + sizeof(HeapHeader) + size);
+        if (large == NULL) {
+            ERROR("Could not allocate %zu bytes\n", size);
+        }
+
+        large->previous = NULL;
+        large->next = heap->large;
+        if (heap->large != NULL) {
+            heap->large->previous = large;
+        }
+        heap->large = large;
+        header = (HeapHeader *) (large + 1);
+    } else if (heap->free_lists[size_class] != NULL) {
+        HeapBlock *block = heap->free_lists[size_class];
+        if (heap->region != NULL && !in_region(heap, block, sizeof(HeapHeader) + usable)) {
+            ERROR("The heap was overwritten: a freed block is outside of linear memory\n");
+        }
+        heap->free_lists[size_class] = block->next;
+        header = (HeapHeader *) block;
+    } else {
+        header = bump(heap, sizeof(HeapHeader) + usable);
+    }
+
+    header->size = usable;
+    header->magic = HEAP_MAGIC;
+    header->size_class = (u8) size_class;
+    heap->used += usable;
+
+    return header + 1;
+}
+
+void heap_free(VMHeap *heap, void *pointer) {
+    HeapHeader *header = (HeapHeader *) pointer - 1;
+    ASSERT(header->magic == HEAP_MAGIC, "Freeing %p, which wasn't allocated by ALC\n", pointer);
+    ASSERT(header->size_class != FREED_CLASS, "Freeing %p twice\n", pointer);
+    ASSERT(header->size_class < HEAP_SIZE_CLASSES || header->size_class == LARGE_CLASS, "Freeing %p, which wasn't allocated by ALC\n", pointer);
+
+    heap->used -= header->size <= heap->used ? header->size : heap->used;
+
+    if (header->size_class == LARGE_CLASS && heap->region != NULL) {
+        header->size_class = FREED_CLASS;
+
+        HeapBlock *block = pointer;
+        block->next = heap->free_large;
+        heap->free_large = block;
+        return;
+    }
+
+    if (header->size_class == LARGE_CLASS) {
+        LargeAllocation *large = (LargeAllocation *) header - 1;
+        if (large->previous != NULL) {
+            large->previous->next = large->next;
+        } else {
+            heap->large = large->next;
+        }
+        if (large->next != NULL) {
+            large->next->previous = large->previous;
+        }
+
+        // Nothing of it is left to check, a second FRE can't be told apart from a bad pointer
+        free(large);
+        return;
+    }
+
+    // The link takes the place of `size`, the mark stays to catch a second FRE
+    usize size_class = header->size_class;
+    header->size_class = FREED_CLASS;
+
+    HeapBlock *block = (HeapBlock *) header;
+    block->next = heap->free_lists[size_class];
+    heap->free_lists[size_class] = block;
+}
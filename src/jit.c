@@ -0,0 +1,753 @@
+#include "jit.h"
+#include "vm.h"
+#include "verifier.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// How control leaves a helper called from native code: the pc to continue at and
+// the start of the frame that is current afterwards. Returned in rax:rdx.
+typedef struct {
+    u64 pc;
+    usize frame_start;
+} JitTransfer;
+
+// Runs a single instruction on the interpreter, for opcodes without a template.
+static JitTransfer jit_step(VM *vm, usize addr) {
+    vm->pc = addr + 1;
+    execute_byte(vm, vm->code[addr]);
+
+    JitTransfer transfer = { .pc = vm->pc, .frame_start = current_frame_start(&vm->call_stack) };
+    return transfer;
+}
+
+static JitTransfer jit_call(VM *vm, u64 target, u64 return_pc) {
+    StackFrame sf = {
+        .callee = target,
+        .caller_site = return_pc,
+        .stack_start = vm->stack.sp
+    };
+    push_to_call_stack(&vm->call_stack, sf);
+    LOG("Calling to address 0x%llx\n", target);
+
+    JitTransfer transfer = { .pc = target, .frame_start = vm->stack.sp };
+    return transfer;
+}
+
+static JitTransfer jit_return(VM *vm) {
+    StackFrame current_frame = pop_from_call_stack(&vm->call_stack);
+
+    JitTransfer transfer = { .pc = current_frame.caller_site, .frame_start = current_frame_start(&vm->call_stack) };
+    return transfer;
+}
+
+#if JIT_SUPPORTED
+#include <sys/mman.h>
+
+// Register allocation for native code. All of them are callee-saved, so they
+// survive calls into the helpers above:
+//   rbx: VM*
+//   rbp: the top 8 bytes of the stack, like `tos` in the interpreters. Their
+//        home in memory at sp - 8 is stale while native code runs.
+//   r12: stack pointer (offset into the stack storage)
+//   r13: stack storage
+//   r14: start of the current frame
+//   r15: byte offset -> native address table
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBP 5
+
+// REX prefixes for [r13 + r12 + disp8] operands
+#define REX_STACK_W 0x4B
+#define REX_STACK 0x43
+
+typedef enum {
+    FIXUP_INSTRUCTION,  // value: decoded instruction index
+    FIXUP_DYNAMIC_JUMP, // Jump to the address in rax
+    FIXUP_SET_PC_EXIT,  // Leave native code with vm->pc = rax
+    FIXUP_BAIL,         // value: address of the instruction to resume at in the interpreter
+} JitFixupKind;
+
+typedef struct {
+    usize at; // Offset of the rel32 to patch
+    JitFixupKind kind;
+    u64 value;
+} JitFixup;
+
+typedef struct {
+    u8 *code;
+    usize count;
+    usize capacity;
+
+    JitFixup *fixups;
+    usize fixups_count;
+    usize fixups_capacity;
+
+    usize *instruction_offsets;
+    usize dynamic_jump_offset;
+    usize set_pc_exit_offset;
+} JitCompiler;
+
+static void emit_bytes(JitCompiler *c, const u8 *bytes, usize n) {
+    if (c->count + n > c->capacity) {
+        while (c->count + n > c->capacity) {
+            c->capacity *= 2;
+        }
+        c->code = realloc(c->code, c->capacity);
+        if (c->code == NULL) {
+            ERROR("Could not grow the JIT code buffer\n");
+        }
+    }
+
+    memcpy(c->code + c->count, bytes, n);
+    c->count += n;
+}
+
+#define EMIT(c, ...) emit_bytes((c), (const u8[]){ __VA_ARGS__ }, sizeof((const u8[]){ __VA_ARGS__ }))
+
+static void emit_u32(JitCompiler *c, u32 value) {
+    emit_bytes(c, (const u8*) &value, sizeof(u32));
+}
+
+static void emit_u64(JitCompiler *c, u64 value) {
+    emit_bytes(c, (const u8*) &value, sizeof(u64));
+}
+
+static void emit_fixup(JitCompiler *c, JitFixupKind kind, u64 value) {
+    if (c->fixups_count == c->fixups_capacity) {
+        c->fixups_capacity = c->fixups_capacity == 0 ? 64 : c->fixups_capacity * 2;
+        c->fixups = realloc(c->fixups, c->fixups_capacity * sizeof(JitFixup));
+        if (c->fixups == NULL) {
+            ERROR("Could not grow the JIT fixup list\n");
+        }
+    }
+
+    JitFixup fixup = { .at = c->count, .kind = kind, .value = value };
+    c->fixups[c->fixups_count++] = fixup;
+    emit_u32(c, 0);
+}
+
+// <op> reg, [r13 + r12 + disp]
+static void emit_stack_access(JitCompiler *c, u8 rex, const u8 *op, usize op_len, u8 reg, int disp) {
+    EMIT(c, rex);
+    emit_bytes(c, op, op_len);
+    EMIT(c, 0x44 | (reg << 3), 0x25, (u8) (disp & 0xFF));
+}
+
+static void emit_load_u64(JitCompiler *c, u8 reg, int disp) {
+    emit_stack_access(c, REX_STACK_W, (const u8[]){ 0x8B }, 1, reg, disp);
+}
+
+static void emit_store_u64(JitCompiler *c, u8 reg, int disp) {
+    emit_stack_access(c, REX_STACK_W, (const u8[]){ 0x89 }, 1, reg, disp);
+}
+
+// movzx reg32, byte [...]
+static void emit_load_u8(JitCompiler *c, u8 reg, int disp) {
+    emit_stack_access(c, REX_STACK, (const u8[]){ 0x0F, 0xB6 }, 2, reg, disp);
+}
+
+static void emit_store_u8(JitCompiler *c, u8 reg, int disp) {
+    emit_stack_access(c, REX_STACK, (const u8[]){ 0x88 }, 1, reg, disp);
+}
+
+static void emit_flush_tos(JitCompiler *c) {
+    emit_store_u64(c, RBP, -8);
+}
+
+static void emit_reload_tos(JitCompiler *c) {
+    emit_load_u64(c, RBP, -8);
+}
+
+// ORs the flag in `reg` (0 or 1) into the top byte of rbp, which must be clear
+static void emit_push_flag(JitCompiler *c, u8 reg) {
+    EMIT(c, 0x48, 0xC1, 0xE0 | reg, 0x38);  // shl reg, 56
+    EMIT(c, 0x48, 0x09, 0xC5 | (reg << 3)); // or rbp, reg
+}
+
+static void emit_add_sp(JitCompiler *c, u8 n) {
+    EMIT(c, 0x49, 0x83, 0xC4, n); // add r12, n
+}
+
+static void emit_sub_sp(JitCompiler *c, u8 n) {
+    EMIT(c, 0x49, 0x83, 0xEC, n); // sub r12, n
+}
+
+static void emit_mov_rax_imm(JitCompiler *c, u64 value) {
+    EMIT(c, 0x48, 0xB8); // mov rax, imm64
+    emit_u64(c, value);
+}
+
+// Bails out to the interpreter at `addr` unless `n` bytes can be popped from the current frame
+// Pushes aren't checked, the guard page after the stack catches them.
+static void emit_check_pop(JitCompiler *c, u8 n, usize addr) {
+    EMIT(c, 0x49, 0x8D, 0x46, n);    // lea rax, [r14 + n]
+    EMIT(c, 0x49, 0x39, 0xC4);       // cmp r12, rax
+    EMIT(c, 0x0F, 0x82);             // jb bail
+    emit_fixup(c, FIXUP_BAIL, addr);
+}
+
+static void emit_sync_sp_to_vm(JitCompiler *c) {
+    EMIT(c, 0x4C, 0x89, 0xA3); // mov [rbx + sp], r12
+    emit_u32(c, offsetof(VM, stack) + offsetof(Stack, sp));
+}
+
+static void emit_load_sp_from_vm(JitCompiler *c) {
+    EMIT(c, 0x4C, 0x8B, 0xA3); // mov r12, [rbx + sp]
+    emit_u32(c, offsetof(VM, stack) + offsetof(Stack, sp));
+}
+
+#define HELPER(fn) ((u64) (uintptr_t) (fn))
+
+// Calls a helper with the VM as first argument and the given arguments in rsi and rdx.
+// Afterwards, the stack is reloaded from the VM and the JitTransfer is in rax:rdx.
+static void emit_helper_call(JitCompiler *c, u64 helper, bool rsi_from_rax, u64 rsi, bool has_rdx, u64 rdx) {
+    emit_flush_tos(c);
+    emit_sync_sp_to_vm(c);
+    EMIT(c, 0x48, 0x89, 0xDF); // mov rdi, rbx
+    if (rsi_from_rax) {
+        EMIT(c, 0x48, 0x89, 0xC6); // mov rsi, rax
+    } else {
+        EMIT(c, 0x48, 0xBE); // mov rsi, imm64
+        emit_u64(c, rsi);
+    }
+    if (has_rdx) {
+        EMIT(c, 0x48, 0xBA); // mov rdx, imm64
+        emit_u64(c, rdx);
+    }
+    emit_mov_rax_imm(c, helper);
+    EMIT(c, 0xFF, 0xD0); // call rax
+    emit_load_sp_from_vm(c);
+    emit_reload_tos(c);
+}
+
+static void emit_jump_to_instruction(JitCompiler *c, u64 index) {
+    EMIT(c, 0xE9); // jmp rel32
+    emit_fixup(c, FIXUP_INSTRUCTION, index);
+}
+
+static void emit_dynamic_jump(JitCompiler *c) {
+    EMIT(c, 0xE9); // jmp rel32
+    emit_fixup(c, FIXUP_DYNAMIC_JUMP, 0);
+}
+
+// Leaves native code with vm->pc = address
+static void emit_exit_at(JitCompiler *c, usize address) {
+    EMIT(c, 0xB8); // mov eax, imm32
+    emit_u32(c, address);
+    EMIT(c, 0xE9);
+    emit_fixup(c, FIXUP_SET_PC_EXIT, 0);
+}
+
+static void emit_prologue(JitCompiler *c) {
+    // void entry(VM *vm, void **native, usize frame_start, void *start)
+    EMIT(c, 0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbp, rbx, r12-r15
+    EMIT(c, 0x48, 0x83, 0xEC, 0x08); // sub rsp, 8 (keeps the stack 16-byte aligned for calls)
+    EMIT(c, 0x48, 0x89, 0xFB);       // mov rbx, rdi
+    EMIT(c, 0x49, 0x89, 0xF7);       // mov r15, rsi
+    EMIT(c, 0x49, 0x89, 0xD6);       // mov r14, rdx
+    emit_load_sp_from_vm(c);
+    EMIT(c, 0x4C, 0x8B, 0xAB);       // mov r13, [rbx + storage]
+    emit_u32(c, offsetof(VM, stack) + offsetof(Stack, storage));
+    emit_reload_tos(c);
+    EMIT(c, 0xFF, 0xE1);             // jmp rcx
+}
+
+static void emit_epilogue(JitCompiler *c, usize program_size) {
+    // Jump to the program address in rax, through the native address table
+    c->dynamic_jump_offset = c->count;
+    EMIT(c, 0x48, 0x3D);             // cmp rax, size
+    emit_u32(c, program_size);
+    EMIT(c, 0x0F, 0x83);             // jae set_pc_exit
+    emit_fixup(c, FIXUP_SET_PC_EXIT, 0);
+    EMIT(c, 0x49, 0x8B, 0x14, 0xC7); // mov rdx, [r15 + rax*8]
+    EMIT(c, 0x48, 0x85, 0xD2);       // test rdx, rdx
+    EMIT(c, 0x0F, 0x84);             // jz set_pc_exit
+    emit_fixup(c, FIXUP_SET_PC_EXIT, 0);
+    EMIT(c, 0xFF, 0xE2);             // jmp rdx
+
+    c->set_pc_exit_offset = c->count;
+    EMIT(c, 0x48, 0x89, 0x83);       // mov [rbx + pc], rax
+    emit_u32(c, offsetof(VM, pc));
+    emit_flush_tos(c);
+    emit_sync_sp_to_vm(c);
+    EMIT(c, 0x48, 0x83, 0xC4, 0x08); // add rsp, 8
+    EMIT(c, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0x5D); // pop r15-r12, rbx, rbp
+    EMIT(c, 0xC3);                   // ret
+}
+
+static void compile_instruction(JitCompiler *c, DecodedProgram *decoded, usize index) {
+    DecodedInstruction *inst = &decoded->instructions[index];
+    usize addr = inst->addr;
+
+    switch (inst->opcode) {
+        case NOP: break;
+        case PSH: {
+            emit_flush_tos(c);
+            emit_add_sp(c, sizeof(u64));
+            EMIT(c, 0x48, 0xBD); // mov rbp, imm64
+            emit_u64(c, inst->a);
+            break;
+        }
+        case PS8: {
+            emit_store_u8(c, RBP, -8);       // The byte shifted out of the cache goes home
+            emit_add_sp(c, 1);
+            EMIT(c, 0x48, 0xC1, 0xED, 0x08); // shr rbp, 8
+            emit_mov_rax_imm(c, (u64) (u8) inst->a << 56);
+            EMIT(c, 0x48, 0x09, 0xC5);       // or rbp, rax
+            break;
+        }
+        case STR: {
+            emit_flush_tos(c);
+            emit_mov_rax_imm(c, inst->a);
+            emit_store_u64(c, RAX, 0);
+            emit_add_sp(c, 2 * sizeof(u64));
+            EMIT(c, 0x48, 0xBD); // mov rbp, imm64
+            emit_u64(c, inst->b);
+            break;
+        }
+        case ADD: {
+            emit_check_pop(c, 2 * sizeof(u64), addr);
+            emit_stack_access(c, REX_STACK_W, (const u8[]){ 0x03 }, 1, RBP, -16); // add rbp, [...]
+            emit_sub_sp(c, sizeof(u64));
+            break;
+        }
+        case MUL: {
+            emit_check_pop(c, 2 * sizeof(u64), addr);
+            emit_stack_access(c, REX_STACK_W, (const u8[]){ 0x0F, 0xAF }, 2, RBP, -16); // imul rbp, [...]
+            emit_sub_sp(c, sizeof(u64));
+            break;
+        }
+        case SUB: {
+            emit_check_pop(c, 2 * sizeof(u64), addr);
+            emit_load_u64(c, RAX, -16);
+            EMIT(c, 0x48, 0x29, 0xE8); // sub rax, rbp
+            EMIT(c, 0x48, 0x89, 0xC5); // mov rbp, rax
+            emit_sub_sp(c, sizeof(u64));
+            break;
+        }
+        case DIV: case MOD: {
+            emit_check_pop(c, 2 * sizeof(u64), addr);
+            emit_load_u64(c, RAX, -16);
+            EMIT(c, 0x31, 0xD2);       // xor edx, edx
+            EMIT(c, 0x48, 0xF7, 0xF5); // div rbp
+            EMIT(c, 0x48, 0x89, inst->opcode == DIV ? 0xC5 : 0xD5); // mov rbp, rax/rdx
+            emit_sub_sp(c, sizeof(u64));
+            break;
+        }
+        case ADDI: case SUBI: {
+            emit_check_pop(c, sizeof(u64), addr);
+            bool is_add = inst->opcode == ADDI;
+            if (inst->a <= 0x7FFFFFFF) {
+                EMIT(c, 0x48, 0x81, is_add ? 0xC5 : 0xED); // add/sub rbp, imm32
+                emit_u32(c, inst->a);
+            } else {
+                emit_mov_rax_imm(c, inst->a);
+                EMIT(c, 0x48, is_add ? 0x01 : 0x29, 0xC5); // add/sub rbp, rax
+            }
+            break;
+        }
+        case MODI: {
+            emit_check_pop(c, sizeof(u64), addr);
+            EMIT(c, 0x48, 0xB9);       // mov rcx, imm64
+            emit_u64(c, inst->a);
+            EMIT(c, 0x48, 0x89, 0xE8); // mov rax, rbp
+            EMIT(c, 0x31, 0xD2);       // xor edx, edx
+            EMIT(c, 0x48, 0xF7, 0xF1); // div rcx
+            EMIT(c, 0x48, 0x89, 0xD5); // mov rbp, rdx
+            break;
+        }
+        case INC: case DEC: {
+            emit_check_pop(c, sizeof(u64), addr);
+            EMIT(c, 0x48, 0xFF, inst->opcode == INC ? 0xC5 : 0xCD); // inc/dec rbp
+            break;
+        }
+        case EQU: case LT: case GT:
+        case EQUI: case LTI: case GTI: {
+            bool immediate = inst->opcode == EQUI || inst->opcode == LTI || inst->opcode == GTI;
+            u8 popped = immediate ? sizeof(u64) : 2 * sizeof(u64);
+            emit_check_pop(c, popped, addr);
+
+            // Compares b with a. EQU only looks at the low byte of a.
+            if (immediate) {
+                emit_mov_rax_imm(c, inst->opcode == EQUI ? (u8) inst->a : inst->a);
+                EMIT(c, 0x48, 0x39, 0xC5);       // cmp rbp, rax
+            } else {
+                emit_load_u64(c, RAX, -16);
+                if (inst->opcode == EQU) {
+                    EMIT(c, 0x40, 0x0F, 0xB6, 0xCD); // movzx ecx, bpl
+                    EMIT(c, 0x48, 0x39, 0xC8);       // cmp rax, rcx
+                } else {
+                    EMIT(c, 0x48, 0x39, 0xE8);       // cmp rax, rbp
+                }
+            }
+
+            u8 condition;
+            switch (inst->opcode) {
+                case EQU: case EQUI: condition = 0x4; break; // e
+                case LT: case LTI: condition = 0x2; break;   // b
+                default: condition = 0x7; break;             // a
+            }
+
+            // A conditional jump right after the comparison branches on the flags
+            // instead of pushing the result only to pop it again
+            u16 next = inst[1].opcode;
+            if (next == JPTI || next == JPFI || next == PJPT || next == PJPF) {
+                emit_load_u64(c, RBP, -(int) popped - 8);
+                EMIT(c, 0x4D, 0x8D, 0x64, 0x24, (u8) -popped); // lea r12, [r12 - popped] (keeps flags)
+
+                bool if_true = next == JPTI || next == PJPT;
+                EMIT(c, 0x0F, 0x80 | (if_true ? condition : condition ^ 1)); // jcc target
+                emit_fixup(c, FIXUP_INSTRUCTION, inst[1].a);
+                emit_jump_to_instruction(c, index + (next == PJPT || next == PJPF ? 3 : 2));
+                break;
+            }
+
+            EMIT(c, 0x0F, 0x90 | condition, 0xC2); // setcc dl
+            EMIT(c, 0x0F, 0xB6, 0xD2);             // movzx edx, dl
+
+            // The new top 8 bytes are the 7 below what was popped plus the flag.
+            // Those 7 bytes are already home, so nothing needs flushing.
+            emit_load_u64(c, RBP, -(int) popped - 8);
+            EMIT(c, 0x48, 0xC1, 0xED, 0x08); // shr rbp, 8
+            emit_push_flag(c, RDX);
+            emit_sub_sp(c, popped - 1);
+            break;
+        }
+        case DUP: {
+            emit_check_pop(c, sizeof(u64), addr);
+            emit_flush_tos(c);
+            emit_add_sp(c, sizeof(u64));
+            break;
+        }
+        case SWP: {
+            emit_check_pop(c, 2 * sizeof(u64), addr);
+            emit_load_u64(c, RAX, -16);
+            emit_store_u64(c, RBP, -16);
+            EMIT(c, 0x48, 0x89, 0xC5); // mov rbp, rax
+            break;
+        }
+        case DRP: {
+            emit_check_pop(c, sizeof(u64), addr);
+            emit_load_u64(c, RBP, -16);
+            emit_sub_sp(c, sizeof(u64));
+            break;
+        }
+        case OVR: {
+            emit_check_pop(c, 2 * sizeof(u64), addr);
+            emit_flush_tos(c);
+            emit_load_u64(c, RBP, -16);
+            emit_add_sp(c, sizeof(u64));
+            break;
+        }
+        case ROT: {
+            emit_check_pop(c, 3 * sizeof(u64), addr);
+            emit_load_u64(c, RCX, -16);
+            emit_load_u64(c, RDX, -24);
+            emit_store_u64(c, RCX, -24);
+            emit_store_u64(c, RBP, -16);
+            EMIT(c, 0x48, 0x89, 0xD5); // mov rbp, rdx
+            break;
+        }
+        case NOT: {
+            emit_check_pop(c, 1, addr);
+            EMIT(c, 0x31, 0xC9);             // xor ecx, ecx
+            EMIT(c, 0x48, 0x89, 0xE8);       // mov rax, rbp
+            EMIT(c, 0x48, 0xC1, 0xE8, 0x38); // shr rax, 56
+            EMIT(c, 0x0F, 0x94, 0xC1);       // sete cl
+            EMIT(c, 0x48, 0xC1, 0xE5, 0x08); // shl rbp, 8
+            EMIT(c, 0x48, 0xC1, 0xED, 0x08); // shr rbp, 8
+            emit_push_flag(c, RCX);
+            break;
+        }
+        case OR: {
+            emit_check_pop(c, 2, addr);
+            EMIT(c, 0x31, 0xC9);             // xor ecx, ecx
+            EMIT(c, 0x48, 0x89, 0xE8);       // mov rax, rbp
+            EMIT(c, 0x48, 0xC1, 0xE8, 0x30); // shr rax, 48
+            EMIT(c, 0x0F, 0x95, 0xC1);       // setne cl
+            EMIT(c, 0x48, 0xC1, 0xE5, 0x10); // shl rbp, 16
+            EMIT(c, 0x48, 0xC1, 0xED, 0x08); // shr rbp, 8
+            emit_load_u8(c, RAX, -9);        // The byte that moves into the cache
+            EMIT(c, 0x48, 0x09, 0xC5);       // or rbp, rax
+            emit_push_flag(c, RCX);
+            emit_sub_sp(c, 1);
+            break;
+        }
+        case JMP: {
+            emit_check_pop(c, sizeof(u64), addr);
+            EMIT(c, 0x48, 0x89, 0xE8); // mov rax, rbp
+            emit_load_u64(c, RBP, -16);
+            emit_sub_sp(c, sizeof(u64));
+            emit_dynamic_jump(c);
+            break;
+        }
+        case JPT: case JPF: {
+            emit_check_pop(c, sizeof(u64) + 1, addr);
+            EMIT(c, 0x48, 0x89, 0xE8); // mov rax, rbp
+            emit_load_u8(c, RCX, -9);
+            emit_load_u64(c, RBP, -17);
+            emit_sub_sp(c, sizeof(u64) + 1);
+            EMIT(c, 0x84, 0xC9);                              // test cl, cl
+            EMIT(c, 0x0F, inst->opcode == JPT ? 0x85 : 0x84); // jnz/jz dynamic_jump
+            emit_fixup(c, FIXUP_DYNAMIC_JUMP, 0);
+            break;
+        }
+        case JMPI: case PJMP: {
+            emit_jump_to_instruction(c, inst->a);
+            break;
+        }
+        case JPTI: case JPFI: case PJPT: case PJPF: {
+            emit_check_pop(c, 1, addr);
+            EMIT(c, 0x48, 0x89, 0xE8);       // mov rax, rbp
+            EMIT(c, 0x48, 0xC1, 0xE8, 0x38); // shr rax, 56
+            EMIT(c, 0x48, 0xC1, 0xE5, 0x08); // shl rbp, 8
+            emit_load_u8(c, RCX, -9);
+            EMIT(c, 0x48, 0x09, 0xCD);       // or rbp, rcx
+            emit_sub_sp(c, 1);
+            EMIT(c, 0x85, 0xC0);             // test eax, eax
+            bool if_true = inst->opcode == JPTI || inst->opcode == PJPT;
+            EMIT(c, 0x0F, if_true ? 0x85 : 0x84); // jnz/jz target
+            emit_fixup(c, FIXUP_INSTRUCTION, inst->a);
+
+            // The fused PSH falls through past the transfer it was fused with
+            if (inst->opcode == PJPT || inst->opcode == PJPF) {
+                emit_jump_to_instruction(c, index + 2);
+            }
+            break;
+        }
+        case CLL: {
+            emit_check_pop(c, sizeof(u64), addr);
+            EMIT(c, 0x48, 0x89, 0xE8); // mov rax, rbp
+            emit_load_u64(c, RBP, -16);
+            emit_sub_sp(c, sizeof(u64));
+            emit_helper_call(c, HELPER(jit_call), true, 0, true, inst[1].addr);
+            EMIT(c, 0x4D, 0x89, 0xE6); // mov r14, r12
+            emit_dynamic_jump(c);
+            break;
+        }
+        case PCLL: {
+            emit_helper_call(c, HELPER(jit_call), false, inst->b, true, inst[2].addr);
+            EMIT(c, 0x4D, 0x89, 0xE6); // mov r14, r12
+            emit_jump_to_instruction(c, inst->a);
+            break;
+        }
+        case RET: {
+            emit_helper_call(c, HELPER(jit_return), false, 0, false, 0);
+            EMIT(c, 0x49, 0x89, 0xD6); // mov r14, rdx
+            emit_dynamic_jump(c);
+            break;
+        }
+        case EXT: case HLT: {
+            emit_exit_at(c, decoded->program->size);
+            break;
+        }
+        default: {
+            // No template: run it on the interpreter and continue wherever it left pc
+            emit_helper_call(c, HELPER(jit_step), false, addr, false, 0);
+            EMIT(c, 0x49, 0x89, 0xD6); // mov r14, rdx
+            EMIT(c, 0x48, 0x3D);       // cmp rax, next
+            emit_u32(c, inst[1].addr);
+            EMIT(c, 0x0F, 0x85);       // jne dynamic_jump
+            emit_fixup(c, FIXUP_DYNAMIC_JUMP, 0);
+            break;
+        }
+    }
+}
+
+bool jit_compile(Program *program, JitProgram *jit, MemoryModel memory) {
+    if (program->size >= (1u << 31)) {
+        LOG("Program is too large for the JIT\n");
+        return false;
+    }
+
+    DecodedProgram *decoded = &jit->decoded;
+    decode_program(program, decoded, memory);
+
+    JitCompiler c = {0};
+    c.capacity = 64 + program->size * 16;
+    c.code = malloc(c.capacity);
+    c.instruction_offsets = malloc((decoded->count + 1) * sizeof(usize));
+    if (c.code == NULL || c.instruction_offsets == NULL) {
+        ERROR("Could not allocate the JIT code buffer\n");
+    }
+
+    emit_prologue(&c);
+    for (usize i = 0; i <= decoded->count; i++) {
+        c.instruction_offsets[i] = c.count;
+        compile_instruction(&c, decoded, i);
+    }
+    emit_epilogue(&c, program->size);
+
+    // Bail stubs go after everything else, so checks stay out of the way of the hot path.
+    // Each one leaves native code at the instruction that failed its check, and the
+    // interpreter runs it again to report the error.
+    usize fixups_count = c.fixups_count;
+    for (usize i = 0; i < fixups_count; i++) {
+        if (c.fixups[i].kind != FIXUP_BAIL) { continue; }
+
+        usize stub = c.count;
+        emit_exit_at(&c, c.fixups[i].value);
+        c.fixups[i].value = stub;
+    }
+
+    for (usize i = 0; i < c.fixups_count; i++) {
+        JitFixup *fixup = &c.fixups[i];
+        usize target = 0;
+        switch (fixup->kind) {
+            case FIXUP_INSTRUCTION: target = c.instruction_offsets[fixup->value]; break;
+            case FIXUP_DYNAMIC_JUMP: target = c.dynamic_jump_offset; break;
+            case FIXUP_SET_PC_EXIT: target = c.set_pc_exit_offset; break;
+            case FIXUP_BAIL: target = fixup->value; break;
+        }
+
+        // rel32 is relative to the end of the operand; wrapping arithmetic handles backward jumps
+        u32 rel = (u32) (target - (fixup->at + sizeof(u32)));
+        memcpy(c.code + fixup->at, &rel, sizeof(u32));
+    }
+
+    jit->size = c.count;
+    jit->code = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        LOG("Could not map memory for the JIT\n");
+        jit->code = NULL;
+        free(c.fixups);
+        free(c.instruction_offsets);
+        free(c.code);
+        free_decoded_program(decoded);
+        return false;
+    }
+    memcpy(jit->code, c.code, c.count);
+    ASSERT(mprotect(jit->code, jit->size, PROT_READ | PROT_EXEC) == 0, "Could not make the JIT code executable\n");
+
+    jit->native = calloc(program->size + 1, sizeof(void*));
+    if (jit->native == NULL) {
+        ERROR("Could not allocate the JIT address table\n");
+    }
+    for (usize i = 0; i < decoded->count; i++) {
+        jit->native[decoded->instructions[i].addr] = jit->code + c.instruction_offsets[i];
+    }
+
+    LOG("Compiled %zu instructions into %zu bytes of native code\n", decoded->count, jit->size);
+
+    free(c.fixups);
+    free(c.instruction_offsets);
+    free(c.code);
+    return true;
+}
+
+void jit_free(JitProgram *jit) {
+    if (jit->code != NULL) {
+        munmap(jit->code, jit->size);
+    }
+    free(jit->native);
+    free_decoded_program(&jit->decoded);
+    jit->code = NULL;
+    jit->native = NULL;
+}
+#else
+bool jit_compile(Program *program, JitProgram *jit, MemoryModel memory) {
+    (void) program;
+    (void) jit;
+    (void) memory;
+    return false;
+}
+
+void jit_free(JitProgram *jit) {
+    (void) jit;
+}
+#endif // JIT_SUPPORTED
+
+typedef void (*JitEntry)(VM *vm, void **native, usize frame_start, void *start);
+
+void run_jit_program(VM *vm, JitProgram *jit) {
+    ASSERT(jit->decoded.memory == vm->memory.model, "The program was compiled for another memory model\n");
+
+    // ISO C has no conversion from an object pointer to a function pointer
+    JitEntry entry;
+    void *entry_address = jit->code;
+    memcpy(&entry, &entry_address, sizeof(entry));
+
+    // Native code starts wherever reset_vm() left pc, the entry point of the Program
+    usize size = vm->program->size;
+    if (vm->pc < size) {
+        void *start = jit->native[vm->pc];
+        ASSERT(start != NULL, "Entry point %#zx is not an instruction boundary\n", vm->pc);
+        entry(vm, jit->native, current_frame_start(&vm->call_stack), start);
+    }
+
+    // Native code leaves pc at the end of the program, or at an instruction that
+    // failed a check so the interpreter reports it the same way it always does.
+    while (vm->pc < size) {
+        OpCode op = get_next_u8_from_program(vm);
+        execute_byte(vm, op);
+    }
+}
+
+void run_jit(VM *vm) {
+    PreparedProgram *prepared = prepared_for_vm(vm, ENGINE_JIT);
+    if (!prepared->jit_ready) {
+        LOG("JIT is not available, using the decoded engine\n");
+    }
+    run_prepared_program(vm, prepared, ENGINE_JIT);
+}
+
+void free_prepared_program(PreparedProgram *prepared) {
+    if (prepared->decoded_ready) {
+        free_decoded_program(&prepared->decoded);
+    }
+    if (prepared->jit_ready) {
+        jit_free(&prepared->jit);
+    }
+    memset(prepared, 0, sizeof(PreparedProgram));
+}
+
+void prepare_program(PreparedProgram *prepared, Program *program, u64 id, ExecutionEngine engine, MemoryModel memory) {
+    if (prepared->program_id != id || prepared->memory != memory) {
+        free_prepared_program(prepared);
+        prepared->program_id = id;
+        prepared->memory = memory;
+    }
+
+    if (engine == ENGINE_JIT && !prepared->jit_tried) {
+        prepared->jit_ready = jit_compile(program, &prepared->jit, memory);
+        prepared->jit_tried = true;
+    }
+
+    // Only once it's ready, a run that failed while preparing it makes the next one retry
+    bool needs_decoded = engine == ENGINE_DECODED || (engine == ENGINE_JIT && !prepared->jit_ready);
+    if (needs_decoded && !prepared->decoded_ready) {
+        Verification verification;
+        prepared->verified = verify_program(program, &verification);
+        decode_program(program, &prepared->decoded, memory);
+        prepared->decoded_ready = true;
+    }
+}
+
+void run_prepared_program(VM *vm, PreparedProgram *prepared, ExecutionEngine engine) {
+    bool compiled = engine == ENGINE_JIT && prepared->jit_ready;
+    bool decoded = (engine == ENGINE_DECODED || engine == ENGINE_JIT) && prepared->decoded_ready;
+
+    if (compiled) {
+        run_jit_program(vm, &prepared->jit);
+    } else if (decoded && prepared->verified) {
+        run_decoded_program_unchecked(vm, &prepared->decoded);
+    } else if (decoded) {
+        run_decoded_program(vm, &prepared->decoded);
+    } else if (engine == ENGINE_THREADED) {
+        run_threaded(vm);
+    } else {
+        run_switch(vm);
+    }
+}
+
+PreparedProgram *prepared_for_vm(VM *vm, ExecutionEngine engine) {
+    Program *program = vm->program;
+    if (program->prepared == NULL) {
+        program->prepared = calloc(1, sizeof(PreparedProgram));
+    }
+
+    prepare_program(program->prepared, program, program_id(program), engine, vm->memory.model);
+    return program->prepared;
+}
@@ -4,13 +4,16 @@
 #include "vm.h"
 #include "program_builder.h"
 #include "assembler.h"
+#include "verifier.h"
+#include "pool.h"
+#include "binary.h"
+#include "module.h"
+#include "cache.h"
+#include "sampler.h"
+#include "generator.h"
 #include <string.h>
-
-void dump_program_to_file(Program *program, char *file_path) {
-    FILE *file = fopen(file_path, "wb");
-    fwrite(program->code, sizeof(u8), program->size, file);
-    fclose(file);
-}
+#include <time.h>
+#include <sys/resource.h>
 
 void build_program(ProgramBuilder *builder) {
     // FizzBuzz
@@ -122,43 +125,646 @@ void execute_example(void) {
     destroy_program(&program);
 }
 
+static double seconds_now(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+// Builds a program of `count` instructions with a label every 8 of them, jumping back
+// and forth between them, and times building it and finalizing it into a Program.
+void benchmark_builder(usize count, bool flat) {
+    ProgramBuilder pb = {0};
+    if (flat) {
+        init_flat_program_builder(&pb);
+    } else {
+        init_program_builder(&pb);
+    }
+
+    double start = seconds_now();
+
+    LABEL_T previous = create_label(&pb);
+    link_label(&pb, previous);
+    for (usize i = 0; i < count; i++) {
+        switch (i % 8) {
+            case 0: {
+                LABEL_T label = create_label(&pb);
+                link_label(&pb, label);
+                emit_push(&pb, i);
+            } break;
+            case 1: emit_plain_instruction(&pb, DUP); break;
+            case 2: emit_jump_if_true(&pb, previous); break;
+            case 3: emit_push_label(&pb, pb.current_label - 1); break;
+            case 4: emit_plain_instruction(&pb, SWP); break;
+            case 5: emit_plain_instruction(&pb, DRP); break;
+            case 6: emit_sized_instruction(&pb, PSH, i); break;
+            default: {
+                emit_plain_instruction(&pb, DRP);
+                previous = pb.current_label - 1;
+            } break;
+        }
+    }
+
+    double built = seconds_now();
+
+    Program program = create_program();
+    clone_to_program(&pb, &program);
+
+    double finalized = seconds_now();
+
+    printf("%s builder: %zu instructions, %u labels, %zu bytes\n", flat ? "flat" : "list", count, pb.current_label, program.size);
+    printf("  build    %8.1f ms  %6.1f ns/instruction\n", (built - start) * 1e3, (built - start) * 1e9 / (double) count);
+    printf("  finalize %8.1f ms  %6.1f ns/instruction\n", (finalized - built) * 1e3, (finalized - built) * 1e9 / (double) count);
+
+    free_program_builder(&pb);
+    destroy_program(&program);
+}
+
+// Allocations so far, when built with COUNT_ALLOCATIONS
+static usize allocations_now(void) {
+#if COUNT_ALLOCATIONS
+    return allocation_count;
+#else
+    return 0;
+#endif
+}
+
+// Times each step of turning a generated program into a Program, and prints one JSON
+// object with the results:
+//   lex       reading every token of the source, without building anything
+//   labels    what interning the label names adds to that
+//   assemble  the whole of assemble_source()
+//   emit      the builder calls for the same program, straight into a flat builder
+//   finalize  clone_to_program() on that builder
+// Allocations per instruction are null unless built with COUNT_ALLOCATIONS.
+void benchmark_toolchain(const GeneratorConfig *config) {
+    StringBuffer source = create_string_buffer(64);
+    generate_source(config, &source);
+    double megabytes = (double) source.count / (1024.0 * 1024.0);
+    usize instructions = generated_instruction_count(config);
+    double count = (double) instructions;
+
+    Assembler assembler = {0};
+    init_assembler(&assembler);
+    assembler.code = source.str;
+    assembler.count = source.count;
+    double start = seconds_now();
+    usize scanned = scan_source(&assembler, false);
+    double lex = seconds_now() - start;
+    free_assembler(&assembler);
+    ASSERT(scanned == instructions, "Scanned %zu instructions out of %zu\n", scanned, instructions);
+
+    assembler = (Assembler) {0};
+    init_assembler(&assembler);
+    assembler.code = source.str;
+    assembler.count = source.count;
+    start = seconds_now();
+    scan_source(&assembler, true);
+    // Without labels the two scans are the same, and the difference is noise
+    double labels = seconds_now() - start - lex;
+    labels = labels > 0 ? labels : 0;
+    free_assembler(&assembler);
+
+    usize allocations = allocations_now();
+    start = seconds_now();
+    Program assembled = assemble_source(source.str, source.count, false, NULL);
+    double assemble = seconds_now() - start;
+    usize assemble_allocations = allocations_now() - allocations;
+
+    allocations = allocations_now();
+    ProgramBuilder pb = {0};
+    init_flat_program_builder(&pb);
+    start = seconds_now();
+    generate_program(config, &pb);
+    double emit = seconds_now() - start;
+    usize emit_allocations = allocations_now() - allocations;
+
+    allocations = allocations_now();
+    Program program = create_program();
+    start = seconds_now();
+    clone_to_program(&pb, &program);
+    double finalize = seconds_now() - start;
+    usize finalize_allocations = allocations_now() - allocations;
+
+    ASSERT(assembled.size == program.size && memcmp(assembled.code, program.code, program.size) == 0,
+           "The generated source and builder calls gave different programs\n");
+
+    printf("{\"instructions\":%zu,\"label_every\":%zu,\"strings\":%zu,\"comment_percent\":%zu,"
+           "\"source_bytes\":%zu,\"code_bytes\":%zu,"
+           "\"lex_ms\":%.3f,\"lex_mb_per_second\":%.1f,\"labels_ms\":%.3f,"
+           "\"assemble_ms\":%.3f,\"assemble_mb_per_second\":%.1f,\"assemble_ns_per_instruction\":%.2f,"
+           "\"emit_ms\":%.3f,\"emit_ns_per_instruction\":%.2f,"
+           "\"finalize_ms\":%.3f,\"finalize_ns_per_instruction\":%.2f,",
+           instructions, config->label_every, config->strings, config->comment_percent,
+           source.count, program.size,
+           lex * 1e3, megabytes / lex, labels * 1e3,
+           assemble * 1e3, megabytes / assemble, assemble * 1e9 / count,
+           emit * 1e3, emit * 1e9 / count,
+           finalize * 1e3, finalize * 1e9 / count);
+    if (COUNT_ALLOCATIONS) {
+        printf("\"assemble_allocations_per_instruction\":%.6f,\"emit_allocations_per_instruction\":%.6f,"
+               "\"finalize_allocations_per_instruction\":%.6f}\n",
+               (double) assemble_allocations / count, (double) emit_allocations / count,
+               (double) finalize_allocations / count);
+    } else {
+        printf("\"assemble_allocations_per_instruction\":null,\"emit_allocations_per_instruction\":null,"
+               "\"finalize_allocations_per_instruction\":null}\n");
+    }
+
+    free_program_builder(&pb);
+    destroy_program(&program);
+    destroy_program(&assembled);
+    free_string_buffer(&source);
+}
+
+static const char *engine_name(ExecutionEngine engine) {
+    switch (engine) {
+        case ENGINE_SWITCH: return "switch";
+        case ENGINE_THREADED: return "threaded";
+        case ENGINE_DECODED: return "decoded";
+        case ENGINE_JIT: return "jit";
+        case ENGINE_DEBUG: return "debug";
+    }
+    return "?";
+}
+
+// Peak resident set of the whole process, in KiB
+static usize peak_rss_kib(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return (usize) usage.ru_maxrss / 1024;
+#else
+    return (usize) usage.ru_maxrss;
+#endif
+}
+
+// Assembles `input_file` and runs it `runs` times on `engine`, with the output thrown away,
+// then prints one JSON object with the results. Startup is assembling the file and mapping
+// the VM. Instructions are counted afterwards on the counting switch engine, so the timed
+// runs and the peak RSS don't include the counters. Meant to be run once per process.
+void benchmark_program(char *input_file, ExecutionEngine engine, usize runs) {
+    double start = seconds_now();
+    Program program = assemble_file(input_file, false, NULL);
+    VM *vm = create_vm(NULL);
+    double started = seconds_now();
+
+    FILE *null_output = fopen("/dev/null", "w");
+    ASSERT(null_output != NULL, "Could not open /dev/null\n");
+    set_vm_output(vm, file_output_sink(null_output));
+
+    double best = 0;
+    double total = 0;
+    for (usize i = 0; i < runs; i++) {
+        double run_start = seconds_now();
+        run_vm(vm, &program, engine);
+        double elapsed = seconds_now() - run_start;
+
+        total += elapsed;
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    usize peak_rss = peak_rss_kib();
+
+    VMProfile profile;
+    init_vm_profile(&profile, &program, false);
+    reset_vm(vm, &program);
+    run_switch_profiled(vm, &profile);
+    flush_output(&vm->output);
+    u64 instructions = profile.instructions;
+    free_vm_profile(&profile);
+
+    printf("{\"program\":\"%s\",\"engine\":\"%s\",\"runs\":%zu,\"code_bytes\":%zu,"
+           "\"instructions\":%llu,\"best_seconds\":%.6f,\"mean_seconds\":%.6f,"
+           "\"instructions_per_second\":%.0f,\"ns_per_instruction\":%.3f,"
+           "\"startup_ms\":%.3f,\"peak_rss_kib\":%zu}\n",
+           input_file, engine_name(engine), runs, program.size,
+           instructions, best, total / (double) runs,
+           best > 0 ? (double) instructions / best : 0.0,
+           instructions > 0 ? best * 1e9 / (double) instructions : 0.0,
+           (started - start) * 1e3, peak_rss);
+
+    free_vm(vm);
+    fclose(null_output);
+    destroy_program(&program);
+}
+
+// Looks for an `--engine=<name>` flag after the input file.
+ExecutionEngine engine_from_args(int argc, char **argv, ExecutionEngine fallback) {
+    const char *flag = "--engine=";
+    usize flag_len = strlen(flag);
+
+    for (int i = 3; i < argc; i++) {
+        if (strncmp(argv[i], flag, flag_len) == 0) {
+            ExecutionEngine engine;
+            ASSERT(string_to_engine(&engine, argv[i] + flag_len), "Unknown engine `%s`\n", argv[i] + flag_len);
+
+            return engine;
+        }
+    }
+
+    return fallback;
+}
+
+// Looks for a flag after the input file.
+bool has_flag(int argc, char **argv, const char *flag) {
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], flag) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Looks for a `<prefix><value>` flag after the input file.
+char *string_from_args(int argc, char **argv, const char *prefix) {
+    usize prefix_len = strlen(prefix);
+
+    for (int i = 3; i < argc; i++) {
+        if (strncmp(argv[i], prefix, prefix_len) == 0) {
+            return argv[i] + prefix_len;
+        }
+    }
+
+    return NULL;
+}
+
+// Looks for a `<prefix><number>` flag after the input file.
+bool size_from_args(int argc, char **argv, const char *prefix, usize *out) {
+    usize prefix_len = strlen(prefix);
+
+    for (int i = 3; i < argc; i++) {
+        if (strncmp(argv[i], prefix, prefix_len) == 0) {
+            char *end;
+            *out = strtoull(argv[i] + prefix_len, &end, 10);
+            ASSERT(*end == '\0' && end != argv[i] + prefix_len, "Invalid size `%s`\n", argv[i]);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// `--label-every=<n>`, `--strings=<count>`, `--comments=<percent>`, `--seed=<n>`
+// and `--passes=<count>` for a program that runs
+GeneratorConfig generator_config_from_args(int argc, char **argv, usize instructions) {
+    GeneratorConfig config = default_generator_config(instructions);
+    size_from_args(argc, argv, "--passes=", &config.passes);
+    size_from_args(argc, argv, "--label-every=", &config.label_every);
+    size_from_args(argc, argv, "--strings=", &config.strings);
+    size_from_args(argc, argv, "--comments=", &config.comment_percent);
+    usize seed = config.seed;
+    size_from_args(argc, argv, "--seed=", &seed);
+    config.seed = seed;
+    ASSERT(config.instructions > 0, "A generated program needs at least one instruction\n");
+
+    return config;
+}
+
+OutputWriter output_writer;
+
+void stop_async_output(void) {
+    stop_output_writer(&output_writer);
+}
+
+// `--stack-size=<bytes>`, `--call-stack-size=<frames>`, `--huge-pages`, `--heap-quota=<bytes>`,
+// `--sandbox`, `--memory-size=<bytes>` and `--async-output`
+VMConfig vm_config_from_args(int argc, char **argv) {
+    VMConfig config = default_vm_config();
+    size_from_args(argc, argv, "--stack-size=", &config.stack_size);
+    size_from_args(argc, argv, "--call-stack-size=", &config.call_stack_size);
+    config.huge_pages = has_flag(argc, argv, "--huge-pages");
+    size_from_args(argc, argv, "--heap-quota=", &config.heap_quota);
+    if (has_flag(argc, argv, "--sandbox")) {
+        config.memory = MEMORY_SANDBOXED;
+    }
+    size_from_args(argc, argv, "--memory-size=", &config.memory_size);
+
+    if (has_flag(argc, argv, "--async-output")) {
+        start_output_writer(&output_writer);
+        atexit(stop_async_output);
+        config.output.writer = &output_writer;
+    }
+
+    return config;
+}
+
 int main(int argc, char **argv) {
      bool use_example = true;
      if (argc > 1) {
          char* mode = argv[1];
+        VMConfig vm_config = vm_config_from_args(argc, argv);
+        set_vm_config(vm_config);
 
         if (strcmp(mode, "asm") == 0) {
             ASSERT(argc > 2, "Assembler needs an input file\n");
 
             char* input_file = argv[2];
+            bool optimize = has_flag(argc, argv, "--optimize");
+
+            // `--output=<file>` saves the program for `bin` instead of running it
+            char *output_file = string_from_args(argc, argv, "--output=");
+            if (output_file != NULL) {
+                Program result = assemble_file(input_file, optimize, NULL);
+                write_binary_file(output_file, &result, NULL, 0, NULL, 0);
+                destroy_program(&result);
+
+                return 0;
+            }
+
+            // Unchanged sources run from the cache, unless `--no-cache` is given
+            Program result;
+            usize eliminated;
+            if (has_flag(argc, argv, "--no-cache")) {
+                result = assemble_file(input_file, optimize, &eliminated);
+            } else {
+                result = assemble_file_cached(input_file, optimize, &eliminated);
+            }
+            if (optimize) {
+                fprintf(stderr, "Peephole optimizer eliminated %zu instructions\n", eliminated);
+            }
+
+            execute_with_engine(&result, engine_from_args(argc, argv, ENGINE_DEBUG));
+            destroy_program(&result);
+
+            return 0;
+        }
 
-            Program result = assemble_file(input_file);
+        // `prof <input>` runs the program on the counting switch engine, then prints the
+        // report. `--cycles` times every opcode too.
+        if (strcmp(mode, "prof") == 0) {
+            ASSERT(argc > 2, "Profiling needs an input file\n");
 
-            debug_execute(&result);
+            Program program = assemble_file(argv[2], has_flag(argc, argv, "--optimize"), NULL);
+
+            VMProfile profile;
+            init_vm_profile(&profile, &program, has_flag(argc, argv, "--cycles"));
+
+            VM vm = {0};
+            init_vm(&vm, &program);
+            reset_vm(&vm, &program);
+            run_switch_profiled(&vm, &profile);
+            flush_output(&vm.output);
+            destroy_vm(&vm);
+
+            print_vm_profile(&profile, &program);
+            free_vm_profile(&profile);
+            destroy_program(&program);
+
+            return 0;
+        }
+
+        // `sample <input>` runs the program while sampling it, and writes the folded stacks
+        // to `--output=<file>` (`<input>.folded` by default). `--interval=<us>` sets the period.
+        if (strcmp(mode, "sample") == 0) {
+            ASSERT(argc > 2, "Sampling needs an input file\n");
+
+            char *input_file = argv[2];
+            DebugInfo debug_info;
+            init_debug_info(&debug_info, input_file);
+            Program program = assemble_file_with_debug_info(input_file, &debug_info);
+
+            usize interval = DEFAULT_SAMPLE_INTERVAL;
+            size_from_args(argc, argv, "--interval=", &interval);
+            Sampler sampler;
+            init_sampler(&sampler, interval);
+
+            VM vm = {0};
+            init_vm(&vm, &program);
+            reset_vm(&vm, &program);
+            run_sampled(&vm, &sampler);
+            flush_output(&vm.output);
+            destroy_vm(&vm);
+
+            StringBuffer default_output = create_string_buffer(64);
+            append_string_buffer(&default_output, input_file);
+            append_string_buffer(&default_output, ".folded");
+            default_output.str[default_output.count] = '\0';
+            char *output_file = string_from_args(argc, argv, "--output=");
+            if (output_file == NULL) {
+                output_file = default_output.str;
+            }
+
+            FILE *file = fopen(output_file, "w");
+            ASSERT(file != NULL, "Could not open `%s` for writing\n", output_file);
+            write_folded_stacks(&sampler, &debug_info, file);
+            fclose(file);
+            fprintf(stderr, "%zu samples (%zu dropped) written to `%s`\n", sampler.samples, sampler.dropped, output_file);
+
+            free_string_buffer(&default_output);
+            free_sampler(&sampler);
+            free_debug_info(&debug_info);
+            destroy_program(&program);
+
+            return 0;
+        }
+
+        // `compile <input> <output>`, the same as `asm <input> --output=<output>`
+        if (strcmp(mode, "compile") == 0) {
+            ASSERT(argc > 3, "Compiling needs an input and an output file\n");
+
+            Program result = assemble_file(argv[2], has_flag(argc, argv, "--optimize"), NULL);
+            write_binary_file(argv[3], &result, NULL, 0, NULL, 0);
+            destroy_program(&result);
+
+            return 0;
+        }
+
+        if (strcmp(mode, "jit") == 0) {
+            ASSERT(argc > 2, "JIT needs an input file\n");
+
+            char* input_file = argv[2];
+
+            Program result = assemble_file(input_file, has_flag(argc, argv, "--optimize"), NULL);
+
+            execute_with_engine(&result, ENGINE_JIT);
             destroy_program(&result);
 
             return 0;
         }
 
+        if (strcmp(mode, "verify") == 0) {
+            ASSERT(argc > 2, "Verifier needs an input file\n");
+
+            Program program = assemble_file(argv[2], has_flag(argc, argv, "--optimize"), NULL);
+
+            Verification verification;
+            if (verify_program(&program, &verification)) {
+                printf("Verified %zu functions, max frame depth %zu bytes\n", verification.functions, verification.max_depth);
+            } else {
+                printf("Verification failed at 0x%zx: %s\n", verification.failed_at, verification.reason);
+            }
+            destroy_program(&program);
+
+            return 0;
+        }
+
+        if (strcmp(mode, "pool") == 0) {
+            ASSERT(argc > 2, "Pool needs an input file\n");
+
+            Program program = assemble_file(argv[2], has_flag(argc, argv, "--optimize"), NULL);
+
+            VMPoolConfig config = default_vm_pool_config();
+            config.engine = engine_from_args(argc, argv, DEFAULT_ENGINE);
+            config.vm_config = vm_config;
+            config.pin_workers = has_flag(argc, argv, "--pin");
+            size_from_args(argc, argv, "--workers=", &config.workers);
+
+            usize jobs_count = 1;
+            size_from_args(argc, argv, "--jobs=", &jobs_count);
+
+            // Every job prints to its own buffer, shown in order once they're all done
+            PoolJob *jobs = calloc(jobs_count, sizeof(PoolJob));
+            StringBuffer *outputs = calloc(jobs_count, sizeof(StringBuffer));
+            OutputSink *sinks = calloc(jobs_count, sizeof(OutputSink));
+            ASSERT(jobs != NULL && outputs != NULL && sinks != NULL, "Could not allocate the jobs\n");
+
+            VMPool pool;
+            init_vm_pool(&pool, config);
+            for (usize i = 0; i < jobs_count; i++) {
+                init_string_buffer(&outputs[i], 64);
+                sinks[i] = memory_output_sink(&outputs[i]);
+                jobs[i].program = &program;
+                jobs[i].output = &sinks[i];
+                submit_job(&pool, &jobs[i]);
+            }
+            wait_for_jobs(&pool);
+            free_vm_pool(&pool);
+
+            usize failed = 0;
+            for (usize i = 0; i < jobs_count; i++) {
+                fwrite(outputs[i].str, sizeof(char), outputs[i].count, stdout);
+                free_string_buffer(&outputs[i]);
+
+                if (!jobs[i].ok) {
+                    printf("Job %zu failed: %s", i, jobs[i].error);
+                    failed++;
+                }
+            }
+            printf("%zu of %zu jobs finished\n", jobs_count - failed, jobs_count);
+
+            free(jobs);
+            free(outputs);
+            free(sinks);
+            destroy_program(&program);
+
+            return failed > 0 ? 1 : 0;
+        }
+
+        if (strcmp(mode, "link") == 0) {
+            ASSERT(argc > 3, "Linking needs an output file and the sources of its modules\n");
+
+            char *output_file = argv[2];
+
+            // Each source is assembled to `<source>.o` next to it, and only again once it changes
+            Module *modules = calloc(argc, sizeof(Module));
+            ASSERT(modules != NULL, "Could not allocate the modules\n");
+            usize modules_count = 0;
+            StringBuffer module_path = create_string_buffer(64);
+            for (int i = 3; i < argc; i++) {
+                if (strncmp(argv[i], "--", 2) == 0) { continue; }
+
+                module_path.count = 0;
+                append_string_buffer(&module_path, argv[i]);
+                append_string_buffer(&module_path, ".o");
+                module_path.str[module_path.count] = '\0';
+                build_module(argv[i], module_path.str, &modules[modules_count++]);
+            }
+
+            Program program;
+            BinarySymbol *symbols;
+            usize symbols_count;
+            link_modules(modules, modules_count, &program, &symbols, &symbols_count);
+            write_binary_file(output_file, &program, NULL, 0, symbols, symbols_count);
+
+            destroy_program(&program);
+            free(symbols);
+            for (usize i = 0; i < modules_count; i++) {
+                free_module(&modules[i]);
+            }
+            free(modules);
+            free_string_buffer(&module_path);
+
+            return 0;
+        }
+
+        // `bench <input> [--engine=<name>] [--runs=<count>]`, see benchmark_program()
+        if (strcmp(mode, "bench") == 0) {
+            ASSERT(argc > 2, "Benchmarking needs an input file\n");
+
+            usize runs = 5;
+            size_from_args(argc, argv, "--runs=", &runs);
+            ASSERT(runs > 0, "Benchmarking needs at least one run\n");
+
+            benchmark_program(argv[2], engine_from_args(argc, argv, DEFAULT_ENGINE), runs);
+
+            return 0;
+        }
+
+        // `generate <output> [--instructions=<count>]` writes a synthetic program,
+        // see generator_config_from_args() for the rest of the flags
+        if (strcmp(mode, "generate") == 0) {
+            ASSERT(argc > 2, "Generating needs an output file\n");
+
+            usize instructions = 100 * 1000;
+            size_from_args(argc, argv, "--instructions=", &instructions);
+            GeneratorConfig config = generator_config_from_args(argc, argv, instructions);
+
+            StringBuffer source = create_string_buffer(64);
+            generate_source(&config, &source);
+            FILE *file = fopen(argv[2], "w");
+            ASSERT(file != NULL, "Could not open `%s` for writing\n", argv[2]);
+            fwrite(source.str, 1, source.count, file);
+            fclose(file);
+            free_string_buffer(&source);
+
+            return 0;
+        }
+
+        // `bench-toolchain [count]`, see benchmark_toolchain()
+        if (strcmp(mode, "bench-toolchain") == 0) {
+            usize count = 1000 * 1000;
+            if (argc > 2) {
+                char *end;
+                count = strtoull(argv[2], &end, 10);
+                ASSERT(*end == '\0' && end != argv[2], "Invalid instruction count `%s`\n", argv[2]);
+            }
+
+            GeneratorConfig config = generator_config_from_args(argc, argv, count);
+            benchmark_toolchain(&config);
+
+            return 0;
+        }
+
+        if (strcmp(mode, "bench-builder") == 0) {
+            usize count = 10 * 1000 * 1000;
+            if (argc > 2) {
+                count = strtoull(argv[2], NULL, 10);
+            }
+
+            benchmark_builder(count, false);
+            benchmark_builder(count, true);
+
+            return 0;
+        }
+
         if (strcmp(mode, "bin") == 0) {
             ASSERT(argc > 2, "Binary execution needs an input file\n");
 
             char* input_file = argv[2];
 
-            usize length;
-            const char *contents = read_all_from_file(input_file, &length);
-
-            Program program = {
-                .code = (u8 *)contents,
-                .size = length
-            };
+            BinaryFile binary;
+            load_binary_file(input_file, &binary);
 
             #if DEBUG
-            print_program(&program);
+            print_program(&binary.program);
             #endif
 
-            debug_execute(&program);
-            destroy_program(&program);
+            execute_with_engine(&binary.program, engine_from_args(argc, argv, ENGINE_DEBUG));
+            free_binary_file(&binary);
 
             return 0;
         }
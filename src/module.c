@@ -0,0 +1,268 @@
+#include "module.h"
+#include "assembler.h"
+#include <string.h>
+
+_Static_assert(sizeof(ModuleHeader) == 112, "ModuleHeader is part of the file format");
+_Static_assert(sizeof(Relocation) == 16, "Relocation is part of the file format");
+_Static_assert(sizeof(ModuleSymbol) == 16, "ModuleSymbol is part of the file format");
+
+static usize align_up(usize value) {
+    return (value + BINARY_ALIGNMENT - 1) & ~(usize) (BINARY_ALIGNMENT - 1);
+}
+
+u64 module_source_hash(const char *source, usize size) {
+    return binary_checksum((const u8 *) source, size);
+}
+
+static BinarySection place_section(usize *end, usize size) {
+    BinarySection section = { .offset = align_up(*end), .size = size };
+    *end = section.offset + size;
+    return section;
+}
+
+void write_module_file(const char *file_path, const Module *module) {
+    ModuleHeader header = {0};
+    memcpy(header.magic, MODULE_MAGIC, sizeof(header.magic));
+    header.version = MODULE_VERSION;
+    header.header_size = sizeof(ModuleHeader);
+    header.source_hash = module->source_hash;
+    header.assembler_revision = module->assembler_revision;
+
+    usize end = sizeof(ModuleHeader);
+    header.code = place_section(&end, module->size);
+    header.exports = place_section(&end, module->exports_count * sizeof(ModuleSymbol));
+    header.imports = place_section(&end, module->imports_count * sizeof(ModuleSymbol));
+    header.relocations = place_section(&end, module->relocations_count * sizeof(Relocation));
+    header.names = place_section(&end, module->names_size);
+
+    usize size = end;
+    u8 *data = calloc(size, sizeof(u8));
+    ASSERT(data != NULL, "Could not allocate %zu bytes for the module\n", size);
+
+    #define COPY_SECTION(section, source) \
+        if (header.section.size > 0) { memcpy(&data[header.section.offset], source, header.section.size); }
+    COPY_SECTION(code, module->code)
+    COPY_SECTION(exports, module->exports)
+    COPY_SECTION(imports, module->imports)
+    COPY_SECTION(relocations, module->relocations)
+    COPY_SECTION(names, module->names)
+    #undef COPY_SECTION
+
+    header.checksum = binary_checksum(&data[sizeof(ModuleHeader)], size - sizeof(ModuleHeader));
+    memcpy(data, &header, sizeof(header));
+
+    FILE *file = fopen(file_path, "wb");
+    ASSERT(file != NULL, "Could not open `%s` for writing\n", file_path);
+    usize written = fwrite(data, sizeof(u8), size, file);
+    bool closed = fclose(file) == 0;
+    free(data);
+
+    ASSERT(written == size && closed, "Could not write `%s`\n", file_path);
+}
+
+static bool section_fits(BinarySection section, usize size, usize record_size) {
+    return section.offset >= sizeof(ModuleHeader) && section.offset % BINARY_ALIGNMENT == 0
+        && section.offset <= size && section.size <= size - section.offset
+        && section.size % record_size == 0;
+}
+
+static bool symbols_valid(const ModuleSymbol *symbols, usize count, const ModuleHeader *header) {
+    for (usize i = 0; i < count; i++) {
+        const ModuleSymbol *symbol = &symbols[i];
+        if (symbol->address > header->code.size || symbol->name_offset > header->names.size
+            || symbol->name_length >= header->names.size - symbol->name_offset) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// A module that doesn't load is assembled again, so nothing here raises an error
+bool load_module_file(const char *file_path, Module *module) {
+    FILE *file = fopen(file_path, "rb");
+    if (file == NULL) { return false; }
+    fclose(file);
+
+    usize size;
+    u8 *data = (u8 *) read_all_from_file(file_path, &size);
+
+    ModuleHeader header;
+    bool valid = size >= sizeof(ModuleHeader);
+    if (valid) {
+        memcpy(&header, data, sizeof(header));
+        valid = memcmp(header.magic, MODULE_MAGIC, sizeof(header.magic)) == 0
+            && header.version == MODULE_VERSION
+            && header.header_size == sizeof(ModuleHeader)
+            && section_fits(header.code, size, 1)
+            && section_fits(header.exports, size, sizeof(ModuleSymbol))
+            && section_fits(header.imports, size, sizeof(ModuleSymbol))
+            && section_fits(header.relocations, size, sizeof(Relocation))
+            && section_fits(header.names, size, 1)
+            && binary_checksum(&data[sizeof(ModuleHeader)], size - sizeof(ModuleHeader)) == header.checksum;
+    }
+    if (!valid) {
+        LOG("`%s` isn't a valid module\n", file_path);
+        free(data);
+        return false;
+    }
+
+    // The sections are aligned in the file, and the contents are malloc()'d
+    memset(module, 0, sizeof(Module));
+    module->code = &data[header.code.offset];
+    module->size = header.code.size;
+    module->exports = (ModuleSymbol *) &data[header.exports.offset];
+    module->exports_count = header.exports.size / sizeof(ModuleSymbol);
+    module->imports = (ModuleSymbol *) &data[header.imports.offset];
+    module->imports_count = header.imports.size / sizeof(ModuleSymbol);
+    module->relocations = (Relocation *) &data[header.relocations.offset];
+    module->relocations_count = header.relocations.size / sizeof(Relocation);
+    module->names = (char *) &data[header.names.offset];
+    module->names_size = header.names.size;
+    module->source_hash = header.source_hash;
+    module->assembler_revision = header.assembler_revision;
+    module->backing = data;
+
+    valid = symbols_valid(module->exports, module->exports_count, &header)
+        && symbols_valid(module->imports, module->imports_count, &header);
+    for (usize i = 0; valid && i < module->relocations_count; i++) {
+        Relocation *relocation = &module->relocations[i];
+        valid = relocation->at <= module->size && module->size - relocation->at >= sizeof(u64)
+            && (relocation->kind == RELOCATION_LOCAL
+                || (relocation->kind == RELOCATION_IMPORT && relocation->symbol < module->imports_count));
+    }
+    for (usize i = 0; valid && i < module->exports_count + module->imports_count; i++) {
+        const ModuleSymbol *symbol = i < module->exports_count ? &module->exports[i] : &module->imports[i - module->exports_count];
+        valid = module->names[symbol->name_offset + symbol->name_length] == '\0';
+    }
+    if (!valid) {
+        LOG("`%s` has invalid symbols or relocations\n", file_path);
+        free_module(module);
+        return false;
+    }
+
+    return true;
+}
+
+void free_module(Module *module) {
+    if (module->backing != NULL) {
+        free(module->backing);
+    } else {
+        free(module->code);
+        free(module->exports);
+        free(module->imports);
+        free(module->relocations);
+        free(module->names);
+    }
+
+    memset(module, 0, sizeof(Module));
+}
+
+void link_modules(const Module *modules, usize count, Program *program, BinarySymbol **symbols, usize *symbols_count) {
+    usize *bases = malloc((count + 1) * sizeof(usize));
+    ASSERT(bases != NULL, "Could not allocate the module addresses\n");
+
+    usize size = 0;
+    usize exports_count = 0;
+    for (usize m = 0; m < count; m++) {
+        bases[m] = size;
+        size += modules[m].size;
+        exports_count += modules[m].exports_count;
+    }
+
+    // Every export by name, the value is the module and export index
+    SymbolTable exports;
+    init_symbol_table(&exports);
+    BinarySymbol *linked_symbols = malloc((exports_count + 1) * sizeof(BinarySymbol));
+    ASSERT(linked_symbols != NULL, "Could not allocate %zu symbols\n", exports_count);
+
+    usize linked_count = 0;
+    for (usize m = 0; m < count; m++) {
+        const Module *module = &modules[m];
+        for (usize i = 0; i < module->exports_count; i++) {
+            const ModuleSymbol *symbol = &module->exports[i];
+            const char *name = module_symbol_name(module, symbol);
+
+            bool existing;
+            Symbol *entry = intern_symbol(&exports, name, symbol->name_length, linked_count, &existing);
+            ASSERT(!existing, "`%s` is exported by `%s` and `%s`\n", name, modules[entry->value >> 32].source_path, module->source_path);
+            entry->value = ((u64) m << 32) | linked_count;
+
+            linked_symbols[linked_count].address = bases[m] + symbol->address;
+            linked_symbols[linked_count].name = name;
+            linked_symbols[linked_count].name_length = symbol->name_length;
+            linked_count++;
+        }
+    }
+
+    *program = create_program();
+    program->size = size;
+    program->code = malloc(size > 0 ? size : 1);
+    ASSERT(program->code != NULL, "Could not allocate the memory for program\n");
+
+    for (usize m = 0; m < count; m++) {
+        const Module *module = &modules[m];
+        u8 *code = &program->code[bases[m]];
+        if (module->size > 0) {
+            memcpy(code, module->code, module->size);
+        }
+
+        for (usize i = 0; i < module->relocations_count; i++) {
+            const Relocation *relocation = &module->relocations[i];
+
+            u64 address;
+            if (relocation->kind == RELOCATION_LOCAL) {
+                memcpy(&address, &code[relocation->at], sizeof(u64));
+                address += bases[m];
+            } else {
+                const ModuleSymbol *import = &module->imports[relocation->symbol];
+                const char *name = module_symbol_name(module, import);
+                Symbol *entry = find_symbol(&exports, name, import->name_length);
+                ASSERT(entry != NULL, "`%s` uses `%s`, which no module exports\n", module->source_path, name);
+                address = linked_symbols[entry->value & 0xFFFFFFFF].address;
+            }
+            memcpy(&code[relocation->at], &address, sizeof(u64));
+        }
+    }
+
+    LOG("Linked %zu modules, %zu bytes and %zu symbols\n", count, size, linked_count);
+
+    free_symbol_table(&exports);
+    free(bases);
+    *symbols = linked_symbols;
+    *symbols_count = linked_count;
+}
+
+bool build_module(const char *source_path, const char *module_path, Module *module) {
+    usize source_size;
+    char *source = read_all_from_file(source_path, &source_size);
+    u64 source_hash = module_source_hash(source, source_size);
+
+    if (load_module_file(module_path, module)) {
+        // Only when it was assembled from the same source, into the same bytes
+        if (module->source_hash == source_hash && module->assembler_revision == ASSEMBLER_REVISION) {
+            LOG("`%s` didn't change, using `%s`\n", source_path, module_path);
+            module->source_path = source_path;
+            free(source);
+            return false;
+        }
+        free_module(module);
+    }
+
+    Assembler assembler = {0};
+    init_assembler(&assembler);
+    assembler.code = source;
+    assembler.count = source_size;
+    assembler.current_pos = 0;
+
+    assemble_module(&assembler, module);
+    module->source_hash = source_hash;
+    module->assembler_revision = ASSEMBLER_REVISION;
+    module->source_path = source_path;
+    write_module_file(module_path, module);
+
+    free_assembler(&assembler);
+    free(source);
+
+    return true;
+}
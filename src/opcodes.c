@@ -1,6 +1,7 @@
 #include "opcodes.h"
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 char *opcode_to_str(OpCode op) {
     #define X(name, val) case name: return #name;
@@ -15,22 +16,135 @@ void print_opcode(OpCode op) {
     printf("%s", opcode_to_str(op));
 }
 
-bool string_to_opcode(OpCode *dst, char *str) {
-    #define X(name, val) else if (strcasecmp(str, #name) == 0) {\
-        *dst = name;\
-        return true; \
+// Mnemonics are at most 4 characters, so they're looked up packed in a u32,
+// upper case, in an open-addressing table filled from OPCODES.
+#define MNEMONIC_TABLE_BITS 7
+#define MNEMONIC_TABLE_SIZE (1 << MNEMONIC_TABLE_BITS)
+
+typedef struct {
+    u32 key; // 0 for an empty slot
+    u8 opcode;
+} MnemonicSlot;
+
+static MnemonicSlot mnemonic_table[MNEMONIC_TABLE_SIZE];
+static pthread_once_t mnemonic_table_once = PTHREAD_ONCE_INIT;
+
+static bool pack_mnemonic(const char *str, usize length, u32 *key) {
+    if (length == 0 || length > sizeof(u32)) { return false; }
+
+    u32 packed = 0;
+    for (usize i = 0; i < length; i++) {
+        u8 c = (u8) str[i];
+        if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }
+        packed = (packed << 8) | c;
     }
 
-    if (str == NULL) { // Why would it? Just to pad the macro
-        *dst = NOP;
+    *key = packed;
+    return true;
+}
+
+static usize mnemonic_slot(u32 key) {
+    return (usize) ((key * 0x9E3779B1u) >> (32 - MNEMONIC_TABLE_BITS));
+}
+
+static void insert_mnemonic(const char *name, OpCode opcode) {
+    u32 key;
+    ASSERT(pack_mnemonic(name, strlen(name), &key), "Mnemonic `%s` doesn't fit the lookup table\n", name);
+
+    usize slot = mnemonic_slot(key);
+    while (mnemonic_table[slot].key != 0) {
+        slot = (slot + 1) & (MNEMONIC_TABLE_SIZE - 1);
     }
-    OPCODES
+    mnemonic_table[slot].key = key;
+    mnemonic_table[slot].opcode = (u8) opcode;
+}
 
+static void build_mnemonic_table(void) {
+    #define X(name, val) insert_mnemonic(#name, name);
+    OPCODES
     #undef X
+}
+
+bool mnemonic_to_opcode(OpCode *dst, const char *str, usize length) {
+    pthread_once(&mnemonic_table_once, build_mnemonic_table);
+
+    u32 key;
+    if (!pack_mnemonic(str, length, &key)) { return false; }
+
+    usize slot = mnemonic_slot(key);
+    while (mnemonic_table[slot].key != 0) {
+        if (mnemonic_table[slot].key == key) {
+            *dst = mnemonic_table[slot].opcode;
+            return true;
+        }
+        slot = (slot + 1) & (MNEMONIC_TABLE_SIZE - 1);
+    }
 
     return false;
 }
 
+bool string_to_opcode(OpCode *dst, char *str) {
+    return mnemonic_to_opcode(dst, str, strlen(str));
+}
+
+usize opcode_immediate_size(OpCode op) {
+    switch (op) {
+        case PS8: return sizeof(u8);
+        case PSH: case STR: return sizeof(u64);
+        // DUPZ takes an offset and a size
+        case DUPZ: return 2 * sizeof(u64);
+        case ADDZ: case SUBZ: case MODZ: case DIVZ: case MULZ:
+        case EQUZ: case LTZ: case DBGZ: case INCZ: case DECZ:
+        case PSHZ: case SWPZ: case DRPZ: case OVRZ:
+        case GTZ: case REFZ: case WRTZ: return sizeof(u64);
+        case ADDI: case SUBI: case MODI: case EQUI: case LTI: case GTI:
+        case JMPI: case JPTI: case JPFI: return sizeof(u64);
+        default: return 0;
+    }
+}
+
+#define EFFECT(p, q, is_pure) (StackEffect) { .pops = (p), .pushes = (q), .pure = (is_pure), .variable = false }
+
+StackEffect opcode_stack_effect(OpCode op) {
+    const u8 w = sizeof(u64);
+    switch (op) {
+        case NOP: return EFFECT(0, 0, true);
+        case ADD: case SUB: case MUL: return EFFECT(2*w, w, true);
+        case DIV: case MOD: return EFFECT(2*w, w, false); // Division by zero traps
+        case EQU: case LT: case GT: return EFFECT(2*w, 1, true);
+        case INC: case DEC: case ADDI: case SUBI: return EFFECT(w, w, true);
+        case MODI: return EFFECT(w, w, false);
+        case EQUI: case LTI: case GTI: return EFFECT(w, 1, true);
+        case PSH: return EFFECT(0, w, true);
+        case PS8: return EFFECT(0, 1, true);
+        case STR: return EFFECT(0, 2*w, true);
+        case DUP: return EFFECT(w, 2*w, true);
+        case SWP: return EFFECT(2*w, 2*w, true);
+        case DRP: return EFFECT(w, 0, true);
+        case OVR: return EFFECT(2*w, 3*w, true);
+        case ROT: return EFFECT(3*w, 3*w, true);
+        case NOT: return EFFECT(1, 1, true);
+        case OR: return EFFECT(2, 1, true);
+        case DBG: case FRE: return EFFECT(w, 0, false);
+        case REF: case ALC: return EFFECT(w, w, false);
+        case RF8: return EFFECT(w, 1, false);
+        case WRT: return EFFECT(2*w, 0, false);
+        case PTC: return EFFECT(1, 0, false);
+        case PTS: return EFFECT(2*w, 0, false);
+        case JMP: case CLL: return EFFECT(w, 0, false);
+        case JPT: case JPF: return EFFECT(w + 1, 0, false);
+        case JPTI: case JPFI: return EFFECT(1, 0, false);
+        case JMPI: case RET: case EXT: case BKP: return EFFECT(0, 0, false);
+        default: {
+            StackEffect effect = { .pure = false, .variable = true };
+            return effect;
+        }
+    }
+}
+#undef EFFECT
+
 #define X(name, val) + 1
 const int OPCODE_COUNT = 0 OPCODES;
 #undef X
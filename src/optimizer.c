@@ -0,0 +1,146 @@
+#include "optimizer.h"
+#include "opcodes.h"
+
+static bool is_immediate_of(Instruction *inst, OpCode opcode, u64 value) {
+    return inst->opcode == opcode &&
+        !inst->operand_is_label &&
+        inst->operands.count == 1 &&
+        inst->operands.data[0].as.u64 == value;
+}
+
+// Opcodes that leave a 0 or a 1 on top of the stack
+static bool pushes_bool(OpCode opcode) {
+    switch (opcode) {
+        case EQU: case LT: case GT:
+        case EQUI: case LTI: case GTI:
+        case NOT: case OR: return true;
+        default: return false;
+    }
+}
+
+static void remove_tail(InstructionArray *out, usize n) {
+    for (usize i = out->count - n; i < out->count; i++) {
+        free_operand_array(&out->data[i].operands);
+    }
+    out->count -= n;
+}
+
+// Tries to simplify the instructions at the end of `out`, without looking before `barrier`.
+// Returns how many instructions were removed.
+static usize simplify_tail(InstructionArray *out, usize barrier) {
+    usize n = out->count - barrier;
+    Instruction *last = &out->data[out->count - 1];
+
+    if (n >= 1) {
+        if (last->opcode == NOP || is_immediate_of(last, ADDI, 0) || is_immediate_of(last, SUBI, 0)) {
+            remove_tail(out, 1);
+            return 1;
+        }
+    }
+
+    if (n >= 2) {
+        Instruction *previous = last - 1;
+        StackEffect effect = opcode_stack_effect(previous->opcode);
+
+        if (previous->opcode == SWP && last->opcode == SWP) {
+            remove_tail(out, 2);
+            return 2;
+        }
+
+        if (last->opcode == DRP && effect.pure && !effect.variable) {
+            // Pushes one u64 and leaves what it read alone (PSH, DUP, OVR): drop both
+            if (effect.pushes == effect.pops + sizeof(u64)) {
+                remove_tail(out, 2);
+                return 2;
+            }
+
+            // Replaces a u64 with another (INC, ADDI...): only the DRP is needed
+            if (effect.pops == sizeof(u64) && effect.pushes == sizeof(u64)) {
+                free_operand_array(&previous->operands);
+                *previous = *last;
+                out->count--;
+                return 1;
+            }
+        }
+
+        if ((is_immediate_of(previous, PSH, 0) && (last->opcode == ADD || last->opcode == SUB)) ||
+            (is_immediate_of(previous, PSH, 1) && (last->opcode == MUL || last->opcode == DIV))) {
+            remove_tail(out, 2);
+            return 2;
+        }
+    }
+
+    if (n >= 3) {
+        Instruction *first = last - 2;
+        Instruction *second = last - 1;
+
+        if (first->opcode == ROT && second->opcode == ROT && last->opcode == ROT) {
+            remove_tail(out, 3);
+            return 3;
+        }
+
+        // NOT turns any byte into 0 or 1, so `NOT NOT` is only a no-op on a 0 or a 1
+        if (pushes_bool(first->opcode) && second->opcode == NOT && last->opcode == NOT) {
+            remove_tail(out, 2);
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+usize optimize_program_builder(ProgramBuilder *builder) {
+    ASSERT(!builder->flat, "The optimizer needs a builder with the instruction list\n");
+
+    InstructionArray *instructions = &builder->instructions;
+    usize count = instructions->count;
+
+    bool *is_target = calloc(count + 1, sizeof(bool));
+    usize *new_index = malloc((count + 1) * sizeof(usize));
+    if (is_target == NULL || new_index == NULL) {
+        ERROR("Could not allocate the memory for the optimizer\n");
+    }
+
+    for (usize label = 0; label < builder->current_label; label++) {
+        if (builder->labels[label] <= count) {
+            is_target[builder->labels[label]] = true;
+        }
+    }
+
+    // Rewrites the array in place, `out` never gets ahead of the instruction being read.
+    // Nothing before the latest label target can be touched: a jump there expects
+    // the stack those instructions leave.
+    InstructionArray out = *instructions;
+    out.count = 0;
+    usize barrier = 0;
+    for (usize i = 0; i < count; i++) {
+        if (is_target[i]) {
+            barrier = out.count;
+        }
+
+        new_index[i] = out.count;
+        out.data[out.count++] = instructions->data[i];
+
+        while (out.count > barrier && simplify_tail(&out, barrier) > 0) {}
+    }
+    new_index[count] = out.count;
+
+    // A label that pointed at a removed instruction now points at the next one left
+    for (usize label = 0; label < builder->current_label; label++) {
+        if (builder->labels[label] <= count) {
+            builder->labels[label] = new_index[builder->labels[label]];
+        }
+    }
+    if (builder->last_linked_index <= count) {
+        builder->last_linked_index = new_index[builder->last_linked_index];
+    }
+
+    usize eliminated = count - out.count;
+    instructions->count = out.count;
+    LOG("Peephole optimizer eliminated %zu of %zu instructions\n", eliminated, count);
+
+    free(is_target);
+    free(new_index);
+
+    return eliminated;
+}
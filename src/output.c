@@ -0,0 +1,281 @@
+#include "output.h"
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+
+OutputSink file_output_sink(FILE *file) {
+    OutputSink sink = { .kind = OUTPUT_FILE, .file = file };
+    return sink;
+}
+
+OutputSink fd_output_sink(int fd) {
+    OutputSink sink = { .kind = OUTPUT_FD, .fd = fd };
+    return sink;
+}
+
+OutputSink memory_output_sink(StringBuffer *memory) {
+    OutputSink sink = { .kind = OUTPUT_MEMORY, .memory = memory };
+    return sink;
+}
+
+static void write_to_sink(OutputSink *sink, const char *data, usize n) {
+    switch (sink->kind) {
+        case OUTPUT_FILE: {
+            fwrite(data, sizeof(char), n, sink->file);
+            break;
+        }
+        case OUTPUT_FD: {
+            while (n > 0) {
+                ssize_t written = write(sink->fd, data, n);
+                if (written <= 0) {
+                    // Nobody is there to report it to, the output is dropped like stdio would
+                    return;
+                }
+                data += written;
+                n -= (usize) written;
+            }
+            break;
+        }
+        case OUTPUT_MEMORY: {
+            StringBuffer *memory = sink->memory;
+            grow_string_buffer_to_fit(memory, n);
+            memcpy(&memory->str[memory->count], data, n);
+            memory->count += n;
+            break;
+        }
+    }
+}
+
+static char *allocate_output_data(void) {
+    char *data = malloc(OUTPUT_BUFFER_SIZE);
+    if (data == NULL) {
+        ERROR("Could not allocate an output buffer\n");
+    }
+
+    return data;
+}
+
+void init_output_buffer(OutputBuffer *buffer, OutputSink sink) {
+    buffer->data = allocate_output_data();
+    buffer->count = 0;
+    buffer->sink = sink;
+}
+
+void free_output_buffer(OutputBuffer *buffer) {
+    sync_output(buffer);
+    free(buffer->data);
+    buffer->data = NULL;
+}
+
+static void push_chunk(OutputWriter *writer, OutputSink sink, char *data, usize count);
+
+void flush_output(OutputBuffer *buffer) {
+    if (buffer->count == 0) { return; }
+
+    if (buffer->sink.writer != NULL) {
+        // The writer frees the data once it's written, the VM goes on with a new one
+        push_chunk(buffer->sink.writer, buffer->sink, buffer->data, buffer->count);
+        buffer->data = allocate_output_data();
+    } else {
+        write_to_sink(&buffer->sink, buffer->data, buffer->count);
+    }
+    buffer->count = 0;
+}
+
+void sync_output(OutputBuffer *buffer) {
+    flush_output(buffer);
+
+    if (buffer->sink.writer != NULL) {
+        drain_output_writer(buffer->sink.writer);
+    }
+    if (buffer->sink.kind == OUTPUT_FILE) {
+        fflush(buffer->sink.file);
+    }
+}
+
+void write_output_slow(OutputBuffer *buffer, const char *data, usize n) {
+    flush_output(buffer);
+
+    if (n > OUTPUT_BUFFER_SIZE) {
+        // Too big to be worth copying, it's written once everything before it is out
+        if (buffer->sink.writer != NULL) {
+            drain_output_writer(buffer->sink.writer);
+        }
+        write_to_sink(&buffer->sink, data, n);
+        return;
+    }
+
+    memcpy(buffer->data, data, n);
+    buffer->count = n;
+}
+
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Decimal digits are written from the end, two at a time
+void write_output_u64(OutputBuffer *buffer, u64 value) {
+    char digits[20];
+    usize start = sizeof(digits);
+
+    while (value >= 100) {
+        usize pair = (value % 100) * 2;
+        value /= 100;
+        start -= 2;
+        digits[start] = DIGIT_PAIRS[pair];
+        digits[start + 1] = DIGIT_PAIRS[pair + 1];
+    }
+
+    if (value >= 10) {
+        usize pair = value * 2;
+        start -= 2;
+        digits[start] = DIGIT_PAIRS[pair];
+        digits[start + 1] = DIGIT_PAIRS[pair + 1];
+    } else {
+        digits[--start] = (char) ('0' + value);
+    }
+
+    write_output(buffer, &digits[start], sizeof(digits) - start);
+}
+
+// Writer
+
+static void wait_a_little(void) {
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 50 * 1000 };
+    nanosleep(&pause, NULL);
+}
+
+static void wake_output_writer(OutputWriter *writer) {
+    pthread_mutex_lock(&writer->lock);
+    pthread_cond_signal(&writer->work_available);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// Every slot has a sequence number: `position` when it can be filled for that
+// position, `position + 1` once it's filled, and it moves a lap ahead once it's written.
+static void push_chunk(OutputWriter *writer, OutputSink sink, char *data, usize count) {
+    usize position = atomic_load_explicit(&writer->head, memory_order_relaxed);
+    OutputChunk *chunk;
+
+    for (;;) {
+        chunk = &writer->ring[position % OUTPUT_RING_SIZE];
+        usize sequence = atomic_load_explicit(&chunk->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&writer->head, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // The ring is full, the writer is behind
+            wait_a_little();
+            position = atomic_load_explicit(&writer->head, memory_order_relaxed);
+        } else {
+            position = atomic_load_explicit(&writer->head, memory_order_relaxed);
+        }
+    }
+
+    chunk->sink = sink;
+    chunk->data = data;
+    chunk->count = count;
+    atomic_store_explicit(&chunk->sequence, position + 1, memory_order_release);
+
+    // Sequentially consistent against the writer setting `sleeping` before it looks
+    // at the ring once more: either it sees this chunk, or this sees it sleeping.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&writer->sleeping, memory_order_relaxed)) {
+        wake_output_writer(writer);
+    }
+}
+
+// Only the writer thread takes chunks out
+static OutputChunk *next_chunk(OutputWriter *writer, usize position) {
+    OutputChunk *chunk = &writer->ring[position % OUTPUT_RING_SIZE];
+    usize sequence = atomic_load_explicit(&chunk->sequence, memory_order_acquire);
+    return sequence == position + 1 ? chunk : NULL;
+}
+
+static bool write_next_chunk(OutputWriter *writer) {
+    usize position = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+    OutputChunk *chunk = next_chunk(writer, position);
+    if (chunk == NULL) { return false; }
+
+    write_to_sink(&chunk->sink, chunk->data, chunk->count);
+    if (chunk->sink.kind == OUTPUT_FILE) {
+        fflush(chunk->sink.file);
+    }
+    free(chunk->data);
+
+    atomic_store_explicit(&chunk->sequence, position + OUTPUT_RING_SIZE, memory_order_release);
+    atomic_store_explicit(&writer->tail, position + 1, memory_order_release);
+    return true;
+}
+
+// Looks at the ring again once `sleeping` is set, so a chunk pushed in between isn't missed
+static void sleep_until_pushed(OutputWriter *writer) {
+    pthread_mutex_lock(&writer->lock);
+    atomic_store_explicit(&writer->sleeping, true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    usize position = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+    if (next_chunk(writer, position) == NULL && !atomic_load_explicit(&writer->stopping, memory_order_acquire)) {
+        pthread_cond_wait(&writer->work_available, &writer->lock);
+    }
+
+    atomic_store_explicit(&writer->sleeping, false, memory_order_relaxed);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+static void *writer_main(void *argument) {
+    OutputWriter *writer = argument;
+
+    for (;;) {
+        if (write_next_chunk(writer)) { continue; }
+
+        if (atomic_load_explicit(&writer->stopping, memory_order_acquire)) {
+            // Whatever was pushed before stopping is out already, or still gets written here
+            while (write_next_chunk(writer)) {}
+            return NULL;
+        }
+        sleep_until_pushed(writer);
+    }
+}
+
+void start_output_writer(OutputWriter *writer) {
+    for (usize i = 0; i < OUTPUT_RING_SIZE; i++) {
+        atomic_init(&writer->ring[i].sequence, i);
+    }
+    atomic_init(&writer->head, 0);
+    atomic_init(&writer->tail, 0);
+    atomic_init(&writer->stopping, false);
+    atomic_init(&writer->sleeping, false);
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->work_available, NULL);
+
+    ASSERT(pthread_create(&writer->thread, NULL, writer_main, writer) == 0, "Could not start the output writer\n");
+}
+
+void stop_output_writer(OutputWriter *writer) {
+    atomic_store_explicit(&writer->stopping, true, memory_order_seq_cst);
+    wake_output_writer(writer);
+    pthread_join(writer->thread, NULL);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->work_available);
+}
+
+void drain_output_writer(OutputWriter *writer) {
+    usize head = atomic_load_explicit(&writer->head, memory_order_acquire);
+    while (atomic_load_explicit(&writer->tail, memory_order_acquire) < head) {
+        wait_a_little();
+    }
+}
@@ -0,0 +1,193 @@
+// pthread_setaffinity_np() is a GNU extension
+#define _GNU_SOURCE
+#include "pool.h"
+#include "jit.h"
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    PreparedProgram *prepared;
+    ExecutionEngine engine;
+} WorkerRun;
+
+static void run_worker_program(VM *vm, void *context) {
+    WorkerRun *run = context;
+    run_prepared_program(vm, run->prepared, run->engine);
+}
+
+// Errors raised while the job runs end up in the job instead of exiting
+static void run_job(VM *vm, PreparedProgram *prepared, VMPoolConfig *config, PoolJob *job) {
+    ExecutionEngine engine = config->engine;
+    ErrorTrap trap;
+    error_trap = &trap;
+
+    if (sigsetjmp(trap.jump, 1) == 0) {
+        prepare_program(prepared, job->program, job->program_id, engine, vm->memory.model);
+
+        set_vm_output(vm, job->output != NULL ? *job->output : config->vm_config.output);
+        reset_vm(vm, job->program);
+        for (usize i = 0; i < job->stack_count; i++) {
+            push_u64_to_stack(&vm->stack, job->stack[i]);
+        }
+
+        WorkerRun run = { .prepared = prepared, .engine = engine };
+        run_trapping_faults(vm, run_worker_program, &run);
+        sync_output(&vm->output);
+        job->ok = true;
+    } else {
+        job->ok = false;
+        memcpy(job->error, trap.message, sizeof(job->error));
+    }
+
+    error_trap = NULL;
+
+    job->stack_size = vm->stack.sp;
+    job->top = 0;
+    if (job->ok && vm->stack.sp >= sizeof(u64)) {
+        memcpy(&job->top, &vm->stack.storage[vm->stack.sp - sizeof(u64)], sizeof(u64));
+    }
+}
+
+static void pin_worker(PoolWorker *worker) {
+#if defined(__linux__)
+    usize cores = (usize) sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->index % cores, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        LOG("Could not pin worker %zu\n", worker->index);
+    }
+#else
+    LOG("Pinning workers is not supported here, worker %zu runs anywhere\n", worker->index);
+#endif
+}
+
+static PoolJob *take_job(VMPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queue_head == NULL && !pool->stopping) {
+        pthread_cond_wait(&pool->job_available, &pool->lock);
+    }
+
+    PoolJob *job = pool->queue_head;
+    if (job != NULL) {
+        pool->queue_head = job->next;
+        if (pool->queue_head == NULL) {
+            pool->queue_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return job;
+}
+
+static void finish_job(VMPool *pool, PoolJob *job) {
+    pthread_mutex_lock(&pool->lock);
+    job->done = true;
+    pool->pending--;
+    if (pool->pending == 0) {
+        pthread_cond_broadcast(&pool->job_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker_main(void *argument) {
+    PoolWorker *worker = argument;
+    VMPool *pool = worker->pool;
+
+    // Pinned before the VM is created, so its stacks are first touched on the worker's node
+    if (pool->config.pin_workers) {
+        pin_worker(worker);
+    }
+
+    VM *vm = create_vm(&pool->config.vm_config);
+    PreparedProgram prepared = {0};
+
+    PoolJob *job;
+    while ((job = take_job(pool)) != NULL) {
+        run_job(vm, &prepared, &pool->config, job);
+        finish_job(pool, job);
+    }
+
+    free_prepared_program(&prepared);
+    free_vm(vm);
+    return NULL;
+}
+
+VMPoolConfig default_vm_pool_config(void) {
+    VMPoolConfig config = {
+        .workers = 0,
+        .engine = DEFAULT_ENGINE,
+        .vm_config = default_vm_config(),
+        .pin_workers = false
+    };
+    return config;
+}
+
+void init_vm_pool(VMPool *pool, VMPoolConfig config) {
+    ASSERT(config.engine != ENGINE_DEBUG, "The debug engine can't run in a pool\n");
+
+    memset(pool, 0, sizeof(VMPool));
+    pool->config = config;
+    pool->workers_count = config.workers > 0 ? config.workers : (usize) sysconf(_SC_NPROCESSORS_ONLN);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_available, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+
+    pool->workers = calloc(pool->workers_count, sizeof(PoolWorker));
+    if (pool->workers == NULL) {
+        ERROR("Could not allocate the workers of the pool\n");
+    }
+
+    for (usize i = 0; i < pool->workers_count; i++) {
+        PoolWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        ASSERT(pthread_create(&worker->thread, NULL, worker_main, worker) == 0, "Could not start worker %zu\n", i);
+    }
+
+    LOG("Started a pool with %zu workers\n", pool->workers_count);
+}
+
+void free_vm_pool(VMPool *pool) {
+    wait_for_jobs(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->job_available);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (usize i = 0; i < pool->workers_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    free(pool->workers);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->job_available);
+    pthread_cond_destroy(&pool->job_done);
+}
+
+void submit_job(VMPool *pool, PoolJob *job) {
+    job->done = false;
+    job->next = NULL;
+    job->program_id = program_id(job->program);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queue_tail != NULL) {
+        pool->queue_tail->next = job;
+    } else {
+        pool->queue_head = job;
+    }
+    pool->queue_tail = job;
+    pool->pending++;
+    pthread_cond_signal(&pool->job_available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void wait_for_jobs(VMPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
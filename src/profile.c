@@ -0,0 +1,115 @@
+#include "profile.h"
+#include "opcodes.h"
+#include "program_builder.h"
+#include <string.h>
+
+void init_vm_profile(VMProfile *profile, Program *program, bool timed) {
+    memset(profile, 0, sizeof(VMProfile));
+    profile->timed = timed;
+    profile->code_size = program->size;
+    profile->address_counts = calloc(program->size + 1, sizeof(u64));
+    profile->call_counts = calloc(program->size + 1, sizeof(u64));
+    if (profile->address_counts == NULL || profile->call_counts == NULL) {
+        ERROR("Could not allocate the profile of %zu bytes of code\n", program->size);
+    }
+}
+
+void free_vm_profile(VMProfile *profile) {
+    free(profile->address_counts);
+    free(profile->call_counts);
+    profile->address_counts = NULL;
+    profile->call_counts = NULL;
+}
+
+typedef struct {
+    usize key;  // Opcode or address
+    u64 count;
+} ProfileEntry;
+
+// Most counted first, ties by key
+static int compare_profile_entries(const void *a, const void *b) {
+    const ProfileEntry *x = a;
+    const ProfileEntry *y = b;
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+    return x->key < y->key ? -1 : (x->key > y->key);
+}
+
+// The keys with a count, sorted
+static ProfileEntry *sorted_entries(const u64 *counts, usize count, usize *entries_count) {
+    ProfileEntry *entries = malloc((count + 1) * sizeof(ProfileEntry));
+    ASSERT(entries != NULL, "Could not allocate the profile report\n");
+
+    usize used = 0;
+    for (usize i = 0; i < count; i++) {
+        if (counts[i] > 0) {
+            entries[used].key = i;
+            entries[used].count = counts[i];
+            used++;
+        }
+    }
+    qsort(entries, used, sizeof(ProfileEntry), compare_profile_entries);
+
+    *entries_count = used;
+    return entries;
+}
+
+static double percent_of(u64 count, u64 total) {
+    return total > 0 ? 100.0 * (double) count / (double) total : 0.0;
+}
+
+void print_vm_profile(VMProfile *profile, Program *program) {
+    u64 total = profile->instructions;
+    u64 total_cycles = 0;
+    for (usize op = 0; op < 256; op++) {
+        total_cycles += profile->opcode_cycles[op];
+    }
+
+    printf("Profile: %llu instructions", total);
+    if (profile->timed) {
+        printf(", %llu cycles", total_cycles);
+    }
+    printf("\n\nOpcodes:\n");
+
+    usize entries_count;
+    ProfileEntry *entries = sorted_entries(profile->opcode_counts, 256, &entries_count);
+    for (usize i = 0; i < entries_count; i++) {
+        usize op = entries[i].key;
+        const char *name = opcode_to_str((OpCode) op);
+        printf("  %12llu %6.2f%%  %-5s", entries[i].count, percent_of(entries[i].count, total), name != NULL ? name : "???");
+        if (profile->timed) {
+            printf(" %8.1f cycles/op %6.2f%% of cycles",
+                   (double) profile->opcode_cycles[op] / (double) entries[i].count,
+                   percent_of(profile->opcode_cycles[op], total_cycles));
+        }
+        printf("\n");
+    }
+    free(entries);
+
+    entries = sorted_entries(profile->call_counts, profile->code_size, &entries_count);
+    if (entries_count > 0) {
+        printf("\nCall targets:\n");
+        for (usize i = 0; i < entries_count; i++) {
+            printf("  %12llu  0x%03zx\n", entries[i].count, entries[i].key);
+        }
+    }
+    free(entries);
+
+    // Every instruction with how many times it ran, blank for the ones that never did
+    printf("\nAnnotated program:\n");
+    for (usize address = 0; address < program->size;) {
+        u64 count = profile->address_counts[address];
+        if (profile->call_counts[address] > 0) {
+            printf("\n0x%03zx: called %llu times\n", address, profile->call_counts[address]);
+        }
+
+        if (count > 0) {
+            printf("%12llu %6.2f%%", count, percent_of(count, total));
+        } else {
+            printf("%20s", "");
+        }
+        address += print_encoded_instruction(program->code, program->size, address, NULL);
+        printf("\n");
+    }
+}
@@ -1,4 +1,7 @@
 #include "program.h"
+#include "jit.h"
+#include <stdatomic.h>
+#include <sys/mman.h>
 
 // A print program that can be used for debugging.
 void print_program(Program* p) {
@@ -23,5 +26,30 @@ Program create_program(void) {
 }
 
 void destroy_program(Program* program) {
-    free(program->code);
+    if (program->mapped_size > 0) {
+        munmap(program->backing, program->mapped_size);
+    } else {
+        free(program->backing != NULL ? program->backing : program->code);
+    }
+    program->code = NULL;
+    program->backing = NULL;
+    program->mapped_size = 0;
+    program->id = 0;
+
+    if (program->prepared != NULL) {
+        free_prepared_program(program->prepared);
+        free(program->prepared);
+        program->prepared = NULL;
+    }
+}
+
+// Unlike its address, which the allocator hands out again once it's freed,
+// the id tells a program apart from every other one the process ever ran.
+u64 program_id(Program *program) {
+    static _Atomic u64 next_id = 1;
+
+    if (program->id == 0) {
+        program->id = atomic_fetch_add(&next_id, 1);
+    }
+    return program->id;
 }
@@ -131,45 +131,237 @@ void init_program_builder(ProgramBuilder *builder) {
     init_inst_array(&builder->instructions, 4);
 }
 
+void init_flat_program_builder(ProgramBuilder *builder) {
+    init_inst_array(&builder->instructions, 0);
+    builder->flat = true;
+    builder->bytes_capacity = 4096;
+    builder->bytes = malloc(builder->bytes_capacity);
+    builder->fixups_capacity = 64;
+    builder->fixups = malloc(builder->fixups_capacity * sizeof(LabelFixup));
+    if (builder->bytes == NULL || builder->fixups == NULL) {
+        ERROR("Could not allocate the memory for the program builder");
+    }
+}
+
 void free_program_builder(ProgramBuilder *builder) {
     free_inst_array(&builder->instructions);
+    free(builder->labels);
+    free(builder->bytes);
+    free(builder->fixups);
+    builder->labels = NULL;
+    builder->labels_capacity = 0;
+    builder->current_label = 0;
+    builder->bytes = NULL;
+    builder->fixups = NULL;
 }
 
-void debug_print_program_builder(ProgramBuilder *builder) {
-    usize size = 0;
-    usize addresses[builder->instructions.count];
-    for (usize i = 0; i < builder->instructions.count; i++) {
-        Instruction *inst = &builder->instructions.data[i];
-        addresses[i] = size;
-        usize operand_size = 0;
-        for (usize j = 0; j < inst->operands.count; j++) {
-            Operand *operand = &inst->operands.data[j];
-            operand_size += operand->type;
+// Flat builders
+
+static u8 *reserve_bytes(ProgramBuilder *builder, usize n) {
+    if (builder->bytes_capacity - builder->bytes_count < n) {
+        while (builder->bytes_capacity - builder->bytes_count < n) {
+            builder->bytes_capacity *= 2;
+        }
+        builder->bytes = realloc(builder->bytes, builder->bytes_capacity);
+        if (builder->bytes == NULL) {
+            ERROR("Could not grow the program builder to %zu bytes", builder->bytes_capacity);
         }
-        size += 1 + operand_size;
     }
 
-    u64 labels[builder->current_label];
+    u8 *start = &builder->bytes[builder->bytes_count];
+    builder->bytes_count += n;
+    return start;
+}
 
-    for (usize i = 0; i < builder->instructions.count; i++) {
-        Instruction *inst = &builder->instructions.data[i];
-        if (inst->operand_is_label) {
-            ASSERT(inst->operands.count == 1, "Label should be the only operand\n");
-            Operand *operand = &inst->operands.data[0];
+static void encode_opcode(ProgramBuilder *builder, OpCode opcode) {
+    builder->last_instruction = builder->bytes_count;
+    *reserve_bytes(builder, 1) = (u8) opcode;
+}
 
-            ASSERT(operand->type == OPERAND_U64, "Label index should be 64bit long\n");
+static void encode_operand(ProgramBuilder *builder, Operand operand) {
+    memcpy(reserve_bytes(builder, operand.type), &operand.as, operand.type);
+}
 
-            u64 address = builder->labels[operand->as.u64];
-            labels[operand->as.u64] = (u64)addresses[address];
+static void encode_label_operand(ProgramBuilder *builder, u64 label) {
+    if (builder->fixups_count == builder->fixups_capacity) {
+        builder->fixups_capacity *= 2;
+        builder->fixups = realloc(builder->fixups, builder->fixups_capacity * sizeof(LabelFixup));
+        if (builder->fixups == NULL) {
+            ERROR("Could not grow the label fixups");
         }
     }
 
+    LabelFixup fixup = { .at = builder->bytes_count, .label = label };
+    builder->fixups[builder->fixups_count++] = fixup;
+    memset(reserve_bytes(builder, sizeof(u64)), 0, sizeof(u64));
+}
+
+// Whether the u64 at `at` is a label, for the last instruction encoded
+static bool operand_is_fixup(ProgramBuilder *builder, usize at) {
+    return builder->fixups_count > 0 && builder->fixups[builder->fixups_count - 1].at == at;
+}
+
+typedef struct {
+    usize address;
+    usize label;
+} LinkedLabel;
+
+static int compare_linked_labels(const void *a, const void *b) {
+    const LinkedLabel *x = a;
+    const LinkedLabel *y = b;
+    if (x->address != y->address) {
+        return x->address < y->address ? -1 : 1;
+    }
+    return x->label < y->label ? -1 : (x->label > y->label);
+}
+
+// Every label with where it points, in the order they show up in a listing
+static LinkedLabel *sorted_labels(ProgramBuilder *builder) {
+    LinkedLabel *linked = malloc((builder->current_label + 1) * sizeof(LinkedLabel));
+    ASSERT(linked != NULL, "Could not allocate the label listing\n");
+    for (usize l = 0; l < builder->current_label; l++) {
+        linked[l].address = builder->labels[l];
+        linked[l].label = l;
+    }
+    qsort(linked, builder->current_label, sizeof(LinkedLabel), compare_linked_labels);
+
+    return linked;
+}
+
+
+static void print_string_operand(const u8 *str, usize length) {
+    printf("\"");
+    for (usize j = 0; j < length; j++) {
+        char c = (char) str[j];
+        if (c == *"\n") {
+            printf("\\n");
+        } else if (c == *"\t") {
+            printf("\\t");
+        } else if (c == *"\r") {
+            printf("\\r");
+        } else if (c == *"\"") {
+            printf("\\\"");
+        } else if (c == *"'") {
+            printf("\\'");
+        } else if (c == *"\\") {
+            printf("\\\\");
+        } else {
+            printf("%c", c);
+        }
+    }
+    printf("\"");
+}
+
+usize print_encoded_instruction(const u8 *code, usize size, usize address, const LabelFixup *label) {
+    OpCode opcode = code[address];
+    usize immediate_size = opcode_immediate_size(opcode);
+    const char *name = opcode_to_str(opcode);
+    printf("  [0x%03zx]\t%-s ", address, name != NULL ? name : "???");
+
+    const u8 *operands = &code[address + 1];
+    usize left = size - address - 1;
+    if (immediate_size > left) {
+        printf("(truncated)");
+        return size - address;
+    }
+
+    if (opcode == STR) {
+        u64 length;
+        memcpy(&length, operands, sizeof(u64));
+        if (length > left - immediate_size) {
+            printf("(truncated)");
+            return size - address;
+        }
+        printf("(%#06llx) ", length);
+        print_string_operand(operands + sizeof(u64), length);
+        immediate_size += length;
+    } else if (label != NULL) {
+        printf("'label#%llu", label->label);
+    } else if (immediate_size == sizeof(u8)) {
+        printf("0x%02x ", operands[0]);
+    } else {
+        for (usize j = 0; j < immediate_size; j += sizeof(u64)) {
+            u64 value;
+            memcpy(&value, &operands[j], sizeof(u64));
+            printf("0x%08llx ", value);
+        }
+    }
+
+    return 1 + immediate_size;
+}
+
+// Same listing as for the instruction list, read back from the encoded bytes
+static void debug_print_flat_program_builder(ProgramBuilder *builder) {
+    LinkedLabel *linked = sorted_labels(builder);
+
+    const u8 *bytes = builder->bytes;
+    usize next_label = 0;
+    usize next_fixup = 0;
+    for (usize address = 0; address < builder->bytes_count;) {
+        while (next_label < builder->current_label && linked[next_label].address <= address) {
+            if (linked[next_label].address == address) {
+                printf("\nlabel#%zu:\n", linked[next_label].label);
+            }
+            next_label++;
+        }
+
+        const LabelFixup *label = NULL;
+        if (next_fixup < builder->fixups_count && builder->fixups[next_fixup].at == address + 1) {
+            label = &builder->fixups[next_fixup++];
+        }
+        usize length = print_encoded_instruction(bytes, builder->bytes_count, address, label);
+        printf("\n");
+
+        address += length;
+    }
+
+    free(linked);
+}
+
+// Byte address of every instruction, plus one past the last so labels at the end resolve.
+// `size` gets the size of the whole program.
+static usize *instruction_addresses(ProgramBuilder *builder, usize *size) {
+    usize count = builder->instructions.count;
+    usize *addresses = malloc((count + 1) * sizeof(usize));
+    if (addresses == NULL) {
+        ERROR("Could not allocate the addresses of %zu instructions\n", count);
+    }
+
+    usize address = 0;
+    for (usize i = 0; i < count; i++) {
+        Instruction *inst = &builder->instructions.data[i];
+        addresses[i] = address;
+        usize operand_size = 0;
+        for (usize j = 0; j < inst->operands.count; j++) {
+            operand_size += inst->operands.data[j].type;
+        }
+        address += 1 + operand_size;
+    }
+    addresses[count] = address;
+
+    if (size != NULL) {
+        *size = address;
+    }
+    return addresses;
+}
+
+void debug_print_program_builder(ProgramBuilder *builder) {
+    if (builder->flat) {
+        debug_print_flat_program_builder(builder);
+        return;
+    }
+
+    usize *addresses = instruction_addresses(builder, NULL);
+    LinkedLabel *linked = sorted_labels(builder);
+    usize next_label = 0;
+
     // Print the instructions as a disassembly
     for (usize i = 0; i < builder->instructions.count; i++) {
-        for (usize l = 0; l < builder->current_label; l++) {
-            if (builder->labels[l] == i) {
-                printf("\nlabel#%zu:\n", l);
+        while (next_label < builder->current_label && linked[next_label].address <= i) {
+            if (linked[next_label].address == i) {
+                printf("\nlabel#%zu:\n", linked[next_label].label);
             }
+            next_label++;
         }
 
         Instruction *inst = &builder->instructions.data[i];
@@ -178,27 +370,15 @@ void debug_print_program_builder(ProgramBuilder *builder) {
             u64 size = inst->operands.data[0].as.u64;
             printf("(%#06llx) ", size);
 
-            printf("\"");
-            for (usize j = 1; j < inst->operands.count; j++) {
-                Operand *operand = &inst->operands.data[j];
-                char c = operand->as.u8;
-                if (c == *"\n") {
-                    printf("\\n");
-                } else if (c == *"\t") {
-                    printf("\\t");
-                } else if (c == *"\r") {
-                    printf("\\r");
-                } else if (c == *"\"") {
-                    printf("\\\"");
-                } else if (c == *"'") {
-                    printf("\\'");
-                } else if (c == *"\\") {
-                    printf("\\\\");
-                } else {
-                    printf("%c", operand->as.u8);
-                }
+            // One operand per byte, gathered so the escaping is the same as in the flat listing
+            usize length = inst->operands.count - 1;
+            u8 *str = malloc(length + 1);
+            ASSERT(str != NULL, "Could not allocate the memory for a string operand\n");
+            for (usize j = 0; j < length; j++) {
+                str[j] = inst->operands.data[j + 1].as.u8;
             }
-            printf("\"");
+            print_string_operand(str, length);
+            free(str);
         } else if (inst->operand_is_label) {
             u64 address = inst->operands.data[0].as.u64;
             printf("'label#%llu", address);
@@ -227,41 +407,51 @@ void debug_print_program_builder(ProgramBuilder *builder) {
         }
         printf("\n");
     }
+
+    free(addresses);
+    free(linked);
 }
 
 void clone_to_program(ProgramBuilder *builder, Program *program) {
-    // First, figure out the size of the program and the address for each instruction
-    usize size = 0;
-    usize addresses[builder->instructions.count];
-    for (usize i = 0; i < builder->instructions.count; i++) {
-        Instruction *inst = &builder->instructions.data[i];
-        addresses[i] = size;
-        usize operand_size = 0;
-        for (usize j = 0; j < inst->operands.count; j++) {
-            Operand *operand = &inst->operands.data[j];
-            operand_size += operand->type;
+    if (builder->flat) {
+        // Everything is encoded already, only the label operands are missing
+        for (usize i = 0; i < builder->fixups_count; i++) {
+            LabelFixup *fixup = &builder->fixups[i];
+            ASSERT(fixup->label < builder->current_label, "Label %llu was never created\n", fixup->label);
+            usize position = builder->labels[fixup->label];
+            u64 address = position == UNLINKED_LABEL ? 0 : position;
+            memcpy(&builder->bytes[fixup->at], &address, sizeof(u64));
         }
-        size += 1 + operand_size;
-    }
 
-    u64 labels[builder->current_label];
+        program->size = builder->bytes_count;
+        program->code = malloc(builder->bytes_count > 0 ? builder->bytes_count : 1);
+        if (program->code == NULL) {
+            ERROR("Could not allocate the memory for program");
+        }
+        memcpy(program->code, builder->bytes, builder->bytes_count);
+        return;
+    }
 
-    // Then resolve the labels.
-    // Each value in builder->labels is the index of the instruction that the label points to.
-    // We need to replace the label with the address of the instruction.
-    for (usize i = 0; i < builder->instructions.count; i++) {
-        Instruction *inst = &builder->instructions.data[i];
-        if (inst->operand_is_label) {
-            // labels should have only one operand
-            ASSERT(inst->operands.count == 1, "[%zu]0x%x instruction has more than one operand, not %zu\n", i, inst->opcode, inst->operands.count);
-            ASSERT(inst->operands.data[0].type == OPERAND_U64, "[%zu] label operand should be u64\n", i);
-            u64 index = inst->operands.data[0].as.u64;
-            usize label_addr = builder->labels[index];
-            usize target_addr = addresses[label_addr];
-            labels[index] = target_addr;
-
-            LOG("Replaced label %llu value from %zu to 0x%zx\n", index, label_addr, target_addr);
+    // First, figure out the size of the program and the address for each instruction
+    usize size;
+    usize *addresses = instruction_addresses(builder, &size);
+
+    // Then resolve the labels: each one holds the index of the instruction it points to,
+    // which becomes the address of that instruction
+    u64 *labels = malloc((builder->current_label + 1) * sizeof(u64));
+    if (labels == NULL) {
+        ERROR("Could not allocate the addresses of %u labels\n", builder->current_label);
+    }
+    for (usize l = 0; l < builder->current_label; l++) {
+        usize index = builder->labels[l];
+        if (index == UNLINKED_LABEL) {
+            labels[l] = 0;
+            continue;
         }
+
+        ASSERT(index <= builder->instructions.count, "Label %zu points past the end\n", l);
+        labels[l] = addresses[index];
+        VERBOSE_LOG("Label %zu is at 0x%llx\n", l, labels[l]);
     }
 
     // Now we can allocate the memory for the program
@@ -286,6 +476,7 @@ void clone_to_program(ProgramBuilder *builder, Program *program) {
         usize operand_size = 0;
         if (inst->operand_is_label) {
             u64 label_id = inst->operands.data[0].as.u64;
+            ASSERT(label_id < builder->current_label, "[%zu] label %llu was never created\n", i, label_id);
             u64 label_address = labels[label_id];
 
             memcpy(mem_start, &label_address, sizeof(u64));
@@ -297,9 +488,73 @@ void clone_to_program(ProgramBuilder *builder, Program *program) {
             }
         }
     }
+
+    free(addresses);
+    free(labels);
+}
+
+// The opcode that takes the operand of a preceding PSH, if there is one.
+static bool immediate_form_of(OpCode opcode, bool operand_is_label, OpCode *dst) {
+    switch (opcode) {
+        case JMP: *dst = JMPI; return true;
+        case JPT: *dst = JPTI; return true;
+        case JPF: *dst = JPFI; return true;
+        default: break;
+    }
+
+    // Label addresses are only useful as jump targets
+    if (operand_is_label) { return false; }
+
+    switch (opcode) {
+        case ADD: *dst = ADDI; return true;
+        case SUB: *dst = SUBI; return true;
+        case MOD: *dst = MODI; return true;
+        case EQU: *dst = EQUI; return true;
+        case LT: *dst = LTI; return true;
+        case GT: *dst = GTI; return true;
+        default: return false;
+    }
+}
+
+// The flat version of the fusion below: PSH and its immediate form are encoded the same
+// way, so only the opcode byte changes
+static bool fuse_flat_push(ProgramBuilder *builder, OpCode opcode) {
+    if (builder->bytes_count == 0 || builder->last_linked_index == builder->bytes_count) { return false; }
+
+    usize previous = builder->last_instruction;
+    OpCode fused;
+    if (builder->bytes[previous] == PSH &&
+        immediate_form_of(opcode, operand_is_fixup(builder, previous + 1), &fused)) {
+        VERBOSE_LOG("Fusing PSH and %s into %s\n", opcode_to_str(opcode), opcode_to_str(fused));
+        builder->bytes[previous] = (u8) fused;
+        return true;
+    }
+
+    return false;
 }
 
 Instruction *emit_plain_instruction(ProgramBuilder *builder, OpCode opcode) {
+    if (builder->flat) {
+        if (!fuse_flat_push(builder, opcode)) {
+            encode_opcode(builder, opcode);
+        }
+        return NULL;
+    }
+
+    // `PSH x` followed by an opcode with an immediate form is fused into it,
+    // unless a label points between the two.
+    InstructionArray *instructions = &builder->instructions;
+    if (instructions->count > 0 && builder->last_linked_index != instructions->count) {
+        Instruction *previous = &instructions->data[instructions->count - 1];
+        OpCode fused;
+        if (previous->opcode == PSH && previous->operands.count == 1 &&
+            immediate_form_of(opcode, previous->operand_is_label, &fused)) {
+            VERBOSE_LOG("Fusing PSH and %s into %s\n", opcode_to_str(opcode), opcode_to_str(fused));
+            previous->opcode = fused;
+            return previous;
+        }
+    }
+
     Instruction instruction = {0};
     instruction.opcode = opcode;
     init_operand_array(&instruction.operands, 0);
@@ -308,6 +563,19 @@ Instruction *emit_plain_instruction(ProgramBuilder *builder, OpCode opcode) {
 }
 
 Instruction *emit_instruction(ProgramBuilder* pb, OpCode opcode, usize count, Operand first, ...) {
+    if (pb->flat) {
+        encode_opcode(pb, opcode);
+        encode_operand(pb, first);
+
+        va_list args;
+        va_start(args, first);
+        for (int i = 0; i < ((int) count)-1; i++) {
+            encode_operand(pb, va_arg(args, Operand));
+        }
+        va_end(args);
+        return NULL;
+    }
+
     // Take the opcode and the operands, and create an instruction.
     // Then insert the instruction into the instruction array.
     Instruction instruction = {0};
@@ -330,6 +598,14 @@ Instruction *emit_instruction(ProgramBuilder* pb, OpCode opcode, usize count, Op
 }
 
 Instruction *emit_instruction_with_operands(ProgramBuilder* pb, OpCode opcode, Operand *byte_operands, usize operands_count) {
+    if (pb->flat) {
+        encode_opcode(pb, opcode);
+        for (usize i = 0; i < operands_count; i++) {
+            encode_operand(pb, byte_operands[i]);
+        }
+        return NULL;
+    }
+
     // Take the opcode and the operands, and create an instruction.
     // Then insert the instruction into the instruction array.
     Instruction instruction = {0};
@@ -356,18 +632,39 @@ void emit_push(ProgramBuilder *builder, u64 value) {
 }
 
 void emit_push_label(ProgramBuilder *builder, u64 label) {
+    emit_label_instruction(builder, PSH, label);
+}
+
+void emit_label_instruction(ProgramBuilder *builder, OpCode opcode, u64 label) {
+    if (builder->flat) {
+        encode_opcode(builder, opcode);
+        encode_label_operand(builder, label);
+        return;
+    }
+
     Operand label_operand = {0};
     label_operand.type = OPERAND_U64;
     label_operand.as.u64 = label;
-    Instruction *inst = emit_instruction(builder, PSH, 0, label_operand);
+    Instruction *inst = emit_instruction(builder, opcode, 0, label_operand);
     inst->operand_is_label = true;
 }
 
 void emit_str(ProgramBuilder *builder, char *str) {
     // Pad the end of the string so that it doesn't include garbage memory when copying to the operands array
     usize len = strlen(str);
+
+    if (builder->flat) {
+        encode_opcode(builder, STR);
+        u64 length = len;
+        memcpy(reserve_bytes(builder, sizeof(u64)), &length, sizeof(u64));
+        memcpy(reserve_bytes(builder, len), str, len);
+        return;
+    }
     
-    Operand operands[1 + len];
+    Operand *operands = malloc((1 + len) * sizeof(Operand));
+    if (operands == NULL) {
+        ERROR("Could not allocate the operands of a string of %zu bytes\n", len);
+    }
     operands[0].type = OPERAND_U64;
     operands[0].as.u64 = len;
 
@@ -379,6 +676,7 @@ void emit_str(ProgramBuilder *builder, char *str) {
     Operand *first = operands;
 
     emit_instruction_with_operands(builder, STR, first, len + 1);
+    free(operands);
 }
 
 void emit_sized_instruction(ProgramBuilder *builder, OpCode opcode, u64 value) {
@@ -389,26 +687,43 @@ void emit_sized_instruction(ProgramBuilder *builder, OpCode opcode, u64 value) {
 }
 
 void emit_jump(ProgramBuilder* builder, LABEL_T target) {
-    emit_push_label(builder, target); // target is the label index
-
-    emit_plain_instruction(builder, JMP);
+    emit_label_instruction(builder, JMPI, target); // target is the label index
 }
 
 void emit_jump_if_true(ProgramBuilder* builder, LABEL_T target) {
-    emit_push_label(builder, target);
-    emit_plain_instruction(builder, JPT);
+    emit_label_instruction(builder, JPTI, target);
 }
 
 void emit_jump_if_false(ProgramBuilder* builder, LABEL_T target) {
-    emit_push_label(builder, target);
-    emit_plain_instruction(builder, JPF);
+    emit_label_instruction(builder, JPFI, target);
 }
 
 // Labels
 LABEL_T create_label(ProgramBuilder* builder) {
+    if (builder->current_label == builder->labels_capacity) {
+        ASSERT(builder->labels_capacity < MAX_LABELS, "A program can't have more than %zu labels\n", MAX_LABELS);
+
+        usize capacity = builder->labels_capacity == 0 ? 64 : builder->labels_capacity * 2;
+        if (capacity > MAX_LABELS) {
+            capacity = MAX_LABELS;
+        }
+        builder->labels = realloc(builder->labels, capacity * sizeof(usize));
+        if (builder->labels == NULL) {
+            ERROR("Could not grow the label table to %zu labels\n", capacity);
+        }
+        builder->labels_capacity = capacity;
+    }
+
+    builder->labels[builder->current_label] = UNLINKED_LABEL;
     return builder->current_label++;
 }
 
 void link_label(ProgramBuilder* builder, LABEL_T addr) {
-    builder->labels[addr] = builder->instructions.count;
+    usize position = builder->flat ? builder->bytes_count : builder->instructions.count;
+    builder->labels[addr] = position;
+    builder->last_linked_index = position;
+}
+
+bool label_is_linked(ProgramBuilder* builder, LABEL_T label) {
+    return label < builder->current_label && builder->labels[label] != UNLINKED_LABEL;
 }
@@ -0,0 +1,164 @@
+#include "sampler.h"
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+// Room for a few hundred thousand samples. Only the part that's written gets touched.
+#define SAMPLER_RECORDS (4 * 1024 * 1024)
+
+void init_sampler(Sampler *sampler, usize interval) {
+    memset(sampler, 0, sizeof(Sampler));
+    sampler->interval = interval > 0 ? interval : DEFAULT_SAMPLE_INTERVAL;
+    sampler->capacity = SAMPLER_RECORDS;
+    sampler->records = malloc(sampler->capacity * sizeof(u64));
+    ASSERT(sampler->records != NULL, "Could not allocate the samples\n");
+}
+
+void free_sampler(Sampler *sampler) {
+    free(sampler->records);
+    sampler->records = NULL;
+    sampler->capacity = 0;
+}
+
+// Set for the duration of run_sampled(), before the timer starts
+static VM *volatile sampled_vm = NULL;
+static Sampler *volatile active_sampler = NULL;
+
+// Only copies numbers out of the VM: nothing here allocates or locks
+static void take_sample(int signal) {
+    (void) signal;
+    VM *vm = sampled_vm;
+    Sampler *sampler = active_sampler;
+    if (vm == NULL || sampler == NULL) { return; }
+
+    // The first frame is the one reset_vm() pushes, not a call
+    CallStack *call_stack = &vm->call_stack;
+    usize calls = call_stack->sp > 0 ? call_stack->sp - 1 : 0;
+    usize frames = calls < SAMPLER_MAX_DEPTH ? calls : SAMPLER_MAX_DEPTH;
+    usize first = call_stack->sp - frames;
+
+    usize needed = 3 + 2 * frames;
+    if (sampler->capacity - sampler->used < needed) {
+        sampler->dropped++;
+        return;
+    }
+
+    u64 *record = &sampler->records[sampler->used];
+    record[0] = vm->pc;
+    record[1] = frames;
+    record[2] = frames < calls;
+    for (usize i = 0; i < frames; i++) {
+        StackFrame *frame = &call_stack->storage[first + i];
+        record[3 + 2 * i] = frame->callee;
+        record[4 + 2 * i] = frame->caller_site;
+    }
+
+    sampler->used += needed;
+    sampler->samples++;
+}
+
+static void run_switch_engine(VM *vm, void *context) {
+    (void) context;
+    run_switch(vm);
+}
+
+void run_sampled(VM *vm, Sampler *sampler) {
+    sampled_vm = vm;
+    active_sampler = sampler;
+
+    struct sigaction action = {0};
+    struct sigaction previous;
+    action.sa_handler = take_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previous);
+
+    struct itimerval timer = {0};
+    timer.it_interval.tv_sec = (time_t) (sampler->interval / 1000000);
+    timer.it_interval.tv_usec = (suseconds_t) (sampler->interval % 1000000);
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    run_trapping_faults(vm, run_switch_engine, NULL);
+
+    struct itimerval stopped = {0};
+    setitimer(ITIMER_PROF, &stopped, NULL);
+    sigaction(SIGPROF, &previous, NULL);
+
+    sampled_vm = NULL;
+    active_sampler = NULL;
+}
+
+static void append_label(StringBuffer *stack, const DebugInfo *info, u64 address) {
+    const char *name = find_debug_label(info, address);
+    if (name != NULL) {
+        append_string_buffer(stack, (char *) name);
+    } else {
+        char hex[24];
+        snprintf(hex, sizeof(hex), "0x%llx", address);
+        append_string_buffer(stack, hex);
+    }
+}
+
+static int compare_stack_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+void write_folded_stacks(Sampler *sampler, const DebugInfo *info, FILE *file) {
+    // Samples with the same stack are added up under its name
+    SymbolTable stacks;
+    init_symbol_table(&stacks);
+    StringBuffer stack = create_string_buffer(256);
+
+    for (usize position = 0; position < sampler->used;) {
+        const u64 *record = &sampler->records[position];
+        u64 pc = record[0];
+        usize frames = record[1];
+        bool truncated = record[2];
+        position += 3 + 2 * frames;
+
+        stack.count = 0;
+        if (truncated) {
+            append_string_buffer(&stack, "...;");
+        } else {
+            // Where the outermost call was made from, or where the program is now
+            u64 root = frames > 0 ? record[4] - 1 : pc;
+            append_label(&stack, info, root);
+            append_char_string_buffer(&stack, ';');
+        }
+        for (usize i = 0; i < frames; i++) {
+            append_label(&stack, info, record[3 + 2 * i]);
+            append_char_string_buffer(&stack, ';');
+        }
+
+        const LineEntry *line = find_debug_line(info, pc);
+        char location[32];
+        snprintf(location, sizeof(location), ":%u", line != NULL ? line->line : 0);
+        append_string_buffer(&stack, (char *) (info->file != NULL ? info->file : "?"));
+        append_string_buffer(&stack, location);
+
+        bool existed;
+        Symbol *symbol = intern_symbol(&stacks, stack.str, stack.count, 0, &existed);
+        symbol->value++;
+    }
+
+    // Sorted, so the same run always gives the same file
+    const char **names = malloc((stacks.count + 1) * sizeof(char *));
+    ASSERT(names != NULL, "Could not allocate the folded stacks\n");
+
+    usize count = 0;
+    for (usize i = 0; i < stacks.capacity; i++) {
+        if (stacks.slots[i].hash != 0) {
+            names[count++] = symbol_name(&stacks, &stacks.slots[i]);
+        }
+    }
+    qsort(names, count, sizeof(char *), compare_stack_names);
+    for (usize i = 0; i < count; i++) {
+        Symbol *symbol = find_symbol(&stacks, names[i], strlen(names[i]));
+        fprintf(file, "%s %llu\n", names[i], symbol->value);
+    }
+
+    free(names);
+    free_string_buffer(&stack);
+    free_symbol_table(&stacks);
+}
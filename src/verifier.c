@@ -0,0 +1,400 @@
+#include "verifier.h"
+#include "opcodes.h"
+#include "vm.h"
+#include <string.h>
+
+#define UNVISITED ((usize) -1)
+#define NO_FUNCTION ((usize) -1)
+
+// The u64s on top of the stack that are known constants, top first.
+// Enough to follow `PSH 'target JMP` and `PSH 2 PSH 8 MUL TKS`.
+typedef struct {
+    u8 count;
+    u64 values[2];
+} Constants;
+
+static const Constants NO_CONSTANTS = {0};
+
+typedef struct {
+    usize depth;    // Bytes above the frame start before running it, UNVISITED until reached
+    usize function;
+    usize args;     // Bytes the frame took from its caller with TKS
+    Constants constants;
+} InstructionState;
+
+typedef struct {
+    usize entry;
+    usize return_depth; // UNVISITED until a RET is reached
+    usize args;
+} FunctionSummary;
+
+// A call whose callee hasn't been seen returning yet
+typedef struct {
+    usize address;
+    usize callee;
+    usize caller;
+    usize caller_args;
+    usize depth; // Caller depth once the target is popped
+} PendingCall;
+
+typedef struct {
+    Program *program;
+    Verification *result;
+
+    bool *boundary;
+    InstructionState *states;
+    usize *function_at; // Entry address -> function index
+
+    usize *worklist;
+    usize worklist_count;
+    bool *queued;
+
+    FunctionSummary *functions;
+    usize functions_count;
+    usize functions_capacity;
+
+    PendingCall *pending;
+    usize pending_count;
+    usize pending_capacity;
+} Verifier;
+
+static bool fail(Verifier *v, usize address, const char *reason) {
+    v->result->ok = false;
+    v->result->failed_at = address;
+    v->result->reason = reason;
+    return false;
+}
+
+static u64 read_operand(Program *program, usize address) {
+    u64 value;
+    memcpy(&value, &program->code[address + 1], sizeof(u64));
+    return value;
+}
+
+static usize instruction_length(Program *program, usize address) {
+    OpCode op = program->code[address];
+    usize length = 1 + opcode_immediate_size(op);
+    if (op == STR) {
+        length += read_operand(program, address);
+    }
+
+    return length;
+}
+
+static bool find_boundaries(Verifier *v) {
+    Program *program = v->program;
+    usize pc = 0;
+    while (pc < program->size) {
+        OpCode op = program->code[pc];
+        if (opcode_to_str(op) == NULL) {
+            return fail(v, pc, "invalid opcode");
+        }
+
+        usize length = 1 + opcode_immediate_size(op);
+        if (length > program->size - pc) {
+            return fail(v, pc, "truncated instruction");
+        }
+        if (op == STR && read_operand(program, pc) > program->size - pc - length) {
+            return fail(v, pc, "string runs past the end of the program");
+        }
+
+        v->boundary[pc] = true;
+        pc += instruction_length(program, pc);
+    }
+
+    // Jumping to the end of the program halts it
+    v->boundary[program->size] = true;
+    return true;
+}
+
+static void enqueue(Verifier *v, usize address) {
+    if (v->queued[address]) { return; }
+
+    v->queued[address] = true;
+    v->worklist[v->worklist_count++] = address;
+}
+
+// Propagates a state to an instruction, checking it against whatever reached it before
+static bool reach(Verifier *v, usize address, usize depth, usize function, usize args, Constants constants) {
+    if (address > v->program->size || !v->boundary[address]) {
+        return fail(v, address, "jump target is not an instruction boundary");
+    }
+    if (address == v->program->size) { return true; }
+
+    InstructionState *state = &v->states[address];
+    if (state->depth == UNVISITED) {
+        state->depth = depth;
+        state->function = function;
+        state->args = args;
+        state->constants = constants;
+        enqueue(v, address);
+        return true;
+    }
+
+    if (state->depth != depth) {
+        return fail(v, address, "reached with different stack depths");
+    }
+    if (state->function != function) {
+        return fail(v, address, "reached from more than one function");
+    }
+    if (state->args != args) {
+        return fail(v, address, "reached with different frame arguments");
+    }
+    // Only the constants every path agrees on are kept
+    u8 common = 0;
+    while (common < state->constants.count && common < constants.count &&
+           state->constants.values[common] == constants.values[common]) {
+        common++;
+    }
+    if (common < state->constants.count) {
+        state->constants.count = common;
+        enqueue(v, address);
+    }
+
+    return true;
+}
+
+static usize function_for_entry(Verifier *v, usize entry) {
+    if (v->function_at[entry] != NO_FUNCTION) {
+        return v->function_at[entry];
+    }
+
+    if (v->functions_count == v->functions_capacity) {
+        v->functions_capacity = v->functions_capacity == 0 ? 8 : v->functions_capacity * 2;
+        v->functions = realloc(v->functions, v->functions_capacity * sizeof(FunctionSummary));
+        if (v->functions == NULL) {
+            ERROR("Could not grow the verifier function list\n");
+        }
+    }
+
+    usize index = v->functions_count++;
+    v->functions[index].entry = entry;
+    v->functions[index].return_depth = UNVISITED;
+    v->functions[index].args = 0;
+    v->function_at[entry] = index;
+
+    return index;
+}
+
+static void add_pending_call(Verifier *v, PendingCall call) {
+    if (v->pending_count == v->pending_capacity) {
+        v->pending_capacity = v->pending_capacity == 0 ? 8 : v->pending_capacity * 2;
+        v->pending = realloc(v->pending, v->pending_capacity * sizeof(PendingCall));
+        if (v->pending == NULL) {
+            ERROR("Could not grow the verifier call list\n");
+        }
+    }
+
+    v->pending[v->pending_count++] = call;
+}
+
+// The callee took `args` bytes from the caller's stack, and RET doesn't restore sp,
+// so whatever the callee leaves stays on the caller's stack.
+static bool resume_after_call(Verifier *v, PendingCall call) {
+    FunctionSummary *callee = &v->functions[call.callee];
+    if (call.depth < callee->args) {
+        return fail(v, call.address, "callee takes more arguments than the caller has");
+    }
+
+    usize return_address = call.address + instruction_length(v->program, call.address);
+    usize depth = call.depth - callee->args + callee->return_depth;
+    return reach(v, return_address, depth, call.caller, call.caller_args, NO_CONSTANTS);
+}
+
+static bool verify_call(Verifier *v, usize address, usize target, InstructionState *state, usize depth) {
+    if (target >= v->program->size || !v->boundary[target]) {
+        return fail(v, address, "call target is not an instruction boundary");
+    }
+
+    usize callee = function_for_entry(v, target);
+    if (!reach(v, target, 0, callee, 0, NO_CONSTANTS)) { return false; }
+
+    PendingCall call = {
+        .address = address,
+        .callee = callee,
+        .caller = state->function,
+        .caller_args = state->args,
+        .depth = depth
+    };
+    if (v->functions[callee].return_depth != UNVISITED) {
+        return resume_after_call(v, call);
+    }
+
+    add_pending_call(v, call);
+    return true;
+}
+
+static bool verify_return(Verifier *v, usize address, InstructionState *state) {
+    if (state->function == 0) {
+        return fail(v, address, "RET outside of a function");
+    }
+
+    FunctionSummary *summary = &v->functions[state->function];
+    if (summary->return_depth != UNVISITED) {
+        if (summary->return_depth != state->depth || summary->args != state->args) {
+            return fail(v, address, "function returns with different stack depths");
+        }
+        return true;
+    }
+
+    summary->return_depth = state->depth;
+    summary->args = state->args;
+
+    // The calls waiting on this function can continue now
+    for (usize i = 0; i < v->pending_count;) {
+        PendingCall call = v->pending[i];
+        if (call.callee != state->function) {
+            i++;
+            continue;
+        }
+
+        v->pending[i] = v->pending[--v->pending_count];
+        if (!resume_after_call(v, call)) { return false; }
+    }
+
+    return true;
+}
+
+// `PSH n TKS` right at the start of a function moves its frame start n bytes down
+static bool verify_take_args(Verifier *v, usize address, InstructionState *state, usize next) {
+    if (state->constants.count == 0) {
+        return fail(v, address, "TKS size is not a constant");
+    }
+    if (state->depth != sizeof(u64) || state->args != 0) {
+        return fail(v, address, "TKS is not at the start of the function");
+    }
+
+    usize args = state->constants.values[0];
+    if (args >= MAX_STACK_SIZE) {
+        return fail(v, address, "TKS takes more than the whole stack");
+    }
+
+    return reach(v, next, args, state->function, args, NO_CONSTANTS);
+}
+
+static bool verify_instruction(Verifier *v, usize address) {
+    Program *program = v->program;
+    InstructionState state = v->states[address];
+    OpCode op = program->code[address];
+    usize next = address + instruction_length(program, address);
+
+    if (op == TKS) {
+        return verify_take_args(v, address, &state, next);
+    }
+
+    StackEffect effect = opcode_stack_effect(op);
+    if (effect.variable) {
+        return fail(v, address, "stack effect is not known statically");
+    }
+    if (state.depth < effect.pops) {
+        return fail(v, address, "pops below the start of the frame");
+    }
+
+    usize depth = state.depth - effect.pops + effect.pushes;
+    if (depth >= MAX_STACK_SIZE) {
+        return fail(v, address, "stack grows past MAX_STACK_SIZE");
+    }
+    if (depth > v->result->max_depth) {
+        v->result->max_depth = depth;
+    }
+
+    usize function = state.function;
+    usize args = state.args;
+
+    switch (op) {
+        case EXT: return true;
+        case RET: return verify_return(v, address, &state);
+        case JMPI: {
+            return reach(v, read_operand(program, address), depth, function, args, NO_CONSTANTS);
+        }
+        case JPTI: case JPFI: {
+            return reach(v, read_operand(program, address), depth, function, args, NO_CONSTANTS) &&
+                reach(v, next, depth, function, args, NO_CONSTANTS);
+        }
+        case JMP: case JPT: case JPF: case CLL: {
+            if (state.constants.count == 0) {
+                return fail(v, address, "jump target is not a constant");
+            }
+
+            if (op == CLL) {
+                return verify_call(v, address, state.constants.values[0], &state, depth);
+            }
+            if (!reach(v, state.constants.values[0], depth, function, args, NO_CONSTANTS)) { return false; }
+            if (op == JMP) { return true; }
+
+            return reach(v, next, depth, function, args, NO_CONSTANTS);
+        }
+        case PSH: {
+            Constants constants = {
+                .count = state.constants.count > 0 ? 2 : 1,
+                .values = { read_operand(program, address), state.constants.values[0] }
+            };
+            return reach(v, next, depth, function, args, constants);
+        }
+        case ADD: case SUB: case MUL: {
+            Constants constants = NO_CONSTANTS;
+            if (state.constants.count == 2) {
+                u64 a = state.constants.values[0];
+                u64 b = state.constants.values[1];
+                constants.count = 1;
+                constants.values[0] = op == ADD ? b + a : op == SUB ? b - a : b * a;
+            }
+            return reach(v, next, depth, function, args, constants);
+        }
+        default: {
+            return reach(v, next, depth, function, args, NO_CONSTANTS);
+        }
+    }
+}
+
+bool verify_program(Program *program, Verification *result) {
+    memset(result, 0, sizeof(Verification));
+    result->ok = true;
+
+    usize size = program->size;
+    Verifier v = {0};
+    v.program = program;
+    v.result = result;
+    v.boundary = calloc(size + 1, sizeof(bool));
+    v.queued = calloc(size + 1, sizeof(bool));
+    v.states = malloc((size + 1) * sizeof(InstructionState));
+    v.function_at = malloc((size + 1) * sizeof(usize));
+    v.worklist = malloc((size + 1) * sizeof(usize));
+    if (v.boundary == NULL || v.queued == NULL || v.states == NULL || v.function_at == NULL || v.worklist == NULL) {
+        ERROR("Could not allocate the memory for the verifier\n");
+    }
+    for (usize i = 0; i <= size; i++) {
+        v.states[i].depth = UNVISITED;
+        v.function_at[i] = NO_FUNCTION;
+    }
+
+    bool ok = find_boundaries(&v);
+    if (ok && program->entry < size) {
+        // The global code runs in the frame init_vm pushes, starting with an empty stack
+        usize global = function_for_entry(&v, program->entry);
+        ok = reach(&v, program->entry, 0, global, 0, NO_CONSTANTS);
+    }
+
+    while (ok && v.worklist_count > 0) {
+        usize address = v.worklist[--v.worklist_count];
+        v.queued[address] = false;
+        ok = verify_instruction(&v, address);
+    }
+
+    result->functions = v.functions_count;
+    if (ok) {
+        LOG("Verified %zu functions, max frame depth %zu bytes\n", result->functions, result->max_depth);
+    } else {
+        LOG("Verification failed at 0x%zx: %s\n", result->failed_at, result->reason);
+    }
+
+    free(v.boundary);
+    free(v.queued);
+    free(v.states);
+    free(v.function_at);
+    free(v.worklist);
+    free(v.functions);
+    free(v.pending);
+
+    return ok;
+}
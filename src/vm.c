@@ -1,9 +1,42 @@
 #include "vm.h"
 #include "opcodes.h"
+#include "jit.h"
+#include "verifier.h"
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static usize page_size(void) {
+    return (usize) sysconf(_SC_PAGESIZE);
+}
+
+static usize round_to_pages(usize size) {
+    usize page = page_size();
+    return (size + page - 1) / page * page;
+}
+
+// Backs more of the reserved call stack with memory
+static void grow_call_stack(CallStack *st) {
+    ASSERT(st->capacity < st->max_capacity, "Max call stack size exceeded.\n");
+
+    usize capacity = st->capacity * 2;
+    if (capacity > st->max_capacity) {
+        capacity = st->max_capacity;
+    }
+
+    usize size = round_to_pages(capacity * sizeof(StackFrame));
+    ASSERT(mprotect(st->storage, size, PROT_READ | PROT_WRITE) == 0, "Could not grow the call stack\n");
+
+    VERBOSE_LOG("Call stack grew to %zu frames\n", capacity);
+    st->capacity = capacity;
+}
 
 void push_to_call_stack(CallStack *st, StackFrame frame) {
-    ASSERT(st->sp < MAX_CALLSTACK_SIZE, "Max call stack size exceeded.\n");
+    // TKS looks at the frame above the top too, so that one has to be backed as well
+    if (st->sp + 1 >= st->capacity) {
+        grow_call_stack(st);
+    }
 
     st->storage[st->sp++] = frame;
 }
@@ -21,13 +54,13 @@ StackFrame *current_stack_frame(CallStack *st) {
 }
 
 void push_to_stack(Stack* st, u8 value) {
-    ASSERT(st->sp < MAX_STACK_SIZE, "Max stack size exceeded.\n");
+    ASSERT(st->sp < st->capacity, "Max stack size exceeded.\n");
 
     st->storage[st->sp++] = value;
 }
 
 void push_n_to_stack(Stack* st, usize n, u8* values) {
-    ASSERT((st->sp + n) <= MAX_STACK_SIZE, "Max stack size exceeded.\n");
+    ASSERT((st->sp + n) <= st->capacity, "Max stack size exceeded.\n");
 
     u8 *dest = &st->storage[st->sp];
     memcpy(dest, values, n);
@@ -38,7 +71,7 @@ void push_n_to_stack(Stack* st, usize n, u8* values) {
 }
 
 void push_u64_to_stack(Stack* st, u64 value) {
-    ASSERT(st->sp + sizeof(u64) < MAX_STACK_SIZE, "Max stack size exceeded.\n");
+    ASSERT(st->sp + sizeof(u64) < st->capacity, "Max stack size exceeded.\n");
 
     memcpy(&st->storage[st->sp], &value, sizeof(u64));
     st->sp += sizeof(u64);
@@ -108,21 +141,334 @@ void debug_stack(Stack *stack) {
     printf("BOTTOM OF STACK\n");
 }
 
+static u64 read_u64_at(const u8 *code) {
+    u64 value;
+    memcpy(&value, code, sizeof(u64));
+    return value;
+}
+
 u64 get_next_u64_from_program(VM *vm) {
     u64 value;
-    memcpy(&value, &vm->program->code[vm->pc], sizeof(u64));
+    memcpy(&value, &vm->code[vm->pc], sizeof(u64));
     vm->pc += sizeof(u64);
     return value;
 }
 
 u64 get_next_u8_from_program(VM *vm) {
-    u8 value = vm->program->code[vm->pc++];
+    u8 value = vm->code[vm->pc++];
     return value;
 }
 
+#define DEFAULT_VM_CONFIG { \
+    .stack_size = MAX_STACK_SIZE, \
+    .call_stack_size = MAX_CALLSTACK_SIZE, \
+    .huge_pages = false, \
+    .heap_quota = 0, \
+    .memory = MEMORY_HOST, \
+    .memory_size = DEFAULT_MEMORY_SIZE, \
+    .output = { .kind = OUTPUT_FILE } \
+}
+
+// stdout isn't a constant expression, so the configs only get it here
+VMConfig default_vm_config(void) {
+    VMConfig config = DEFAULT_VM_CONFIG;
+    config.output.file = stdout;
+    return config;
+}
+
+static VMConfig vm_config = DEFAULT_VM_CONFIG;
+static bool vm_config_set = false;
+
+void set_vm_config(VMConfig config) {
+    vm_config = config;
+    vm_config_set = true;
+}
+
+static const VMConfig *current_vm_config(void) {
+    if (!vm_config_set) {
+        set_vm_config(default_vm_config());
+    }
+
+    return &vm_config;
+}
+
+// The VM running on this thread, for the fault handler to tell its guard pages apart
+static _Thread_local VM *running_vm = NULL;
+
+// A write past the stack lands on the guard page after it, and linear memory faults
+// the same way, from the loads and stores of the program. Nothing here is safe to
+// do from a signal handler besides recording it, so the handler jumps back to
+// run_trapping_faults() and the error is raised from there.
+static void stack_fault_handler(int signal, siginfo_t *info, void *context) {
+    (void) context;
+    VM *vm = running_vm;
+    u8 *address = info->si_addr;
+
+    VMFault fault = VM_FAULT_NONE;
+    if (vm != NULL && address >= vm->stack_mapping && address < vm->stack_mapping + vm->stack_mapping_size) {
+        fault = address >= vm->stack.storage ? VM_FAULT_STACK_OVERFLOW : VM_FAULT_FRAME_BOUNDS;
+    } else if (vm != NULL && address >= vm->memory.mapping && address < vm->memory.mapping + vm->memory.mapping_size) {
+        fault = VM_FAULT_MEMORY;
+        vm->fault_address = (u64) (address - vm->memory.base);
+    }
+
+    if (fault != VM_FAULT_NONE && vm->fault_jump != NULL) {
+        vm->fault = fault;
+        siglongjmp(*vm->fault_jump, 1);
+    }
+
+    // Not a guard page, or not while an engine runs: let the fault happen again without the handler
+    struct sigaction action = {0};
+    action.sa_handler = SIG_DFL;
+    sigaction(signal, &action, NULL);
+}
+
+void run_trapping_faults(VM *vm, void (*run)(VM *vm, void *context), void *context) {
+    sigjmp_buf jump;
+    sigjmp_buf *previous = vm->fault_jump;
+
+    // The signal mask is saved too, so SIGSEGV isn't left blocked after jumping out of the handler
+    if (sigsetjmp(jump, 1) != 0) {
+        vm->fault_jump = previous;
+        switch (vm->fault) {
+            case VM_FAULT_STACK_OVERFLOW: ERROR("Max stack size exceeded.\n");
+            case VM_FAULT_FRAME_BOUNDS: ERROR("Invalid access out of stack frame bounds.\n");
+            case VM_FAULT_MEMORY: ERROR("Out of bounds memory access at %#llx.\n", vm->fault_address);
+            case VM_FAULT_NONE: break;
+        }
+        ERROR("Unknown fault while running the VM\n");
+    }
+
+    vm->fault_jump = &jump;
+    vm->fault = VM_FAULT_NONE;
+    run(vm, context);
+    vm->fault_jump = previous;
+}
+
+static void install_stack_fault_handler(void) {
+    // Pool workers create their VMs at the same time
+    static _Atomic bool installed = false;
+    if (installed) { return; }
+
+    struct sigaction action = {0};
+    action.sa_sigaction = stack_fault_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    // macOS raises SIGBUS for protected pages
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+    installed = true;
+}
+
+static void advise_huge_pages(void *start, usize size) {
+#ifdef MADV_HUGEPAGE
+    madvise(start, size, MADV_HUGEPAGE);
+#else
+    (void) start;
+    (void) size;
+#endif
+}
+
+// [guard][STACK_PADDING + stack_size, rounded to pages][guard]
+// The storage is placed so that it ends right where the upper guard page starts.
+static void map_stack(VM *vm, const VMConfig *config) {
+    usize guard = page_size();
+    usize usable = round_to_pages(STACK_PADDING + config->stack_size);
+    usize size = guard + usable + guard;
+
+    u8 *mapping = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    ASSERT(mapping != MAP_FAILED, "Could not map %zu bytes for the stack\n", size);
+    ASSERT(mprotect(mapping + guard, usable, PROT_READ | PROT_WRITE) == 0, "Could not map the stack\n");
+    if (config->huge_pages) {
+        advise_huge_pages(mapping + guard, usable);
+    }
+
+    vm->stack_mapping = mapping;
+    vm->stack_mapping_size = size;
+    vm->stack.capacity = config->stack_size;
+    vm->stack.storage = mapping + guard + usable - config->stack_size;
+}
+
+// Reserves the address space for the whole call stack, but only backs the first frames
+static void map_call_stack(VM *vm, const VMConfig *config) {
+    usize max_capacity = config->call_stack_size;
+    ASSERT(max_capacity > 1, "The call stack needs room for more than one frame\n");
+
+    usize size = round_to_pages(max_capacity * sizeof(StackFrame));
+    u8 *mapping = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    ASSERT(mapping != MAP_FAILED, "Could not reserve %zu bytes for the call stack\n", size);
+    if (config->huge_pages) {
+        advise_huge_pages(mapping, size);
+    }
+
+    vm->call_stack_mapping = mapping;
+    vm->call_stack_mapping_size = size;
+    vm->call_stack.storage = (StackFrame *) mapping;
+    vm->call_stack.max_capacity = max_capacity;
+    vm->call_stack.capacity = INITIAL_CALLSTACK_SIZE / 2;
+    grow_call_stack(&vm->call_stack);
+}
+
+// [guard][4 GB, the first `memory_size` bytes backed][guard]
+// The guard below catches what FRE reads before a pointer, the one above the
+// u64 loads and stores at the last offsets.
+static void map_linear_memory(VM *vm, const VMConfig *config) {
+    LinearMemory *memory = &vm->memory;
+    memory->model = config->memory;
+
+    if (config->memory == MEMORY_HOST) {
+        memory->base = NULL;
+        memory->mask = (u64) -1;
+        memory->limit = (u64) -1;
+        memory->size = 0;
+        memory->mapping = NULL;
+        memory->mapping_size = 0;
+        return;
+    }
+
+    ASSERT(config->memory_size <= MAX_MEMORY_SIZE, "Linear memory can't be bigger than %zu bytes\n", MAX_MEMORY_SIZE);
+
+    usize guard = page_size();
+    usize usable = round_to_pages(config->memory_size);
+    usize size = guard + MAX_MEMORY_SIZE + guard;
+
+    u8 *mapping = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    ASSERT(mapping != MAP_FAILED, "Could not reserve %zu bytes for linear memory\n", size);
+    ASSERT(mprotect(mapping + guard, usable, PROT_READ | PROT_WRITE) == 0, "Could not map linear memory\n");
+    if (config->huge_pages) {
+        advise_huge_pages(mapping + guard, usable);
+    }
+
+    memory->mapping = mapping;
+    memory->mapping_size = size;
+    memory->base = mapping + guard;
+    memory->mask = (u32) -1;
+    memory->limit = usable;
+    memory->size = usable;
+    memory->huge_pages = config->huge_pages;
+    memory->used = false;
+}
+
+// The program goes at the start of linear memory, the heap gets the rest
+static void load_linear_memory(VM *vm, Program *program) {
+    LinearMemory *memory = &vm->memory;
+    if (memory->model == MEMORY_HOST) {
+        memory->code_address = program != NULL ? (u64) program->code : 0;
+        return;
+    }
+
+    // Nothing of the last run can be seen by the next one. Mapping fresh pages over the
+    // backed part only costs as much as the pages the last run touched.
+    if (memory->used) {
+        u8 *cleared = mmap(memory->base, memory->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        ASSERT(cleared == memory->base, "Could not clear linear memory\n");
+        if (memory->huge_pages) {
+            advise_huge_pages(memory->base, memory->size);
+        }
+    }
+    memory->used = program != NULL;
+
+    usize code_size = program != NULL ? (program->size + 15) & ~(usize) 15 : 0;
+    ASSERT(code_size <= memory->size, "The program doesn't fit in %zu bytes of linear memory\n", memory->size);
+    if (program != NULL) {
+        memcpy(memory->base, program->code, program->size);
+    }
+
+    memory->code_address = 0;
+    use_heap_region(&vm->heap, memory->base + code_size, memory->size - code_size);
+}
+
+void init_vm(VM *vm, Program *program) {
+    init_vm_with_config(vm, program, current_vm_config());
+}
+
+void init_vm_with_config(VM *vm, Program *program, const VMConfig *config) {
+    install_stack_fault_handler();
+    map_stack(vm, config);
+    map_call_stack(vm, config);
+    init_output_buffer(&vm->output, config->output);
+    init_vm_heap(&vm->heap, config->heap_quota);
+    map_linear_memory(vm, config);
+
+    reset_vm(vm, program);
+}
+
+// Gets what the running VM printed out before an error is reported
+static void flush_running_vm_output(void) {
+    if (running_vm != NULL) {
+        sync_output(&running_vm->output);
+    }
+}
+
+// Only the bytes the last run left on the stack are cleared, the rest of the
+// mappings stay as they are. Nothing above sp can be read before it's pushed.
+void reset_vm(VM *vm, Program *program) {
+    memset(vm->stack.storage - STACK_PADDING, 0, STACK_PADDING + vm->stack.sp);
+    vm->stack.sp = 0;
+    vm->call_stack.sp = 0;
+    memset(vm->registers, 0, sizeof(vm->registers));
+    memset(vm->strings, 0, sizeof(vm->strings));
+    vm->current_string = 0;
+    vm->output.count = 0;
+    reset_vm_heap(&vm->heap);
+    load_linear_memory(vm, program);
+    running_vm = vm;
+    before_error = flush_running_vm_output;
+    // A run that ended in an error can leave the jump of a frame that's gone
+    vm->fault_jump = NULL;
+
+    vm->pc = program != NULL ? program->entry : 0;
+    vm->program = program;
+    vm->code = program != NULL ? program->code : NULL;
+
+    StackFrame global_stack_frame = {
+        .caller_site = 0,
+        .callee = 0,
+        .stack_start = 0
+    };
+    push_to_call_stack(&vm->call_stack, global_stack_frame);
+}
+
+VM *create_vm(const VMConfig *config) {
+    VM *vm = aligned_alloc(_Alignof(VM), sizeof(VM));
+    ASSERT(vm != NULL, "Could not allocate a VM\n");
+    memset(vm, 0, sizeof(VM));
+
+    init_vm_with_config(vm, NULL, config != NULL ? config : current_vm_config());
+    return vm;
+}
+
+void free_vm(VM *vm) {
+    destroy_vm(vm);
+    free(vm);
+}
+
+const u8 *vm_stack_contents(VM *vm, usize *size) {
+    *size = vm->stack.sp;
+    return vm->stack.storage;
+}
+
+void set_vm_output(VM *vm, OutputSink sink) {
+    flush_output(&vm->output);
+    vm->output.sink = sink;
+}
+
 void destroy_vm(VM* vm) {
-    (void) vm;
-    // TODO: Free whatever needs to be freed
+    free_output_buffer(&vm->output);
+    free_vm_heap(&vm->heap);
+    if (running_vm == vm) {
+        running_vm = NULL;
+        before_error = NULL;
+    }
+
+    munmap(vm->stack_mapping, vm->stack_mapping_size);
+    munmap(vm->call_stack_mapping, vm->call_stack_mapping_size);
+    if (vm->memory.mapping != NULL) {
+        munmap(vm->memory.mapping, vm->memory.mapping_size);
+    }
+    vm->stack_mapping = NULL;
+    vm->call_stack_mapping = NULL;
+    vm->memory.mapping = NULL;
 }
 
 // Execution
@@ -136,12 +482,12 @@ void execute_byte(VM *vm, OpCode op) {
             VERBOSE_LOG("[%zx] Saving a string\n", vm->pc);
 
             u64 str_length = get_next_u64_from_program(vm);
-            char *str = (char*) &vm->program->code[vm->pc];
+            u64 str = vm->memory.code_address + vm->pc;
 
             // Increment the program counter by the length of the string
             vm->pc += str_length;
 
-            push_u64_to_stack(&vm->stack, (u64) str);
+            push_u64_to_stack(&vm->stack, str);
             push_u64_to_stack(&vm->stack, str_length);
             break;
         }
@@ -149,19 +495,16 @@ void execute_byte(VM *vm, OpCode op) {
             VERBOSE_LOG("[%zx] Printing string\n", vm->pc);
 
             u64 str_length = pop_u64_from_stack(vm);
-            const char *str = (const char*)pop_u64_from_stack(vm);
+            const char *str = (const char*) vm_address_range(vm, pop_u64_from_stack(vm), str_length);
             
-            // Since the string is not null terminated, we need to print it manually
-            for (usize i = 0; i < str_length; i++) {
-                putc(str[i], stdout);
-            }
+            write_output(&vm->output, str, str_length);
             break;
         }
         case PTC: {
             VERBOSE_LOG("[%zx] Printing char\n", vm->pc);
 
             u8 c = pop_from_stack(vm);
-            putc((int)c, stdout);
+            write_output_char(&vm->output, (char) c);
             break;
         }
         case ADD: {
@@ -291,6 +634,35 @@ void execute_byte(VM *vm, OpCode op) {
             }
             break;
         }
+        case JMPI: {
+            VERBOSE_LOG("[%zx] Jumping to an immediate\n", vm->pc);
+
+            u64 target = get_next_u64_from_program(vm);
+            vm->pc = (usize) target;
+            break;
+        }
+        case JPTI: {
+            VERBOSE_LOG("[%zx] Jumping to an immediate if true\n", vm->pc);
+
+            u64 target = get_next_u64_from_program(vm);
+
+            u8 condition = pop_from_stack(vm);
+            if (condition) {
+                vm->pc = (usize) target;
+            }
+            break;
+        }
+        case JPFI: {
+            VERBOSE_LOG("[%zx] Jumping to an immediate if false\n", vm->pc);
+
+            u64 target = get_next_u64_from_program(vm);
+
+            u8 condition = pop_from_stack(vm);
+            if (!condition) {
+                vm->pc = (usize) target;
+            }
+            break;
+        }
         case EQU: {
             VERBOSE_LOG("[%zx] Checking if equal\n", vm->pc);
 
@@ -322,6 +694,57 @@ void execute_byte(VM *vm, OpCode op) {
             push_to_stack(&vm->stack, result);
             break;
         }
+        case ADDI: {
+            VERBOSE_LOG("[%zx] Adding an immediate\n", vm->pc);
+
+            u64 a = get_next_u64_from_program(vm);
+            u64 b = pop_u64_from_stack(vm);
+            push_u64_to_stack(&vm->stack, b + a);
+            break;
+        }
+        case SUBI: {
+            VERBOSE_LOG("[%zx] Subtracting an immediate\n", vm->pc);
+
+            u64 a = get_next_u64_from_program(vm);
+            u64 b = pop_u64_from_stack(vm);
+            push_u64_to_stack(&vm->stack, b - a);
+            break;
+        }
+        case MODI: {
+            VERBOSE_LOG("[%zx] Modulo by an immediate\n", vm->pc);
+
+            u64 a = get_next_u64_from_program(vm);
+            u64 b = pop_u64_from_stack(vm);
+            push_u64_to_stack(&vm->stack, b % a);
+            break;
+        }
+        case EQUI: {
+            VERBOSE_LOG("[%zx] Checking if equal to an immediate\n", vm->pc);
+
+            u64 a = get_next_u64_from_program(vm);
+            u64 b = pop_u64_from_stack(vm);
+
+            push_to_stack(&vm->stack, (u8) a == b);
+            break;
+        }
+        case LTI: {
+            VERBOSE_LOG("[%zx] Checking if less than an immediate\n", vm->pc);
+
+            u64 a = get_next_u64_from_program(vm);
+            u64 b = pop_u64_from_stack(vm);
+
+            push_to_stack(&vm->stack, b < a);
+            break;
+        }
+        case GTI: {
+            VERBOSE_LOG("[%zx] Checking if greater than an immediate\n", vm->pc);
+
+            u64 a = get_next_u64_from_program(vm);
+            u64 b = pop_u64_from_stack(vm);
+
+            push_to_stack(&vm->stack, b > a);
+            break;
+        }
         case NOT: {
             VERBOSE_LOG("[%zx] Negating a value\n", vm->pc);
 
@@ -346,7 +769,7 @@ void execute_byte(VM *vm, OpCode op) {
         case REF: {
             VERBOSE_LOG("[%zx] Dereferencing a pointer\n", vm->pc);
             u64 ptr_num = pop_u64_from_stack(vm);
-            u64 value = *((u64*)ptr_num);
+            u64 value = *((u64*)vm_address(vm, ptr_num));
 
             push_u64_to_stack(&vm->stack, value);
             break;
@@ -354,20 +777,21 @@ void execute_byte(VM *vm, OpCode op) {
         case RF8: {
             VERBOSE_LOG("[%zx] Dereferencing a u8 pointer\n", vm->pc);
             u64 ptr_num = pop_u64_from_stack(vm);
-            u8 value = *((u64*)ptr_num);
+            u8 value = *((u64*)vm_address(vm, ptr_num));
 
             push_to_stack(&vm->stack, value);
             break;
         }
         case DBG: {
             u64 num = pop_u64_from_stack(vm);
-            printf("%llu", num);
+            write_output_u64(&vm->output, num);
             break;
         }
         case EXT: {
             VERBOSE_LOG("[%zx] Exiting\n", vm->pc);
 
             vm->pc = vm->program->size;
+            flush_output(&vm->output);
             break;
         }
         case INC: {
@@ -452,16 +876,16 @@ void execute_byte(VM *vm, OpCode op) {
             VERBOSE_LOG("[%zx] Allocating 64 bits on the stack\n", vm->pc);
 
             u64 size = pop_u64_from_stack(vm);
-            void *ptr = malloc(size);
+            void *ptr = heap_allocate(&vm->heap, size);
 
-            push_u64_to_stack(&vm->stack, (u64) ptr);
+            push_u64_to_stack(&vm->stack, vm_pointer(vm, ptr));
             break;
         }
         case WRT: {
             VERBOSE_LOG("[%zx] Writing to a pointer\n", vm->pc);
 
             u64 value = pop_u64_from_stack(vm);
-            u64 *ptr = (u64*)pop_u64_from_stack(vm);
+            u64 *ptr = (u64*)vm_address(vm, pop_u64_from_stack(vm));
 
             *ptr = value;
             break;
@@ -470,7 +894,7 @@ void execute_byte(VM *vm, OpCode op) {
             VERBOSE_LOG("[%zx] Freeing a pointer\n", vm->pc);
 
             u64 ptr = pop_u64_from_stack(vm);
-            free((void*)ptr);
+            heap_free(&vm->heap, vm_address(vm, ptr));
             break;
         }
         // FIXME: Is this fine? Does it defeat the purpose of a stack machine?
@@ -494,6 +918,7 @@ void execute_byte(VM *vm, OpCode op) {
         }
         case BKP: {
             VERBOSE_LOG("[%zx] Hit breakpoint\n", vm->pc);
+            sync_output(&vm->output);
 
             printf("The stack at this point:\n");
             debug_stack(&vm->stack);
@@ -531,7 +956,7 @@ void execute_byte(VM *vm, OpCode op) {
 
             u64 ptr = pop_u64_from_stack(vm);
 
-            memcpy((void*)ptr, value, n);
+            memcpy(vm_address_range(vm, ptr, n), value, n);
             break;
         }
         default: {
@@ -546,40 +971,479 @@ void execute_byte(VM *vm, OpCode op) {
     }
 }
 
-void execute(Program *program) {
-    VM vm = {0};
-    StackFrame global_stack_frame = {
-        .caller_site = 0,
-        .callee = 0,
-        .stack_start = 0
-    };
-    push_to_call_stack(&vm.call_stack, global_stack_frame);
-    vm.program = program;
+#define PROFILE_COUNTS 0
+#define PROFILE_CYCLES 0
+#define SWITCH_ENGINE_NAME switch_loop
+#include "switch_engine.h"
+#undef SWITCH_ENGINE_NAME
+
+#undef PROFILE_COUNTS
+#define PROFILE_COUNTS 1
+#define SWITCH_ENGINE_NAME switch_loop_counted
+#include "switch_engine.h"
+#undef SWITCH_ENGINE_NAME
+
+#undef PROFILE_CYCLES
+#define PROFILE_CYCLES 1
+#define SWITCH_ENGINE_NAME switch_loop_timed
+#include "switch_engine.h"
+#undef SWITCH_ENGINE_NAME
+#undef PROFILE_COUNTS
+#undef PROFILE_CYCLES
+
+void run_switch(VM *vm) {
+    switch_loop(vm, NULL);
+}
+
+static void run_profiled_loop(VM *vm, void *context) {
+    VMProfile *profile = context;
+    if (profile->timed) {
+        switch_loop_timed(vm, profile);
+    } else {
+        switch_loop_counted(vm, profile);
+    }
+}
+
+void run_switch_profiled(VM *vm, VMProfile *profile) {
+    run_trapping_faults(vm, run_profiled_loop, profile);
+}
+
+// Empty call stacks have no frame to pop values from.
+// Past any stack size, but far enough from overflowing when a pop size is added to it.
+#define NO_FRAME_START ((usize) -1 / 2)
+usize current_frame_start(CallStack *st) {
+    return st->sp > 0 ? st->storage[st->sp-1].stack_start : NO_FRAME_START;
+}
+
+#if THREADED_DISPATCH
+// Opcodes whose handlers only touch the stack. Both threaded engines expand
+// STACK_OPCODE_HANDLERS, so they always agree with each other.
+#define STACK_OPCODES \
+    X(NOP) X(PS8) \
+    X(ADD) X(SUB) X(MOD) X(DIV) X(MUL) \
+    X(EQU) X(LT)  X(GT)  X(NOT) X(OR)  \
+    X(INC) X(DEC) X(DUP) X(SWP) X(DRP) \
+    X(OVR) X(ROT) X(DBG) \
+    X(ADDI) X(SUBI) X(MODI) X(EQUI) X(LTI) X(GTI)
+
+// Opcodes with a handler inlined in the byte-stream threaded core. Everything else
+// in OPCODES is routed through execute_byte(), so both cores share the same semantics.
+#define THREADED_OPCODES \
+    STACK_OPCODES \
+    X(PSH) X(JMP) X(JPT) X(JPF) X(EXT) \
+    X(JMPI) X(JPTI) X(JPFI)
+
+// Opcodes with a handler inlined in the decoded core, besides the decoder superinstructions.
+#define DECODED_ENGINE_OPCODES \
+    STACK_OPCODES \
+    X(PSH) X(JMP) X(JPT) X(JPF) X(EXT) \
+    X(JMPI) X(JPTI) X(JPFI) \
+    X(STR) X(PTS) X(PTC) X(CLL) X(RET)
+
+// Labels-as-values are a GNU extension, which -Wpedantic complains about.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#if defined(__clang__)
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#endif
+
+// Stack access for engines that keep `sp`, `storage` and `frame_start` in locals.
+// The top 8 bytes of the stack always live in `tos`, so a push is one store and a
+// pop is one load. Memory only holds the bytes below them: `tos_home[sp]` is where
+// `tos` goes when it's flushed, which reaches into STACK_PADDING when sp < 8.
+// Bytes are pushed and popped by shifting them in and out of `tos`.
+// Pushes don't check sp: once it's past the capacity, the next flush of `tos`
+// writes into the guard page after the stack.
+// Engines over verified programs define CHECK_FRAMES to 0 to drop the frame bounds checks.
+#define CHECK_FRAMES 1
+#define FRAME_CHECK(condition) do { \
+    if (CHECK_FRAMES) { ASSERT(condition, "Invalid access out of stack frame bounds.\n"); } \
+} while(0)
+
+#define FLUSH_TOS() memcpy(&tos_home[sp], &tos, sizeof(u64))
+#define RELOAD_TOS() memcpy(&tos, &tos_home[sp], sizeof(u64))
+
+#define POP_U64(dst) do { \
+    FRAME_CHECK(sp >= frame_start + sizeof(u64)); \
+    (dst) = tos; \
+    sp -= sizeof(u64); \
+    RELOAD_TOS(); \
+} while(0)
+
+#define POP_U8(dst) do { \
+    FRAME_CHECK(sp > frame_start); \
+    (dst) = (u8) (tos >> 56); \
+    sp--; \
+    tos = (tos << 8) | tos_home[sp]; \
+} while(0)
+
+#define PUSH_U64(value) do { \
+    u64 pushed_ = (value); \
+    FLUSH_TOS(); \
+    sp += sizeof(u64); \
+    tos = pushed_; \
+} while(0)
+
+#define PUSH_U8(value) do { \
+    u8 pushed_ = (value); \
+    tos_home[sp] = (u8) tos; \
+    sp++; \
+    tos = (tos >> 8) | ((u64) pushed_ << 56); \
+} while(0)
+
+// Replaces the u64 on top of the stack (`b`) without moving sp
+#define UPDATE_U64(expr) do { \
+    FRAME_CHECK(sp >= frame_start + sizeof(u64)); \
+    u64 b = tos; \
+    tos = (expr); \
+    DISPATCH(); \
+} while(0)
+
+#define COMPARE_IMMEDIATE_U64(expr) do { \
+    u64 a = OPERAND_U64; \
+    u64 b; \
+    POP_U64(b); \
+    PUSH_U8(expr); \
+    DISPATCH(); \
+} while(0)
+
+#define BINARY_U64(expr) do { \
+    u64 a, b; \
+    POP_U64(a); \
+    POP_U64(b); \
+    PUSH_U64(expr); \
+    DISPATCH(); \
+} while(0)
+
+#define COMPARE_U64(expr) do { \
+    u64 a, b; \
+    POP_U64(a); \
+    POP_U64(b); \
+    PUSH_U8(expr); \
+    DISPATCH(); \
+} while(0)
+
+// OPERAND_U8 and OPERAND_U64 are how each engine reads the immediates.
+#define STACK_OPCODE_HANDLERS \
+    op_NOP: DISPATCH(); \
+    op_PS8: { \
+        PUSH_U8(OPERAND_U8); \
+        DISPATCH(); \
+    } \
+    op_ADD: BINARY_U64(b + a); \
+    op_SUB: BINARY_U64(b - a); \
+    op_MOD: BINARY_U64(b % a); \
+    op_DIV: BINARY_U64(b / a); \
+    op_MUL: BINARY_U64(b * a); \
+    op_EQU: COMPARE_U64((u8) a == b); \
+    op_LT: COMPARE_U64(b < a); \
+    op_GT: COMPARE_U64(b > a); \
+    op_NOT: { \
+        u8 a; \
+        POP_U8(a); \
+        PUSH_U8(!a); \
+        DISPATCH(); \
+    } \
+    op_OR: { \
+        u8 a, b; \
+        POP_U8(a); \
+        POP_U8(b); \
+        PUSH_U8(a || b); \
+        DISPATCH(); \
+    } \
+    op_INC: UPDATE_U64(b + 1); \
+    op_DEC: UPDATE_U64(b - 1); \
+    op_ADDI: UPDATE_U64(b + OPERAND_U64); \
+    op_SUBI: UPDATE_U64(b - OPERAND_U64); \
+    op_MODI: UPDATE_U64(b % OPERAND_U64); \
+    op_EQUI: COMPARE_IMMEDIATE_U64((u8) a == b); \
+    op_LTI: COMPARE_IMMEDIATE_U64(b < a); \
+    op_GTI: COMPARE_IMMEDIATE_U64(b > a); \
+    op_DUP: { \
+        u64 value; \
+        POP_U64(value); \
+        PUSH_U64(value); \
+        PUSH_U64(value); \
+        DISPATCH(); \
+    } \
+    op_SWP: { \
+        u64 a, b; \
+        POP_U64(a); \
+        POP_U64(b); \
+        PUSH_U64(a); \
+        PUSH_U64(b); \
+        DISPATCH(); \
+    } \
+    op_DRP: { \
+        u64 value; \
+        POP_U64(value); \
+        (void) value; \
+        DISPATCH(); \
+    } \
+    op_OVR: { \
+        u64 a, b; \
+        POP_U64(a); \
+        POP_U64(b); \
+        PUSH_U64(b); \
+        PUSH_U64(a); \
+        PUSH_U64(b); \
+        DISPATCH(); \
+    } \
+    op_ROT: { \
+        u64 a, b, c; \
+        POP_U64(a); \
+        POP_U64(b); \
+        POP_U64(c); \
+        PUSH_U64(b); \
+        PUSH_U64(a); \
+        PUSH_U64(c); \
+        DISPATCH(); \
+    } \
+    op_DBG: { \
+        u64 num; \
+        POP_U64(num); \
+        write_output_u64(&vm->output, num); \
+        DISPATCH(); \
+    }
+
+// Direct-threaded interpreter: pc, sp and the code pointer live in locals, and each
+// handler jumps straight to the next one instead of returning to a dispatch loop.
+// The VM struct is only synced when an opcode falls back to execute_byte().
+void run_threaded(VM *vm) {
+    Program *program = vm->program;
+
+    void *dispatch_table[256];
+    for (usize i = 0; i < 256; i++) {
+        dispatch_table[i] = &&op_invalid;
+    }
+    #define X(name, val) dispatch_table[name] = &&op_fallback;
+    OPCODES
+    #undef X
+    #define X(name) dispatch_table[name] = &&op_##name;
+    THREADED_OPCODES
+    #undef X
+
+    const u8 *code = program->code;
+    const usize size = program->size;
+    u8 *storage = vm->stack.storage;
+    usize pc = vm->pc;
+    usize sp = vm->stack.sp;
+    usize frame_start = current_frame_start(&vm->call_stack);
+    u8 *tos_home = storage - sizeof(u64);
+    u64 tos;
+    RELOAD_TOS();
+    u8 op = NOP;
+
+    #define DISPATCH() do { \
+        if (pc >= size) { goto done; } \
+        op = code[pc++]; \
+        goto *dispatch_table[op]; \
+    } while(0)
+    #define OPERAND_U8 code[pc++]
+    #define OPERAND_U64 (pc += sizeof(u64), read_u64_at(&code[pc - sizeof(u64)]))
+
+    DISPATCH();
+
+    STACK_OPCODE_HANDLERS
+
+    op_PSH: {
+        PUSH_U64(OPERAND_U64);
+        DISPATCH();
+    }
+    op_JMP: {
+        u64 target;
+        POP_U64(target);
+        pc = (usize) target;
+        DISPATCH();
+    }
+    op_JPT: {
+        u64 target;
+        u8 condition;
+        POP_U64(target);
+        POP_U8(condition);
+        if (condition) {
+            pc = (usize) target;
+        }
+        DISPATCH();
+    }
+    op_JPF: {
+        u64 target;
+        u8 condition;
+        POP_U64(target);
+        POP_U8(condition);
+        if (!condition) {
+            pc = (usize) target;
+        }
+        DISPATCH();
+    }
+    op_JMPI: {
+        pc = (usize) OPERAND_U64;
+        DISPATCH();
+    }
+    op_JPTI: {
+        u64 target = OPERAND_U64;
+        u8 condition;
+        POP_U8(condition);
+        if (condition) {
+            pc = (usize) target;
+        }
+        DISPATCH();
+    }
+    op_JPFI: {
+        u64 target = OPERAND_U64;
+        u8 condition;
+        POP_U8(condition);
+        if (!condition) {
+            pc = (usize) target;
+        }
+        DISPATCH();
+    }
+    op_EXT: goto done;
+
+    op_fallback: {
+        FLUSH_TOS();
+        vm->pc = pc;
+        vm->stack.sp = sp;
+
+        execute_byte(vm, op);
+
+        pc = vm->pc;
+        sp = vm->stack.sp;
+        RELOAD_TOS();
+        frame_start = current_frame_start(&vm->call_stack);
+        DISPATCH();
+    }
+    op_invalid: {
+        ERROR("Invalid opcode %#x\n", op);
+    }
+
+    #undef DISPATCH
+    #undef OPERAND_U8
+    #undef OPERAND_U64
+
+done:
+    FLUSH_TOS();
+    vm->pc = pc;
+    vm->stack.sp = sp;
+}
+
+#define DECODED_ENGINE_NAME run_decoded_program
+#include "decoded_engine.h"
+
+// A verified program can't pop below its frame, so those checks can go
+#undef CHECK_FRAMES
+#define CHECK_FRAMES 0
+#define DECODED_ENGINE_NAME run_decoded_program_unchecked
+#include "decoded_engine.h"
+
+#undef CHECK_FRAMES
+#undef FRAME_CHECK
+#undef FLUSH_TOS
+#undef RELOAD_TOS
+#undef POP_U64
+#undef POP_U8
+#undef PUSH_U64
+#undef PUSH_U8
+#undef UPDATE_U64
+#undef COMPARE_IMMEDIATE_U64
+#undef BINARY_U64
+#undef COMPARE_U64
+#undef STACK_OPCODE_HANDLERS
+#pragma GCC diagnostic pop
+#else
+void run_threaded(VM *vm) {
+    run_switch(vm);
+}
+
+void run_decoded_program(VM *vm, DecodedProgram *decoded) {
+    (void) decoded;
+    run_switch(vm);
+}
+
+void run_decoded_program_unchecked(VM *vm, DecodedProgram *decoded) {
+    (void) decoded;
+    run_switch(vm);
+}
+#endif // THREADED_DISPATCH
 
-    while (vm.pc < program->size) {
-        OpCode op = get_next_u8_from_program(&vm);
+// Programs that pass the verifier run without frame checks, the rest keep them
+void run_decoded(VM *vm) {
+    run_prepared_program(vm, prepared_for_vm(vm, ENGINE_DECODED), ENGINE_DECODED);
+}
 
-        execute_byte(&vm, op);
+static void run_engine(VM *vm, void *context) {
+    ExecutionEngine engine = *(ExecutionEngine *) context;
+
+    switch (engine) {
+        case ENGINE_SWITCH: {
+            run_switch(vm);
+            break;
+        }
+        case ENGINE_THREADED: {
+            run_threaded(vm);
+            break;
+        }
+        case ENGINE_DECODED: {
+            run_decoded(vm);
+            break;
+        }
+        case ENGINE_JIT: {
+            run_jit(vm);
+            break;
+        }
+        case ENGINE_DEBUG: {
+            debug_run(vm);
+            break;
+        }
     }
+}
+
+void run_vm(VM *vm, Program *program, ExecutionEngine engine) {
+    reset_vm(vm, program);
+    run_trapping_faults(vm, run_engine, &engine);
+    flush_output(&vm->output);
+}
 
+void execute_with_engine(Program *program, ExecutionEngine engine) {
+    VM vm = {0};
+    init_vm(&vm, program);
+    run_vm(&vm, program, engine);
     destroy_vm(&vm);
 }
 
+bool string_to_engine(ExecutionEngine *dst, char *str) {
+    if (strcmp(str, "switch") == 0) {
+        *dst = ENGINE_SWITCH;
+    } else if (strcmp(str, "threaded") == 0) {
+        *dst = ENGINE_THREADED;
+    } else if (strcmp(str, "decoded") == 0) {
+        *dst = ENGINE_DECODED;
+    } else if (strcmp(str, "jit") == 0) {
+        *dst = ENGINE_JIT;
+    } else if (strcmp(str, "debug") == 0) {
+        *dst = ENGINE_DEBUG;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+void execute(Program *program) {
+    execute_with_engine(program, DEFAULT_ENGINE);
+}
+
 void debug_execute(Program *program) {
-    VM vm = {0};
-    StackFrame global_stack_frame = {
-        .caller_site = 0,
-        .callee = 0,
-        .stack_start = 0
-    };
-    push_to_call_stack(&vm.call_stack, global_stack_frame);
-    vm.program = program;
+    execute_with_engine(program, ENGINE_DEBUG);
+}
 
-    while (vm.pc < program->size) {
-        usize inst_position = vm.pc;
-        OpCode op = get_next_u8_from_program(&vm);
+void debug_run(VM *vm) {
+    usize size = vm->program->size;
+    while (vm->pc < size) {
+        usize inst_position = vm->pc;
+        OpCode op = get_next_u8_from_program(vm);
 
-        execute_byte(&vm, op);
+        execute_byte(vm, op);
 
         if (op == BKP) {
             printf("Stopping at 0x%03zx\n", inst_position);
@@ -599,6 +1463,4 @@ void debug_execute(Program *program) {
             }
         }
     }
-
-    destroy_vm(&vm);
 }